@@ -0,0 +1,804 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Userspace benchmark of an osfs mount, run by `make bench`. Every workload
+ * prints one JSON object per line on stdout, so results of two module
+ * versions can be diffed or loaded by a script:
+ *   {"test":"seq_write","io_size":4096,"threads":1,"ops":...,"errors":0,
+ *    "bytes":...,"secs":...,"mib_s":...,"ops_s":...,"p50_us":...,
+ *    "p99_us":...,"max_us":...}
+ * The first line is a "meta" record naming the kernel and module version.
+ * Latencies are those of single system calls; throughput covers the whole
+ * workload, including the final fsync of writes. Progress and errors go to
+ * stderr.
+ *
+ * Usage: osfs_bench -d <dir> [-q] [-s file_size_mib] [-n files] [-t threads]
+ *                   [workload...]
+ * -q selects a quick profile for a smoke test on a small mount; -s, -n and -t
+ * override it wherever they appear.
+ * Without workloads, all of them run in the order of osfs_workloads.
+ */
+
+#define MIB (1024.0 * 1024.0)
+
+/**
+ * Struct: bench_config
+ * Description: Parameters of a run, set from the command line.
+ */
+struct bench_config {
+    const char *dir;                    // Directory on the mount the workloads run in
+    size_t file_size;                   // Size of the file of the read/write workloads
+    unsigned int nr_files;              // Files of the create/lookup/unlink storm
+    unsigned int threads;               // Threads of the multi-threaded writers
+    unsigned int fanout;                // Subdirectories per directory of the readdir tree
+    unsigned int depth;                 // Levels of subdirectories of the readdir tree
+    unsigned int files_per_dir;         // Files per directory of the readdir tree
+};
+
+/**
+ * Struct: bench_lat
+ * Description: Latencies of the calls of a workload, in nanoseconds.
+ */
+struct bench_lat {
+    uint64_t *ns;
+    size_t nr;                          // Latencies recorded
+    size_t cap;                         // Room in ns
+    size_t errors;                      // Calls that failed, not recorded
+};
+
+static const size_t io_sizes[] = { 4096, 65536, 1048576 };
+
+static void die(const char *what)
+{
+    fprintf(stderr, "osfs_bench: %s: %s\n", what, strerror(errno));
+    exit(1);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t xorshift64(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static void lat_init(struct bench_lat *lat, size_t cap)
+{
+    lat->ns = malloc((cap ? cap : 1) * sizeof(*lat->ns));
+    if (!lat->ns)
+        die("malloc");
+    lat->nr = 0;
+    lat->cap = cap;
+    lat->errors = 0;
+}
+
+static void lat_free(struct bench_lat *lat)
+{
+    free(lat->ns);
+}
+
+/**
+ * Function: lat_add
+ * Description: Records one call, started at start, that returned ok.
+ * Inputs:
+ *   - lat: The latencies of the workload.
+ *   - start: now_ns() taken before the call.
+ *   - ok: Whether the call succeeded.
+ * Returns:
+ *   - None.
+ */
+static void lat_add(struct bench_lat *lat, uint64_t start, int ok)
+{
+    uint64_t ns = now_ns() - start;
+
+    if (!ok) {
+        lat->errors++;
+        return;
+    }
+    if (lat->nr < lat->cap)
+        lat->ns[lat->nr++] = ns;
+}
+
+/**
+ * Function: lat_merge
+ * Description: Appends the latencies of a thread to those of the workload.
+ * Inputs:
+ *   - dst: The latencies of the workload, with room for those of src.
+ *   - src: The latencies of one thread.
+ * Returns:
+ *   - None.
+ */
+static void lat_merge(struct bench_lat *dst, const struct bench_lat *src)
+{
+    size_t nr = src->nr;
+
+    if (nr > dst->cap - dst->nr)
+        nr = dst->cap - dst->nr;
+    memcpy(dst->ns + dst->nr, src->ns, nr * sizeof(*src->ns));
+    dst->nr += nr;
+    dst->errors += src->errors;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Function: lat_percentile
+ * Description: Nearest-rank percentile of sorted latencies.
+ * Inputs:
+ *   - lat: The latencies, sorted.
+ *   - p: The percentile, between 0 and 100.
+ * Returns:
+ *   - The latency in microseconds, 0 if nothing was recorded.
+ */
+static double lat_percentile(const struct bench_lat *lat, double p)
+{
+    size_t rank;
+
+    if (!lat->nr)
+        return 0;
+    rank = (size_t)(p / 100.0 * lat->nr + 0.999999);
+    if (rank < 1)
+        rank = 1;
+    if (rank > lat->nr)
+        rank = lat->nr;
+    return lat->ns[rank - 1] / 1000.0;
+}
+
+/**
+ * Function: report
+ * Description: Prints the result line of a workload.
+ * Inputs:
+ *   - test: The name of the workload.
+ *   - io_size: The size of each call, 0 for metadata workloads.
+ *   - threads: The number of threads.
+ *   - lat: The latencies of its calls, sorted here.
+ *   - bytes: The bytes transferred.
+ *   - elapsed: The wall time of the workload in nanoseconds.
+ *   - extra: Further JSON members, with a leading comma, or "".
+ * Returns:
+ *   - None.
+ */
+static void report(const char *test, size_t io_size, unsigned int threads,
+                   struct bench_lat *lat, uint64_t bytes, uint64_t elapsed, const char *extra)
+{
+    double secs = elapsed / 1e9;
+
+    qsort(lat->ns, lat->nr, sizeof(*lat->ns), cmp_u64);
+    printf("{\"test\":\"%s\",\"io_size\":%zu,\"threads\":%u,\"ops\":%zu,\"errors\":%zu,"
+           "\"bytes\":%llu,\"secs\":%.6f,\"mib_s\":%.2f,\"ops_s\":%.1f,"
+           "\"p50_us\":%.2f,\"p99_us\":%.2f,\"max_us\":%.2f%s}\n",
+           test, io_size, threads, lat->nr, lat->errors, (unsigned long long)bytes, secs,
+           secs > 0 ? bytes / MIB / secs : 0, secs > 0 ? lat->nr / secs : 0,
+           lat_percentile(lat, 50), lat_percentile(lat, 99), lat_percentile(lat, 100), extra);
+    fflush(stdout);
+}
+
+static void report_meta(const struct bench_config *cfg)
+{
+    char version[64] = "unknown";
+    struct utsname uts;
+    FILE *f;
+
+    uname(&uts);
+    f = fopen("/sys/module/osfs/srcversion", "r");
+    if (f) {
+        if (fscanf(f, "%63s", version) != 1)
+            strcpy(version, "unknown");
+        fclose(f);
+    }
+    printf("{\"test\":\"meta\",\"kernel\":\"%s\",\"module\":\"%s\",\"file_size\":%zu,"
+           "\"nr_files\":%u,\"threads\":%u,\"time\":%lld}\n",
+           uts.release, version, cfg->file_size, cfg->nr_files, cfg->threads,
+           (long long)time(NULL));
+}
+
+static char *bench_path(const struct bench_config *cfg, const char *name)
+{
+    static char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/%s", cfg->dir, name);
+    return path;
+}
+
+/**
+ * Function: fill_file
+ * Description: Creates or truncates a file and writes size bytes into it,
+ *              untimed, then drops it from the page cache so reads reach the
+ *              filesystem.
+ * Inputs:
+ *   - path: The file.
+ *   - size: The size to give it.
+ * Returns:
+ *   - An open read/write descriptor of the file.
+ */
+static int fill_file(const char *path, size_t size)
+{
+    static char buf[1 << 20];
+    size_t done, len;
+    int fd;
+
+    memset(buf, 0xa5, sizeof(buf));
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        die(path);
+    for (done = 0; done < size; done += len) {
+        len = size - done < sizeof(buf) ? size - done : sizeof(buf);
+        if (pwrite(fd, buf, len, done) != (ssize_t)len)
+            die("pwrite");
+    }
+    if (fsync(fd))
+        die("fsync");
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    return fd;
+}
+
+/**
+ * Function: run_io
+ * Description: Issues size / io_size reads or writes of io_size bytes on a
+ *              range of one file, at consecutive or random aligned offsets.
+ * Inputs:
+ *   - fd: The file.
+ *   - buf: A buffer of io_size bytes.
+ *   - base: The first byte of the range to go over.
+ *   - size: The size of the range.
+ *   - io_size: The size of each call.
+ *   - write: Whether to write.
+ *   - random: Whether the offsets are random.
+ *   - seed: The state of the offset generator.
+ *   - lat: Where the calls are recorded.
+ * Returns:
+ *   - The number of bytes transferred.
+ */
+static uint64_t run_io(int fd, char *buf, size_t base, size_t size, size_t io_size, int write,
+                       int random, uint64_t *seed, struct bench_lat *lat)
+{
+    size_t nr = size / io_size, i;
+    uint64_t bytes = 0, start;
+    off_t off;
+    ssize_t ret;
+
+    for (i = 0; i < nr; i++) {
+        off = base + (random ? xorshift64(seed) % nr : i) * io_size;
+        start = now_ns();
+        ret = write ? pwrite(fd, buf, io_size, off) : pread(fd, buf, io_size, off);
+        lat_add(lat, start, ret == (ssize_t)io_size);
+        if (ret > 0)
+            bytes += ret;
+    }
+    return bytes;
+}
+
+/**
+ * Function: bench_rw
+ * Description: Sequential and random reads and writes of the configured file
+ *              size, for each of io_sizes. Writes start from an empty file
+ *              for the sequential case and go over a written one for the
+ *              random case; reads start with a cold page cache.
+ * Inputs:
+ *   - cfg: The configuration.
+ *   - write: Whether to write.
+ *   - random: Whether the offsets are random.
+ * Returns:
+ *   - None.
+ */
+static void bench_rw(const struct bench_config *cfg, int write, int random)
+{
+    const char *name = random ? (write ? "rand_write" : "rand_read") :
+                                (write ? "seq_write" : "seq_read");
+    char *path = bench_path(cfg, "rw.dat");
+    struct bench_lat lat;
+    uint64_t seed = 0x9e3779b97f4a7c15ULL, bytes, start;
+    size_t i, io_size;
+    char *buf;
+    int fd;
+
+    for (i = 0; i < sizeof(io_sizes) / sizeof(io_sizes[0]); i++) {
+        io_size = io_sizes[i];
+        if (io_size > cfg->file_size)
+            continue;
+        buf = malloc(io_size);
+        if (!buf)
+            die("malloc");
+        memset(buf, 0x5a, io_size);
+        lat_init(&lat, cfg->file_size / io_size);
+
+        if (write && !random) {
+            fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0)
+                die(path);
+        } else {
+            fd = fill_file(path, cfg->file_size);
+        }
+
+        start = now_ns();
+        bytes = run_io(fd, buf, 0, cfg->file_size, io_size, write, random, &seed, &lat);
+        if (write && fsync(fd))
+            die("fsync");
+        report(name, io_size, 1, &lat, bytes, now_ns() - start, "");
+
+        close(fd);
+        lat_free(&lat);
+        free(buf);
+    }
+    unlink(path);
+}
+
+static void bench_seq_write(const struct bench_config *cfg) { bench_rw(cfg, 1, 0); }
+static void bench_seq_read(const struct bench_config *cfg) { bench_rw(cfg, 0, 0); }
+static void bench_rand_write(const struct bench_config *cfg) { bench_rw(cfg, 1, 1); }
+static void bench_rand_read(const struct bench_config *cfg) { bench_rw(cfg, 0, 1); }
+
+/**
+ * Function: bench_storm
+ * Description: Creates nr_files empty files in one directory, looks each of
+ *              them up in random order, looks up as many names that do not
+ *              exist, then unlinks the files, reporting every phase.
+ * Inputs:
+ *   - cfg: The configuration.
+ * Returns:
+ *   - None.
+ */
+static void bench_storm(const struct bench_config *cfg)
+{
+    char dir[PATH_MAX], path[PATH_MAX + 16];
+    uint64_t seed = 0x2545f4914f6cdd1dULL, start, t0;
+    struct bench_lat lat;
+    struct stat st;
+    unsigned int i, n;
+    int fd;
+
+    snprintf(dir, sizeof(dir), "%s", bench_path(cfg, "storm"));
+    if (mkdir(dir, 0755) && errno != EEXIST)
+        die(dir);
+
+    lat_init(&lat, cfg->nr_files);
+    t0 = now_ns();
+    for (i = 0; i < cfg->nr_files; i++) {
+        snprintf(path, sizeof(path), "%s/f%07u", dir, i);
+        start = now_ns();
+        fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        lat_add(&lat, start, fd >= 0);
+        if (fd >= 0)
+            close(fd);
+    }
+    report("create", 0, 1, &lat, 0, now_ns() - t0, "");
+    lat_free(&lat);
+
+    lat_init(&lat, cfg->nr_files);
+    t0 = now_ns();
+    for (i = 0; i < cfg->nr_files; i++) {
+        n = xorshift64(&seed) % cfg->nr_files;
+        snprintf(path, sizeof(path), "%s/f%07u", dir, n);
+        start = now_ns();
+        lat_add(&lat, start, !stat(path, &st));
+    }
+    report("lookup", 0, 1, &lat, 0, now_ns() - t0, "");
+    lat_free(&lat);
+
+    // Misses are expected to fail; their latency is what counts
+    lat_init(&lat, cfg->nr_files);
+    t0 = now_ns();
+    for (i = 0; i < cfg->nr_files; i++) {
+        snprintf(path, sizeof(path), "%s/missing%07u", dir, i % 64);
+        start = now_ns();
+        lat_add(&lat, start, stat(path, &st) && errno == ENOENT);
+    }
+    report("lookup_miss", 0, 1, &lat, 0, now_ns() - t0, "");
+    lat_free(&lat);
+
+    lat_init(&lat, cfg->nr_files);
+    t0 = now_ns();
+    for (i = 0; i < cfg->nr_files; i++) {
+        snprintf(path, sizeof(path), "%s/f%07u", dir, i);
+        start = now_ns();
+        lat_add(&lat, start, !unlink(path));
+    }
+    report("unlink", 0, 1, &lat, 0, now_ns() - t0, "");
+    lat_free(&lat);
+    rmdir(dir);
+}
+
+/**
+ * Struct: writer_arg
+ * Description: Work of one thread of the multi-threaded writers.
+ */
+struct writer_arg {
+    pthread_barrier_t *barrier;         // Released once every thread is ready
+    int fd;                             // File to write
+    size_t base;                        // First byte of the thread's range
+    size_t size;                        // Bytes to write
+    size_t io_size;                     // Size of each write
+    struct bench_lat lat;               // Latencies of the thread
+    uint64_t bytes;                     // Bytes written
+};
+
+static void *writer_thread(void *p)
+{
+    struct writer_arg *arg = p;
+    uint64_t seed = 0;
+    char *buf;
+
+    buf = malloc(arg->io_size);
+    if (!buf)
+        die("malloc");
+    memset(buf, 0x3c, arg->io_size);
+    pthread_barrier_wait(arg->barrier);
+    arg->bytes = run_io(arg->fd, buf, arg->base, arg->size, arg->io_size, 1, 0, &seed,
+                        &arg->lat);
+    free(buf);
+    return NULL;
+}
+
+/**
+ * Function: bench_mt_write
+ * Description: Threads writing file_size bytes between them, sequentially in
+ *              64 KiB calls, either each to its own file or each to its own
+ *              range of one shared file.
+ * Inputs:
+ *   - cfg: The configuration.
+ *   - shared: Whether the threads share one file.
+ * Returns:
+ *   - None.
+ */
+static void bench_mt_write(const struct bench_config *cfg, int shared)
+{
+    size_t io_size = 65536, per_thread = cfg->file_size / cfg->threads / io_size * io_size;
+    struct writer_arg *args;
+    pthread_barrier_t barrier;
+    pthread_t *tids;
+    struct bench_lat lat;
+    uint64_t bytes = 0, start, elapsed;
+    char name[32];
+    unsigned int i;
+    int fd = -1;
+
+    if (!per_thread)
+        return;
+    args = calloc(cfg->threads, sizeof(*args));
+    tids = calloc(cfg->threads, sizeof(*tids));
+    if (!args || !tids)
+        die("calloc");
+    pthread_barrier_init(&barrier, NULL, cfg->threads + 1);
+
+    if (shared) {
+        fd = open(bench_path(cfg, "mt_shared.dat"), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            die("open");
+    }
+    for (i = 0; i < cfg->threads; i++) {
+        args[i].barrier = &barrier;
+        if (shared) {
+            args[i].fd = fd;
+            args[i].base = i * per_thread;
+        } else {
+            snprintf(name, sizeof(name), "mt_%u.dat", i);
+            args[i].fd = open(bench_path(cfg, name), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (args[i].fd < 0)
+                die("open");
+        }
+        args[i].size = per_thread;
+        args[i].io_size = io_size;
+        lat_init(&args[i].lat, per_thread / io_size);
+        if (pthread_create(&tids[i], NULL, writer_thread, &args[i]))
+            die("pthread_create");
+    }
+
+    pthread_barrier_wait(&barrier);
+    start = now_ns();
+    for (i = 0; i < cfg->threads; i++) {
+        pthread_join(tids[i], NULL);
+        if (!shared && fsync(args[i].fd))
+            die("fsync");
+    }
+    if (shared && fsync(fd))
+        die("fsync");
+    elapsed = now_ns() - start;
+
+    lat_init(&lat, (per_thread / io_size) * cfg->threads);
+    for (i = 0; i < cfg->threads; i++) {
+        lat_merge(&lat, &args[i].lat);
+        bytes += args[i].bytes;
+    }
+    report(shared ? "mt_write_shared" : "mt_write_private", io_size, cfg->threads, &lat,
+           bytes, elapsed, "");
+
+    for (i = 0; i < cfg->threads; i++) {
+        lat_free(&args[i].lat);
+        if (!shared) {
+            close(args[i].fd);
+            snprintf(name, sizeof(name), "mt_%u.dat", i);
+            unlink(bench_path(cfg, name));
+        }
+    }
+    if (shared) {
+        close(fd);
+        unlink(bench_path(cfg, "mt_shared.dat"));
+    }
+    lat_free(&lat);
+    pthread_barrier_destroy(&barrier);
+    free(tids);
+    free(args);
+}
+
+static void bench_mt_write_private(const struct bench_config *cfg) { bench_mt_write(cfg, 0); }
+static void bench_mt_write_shared(const struct bench_config *cfg) { bench_mt_write(cfg, 1); }
+
+/**
+ * Function: make_tree
+ * Description: Creates a directory with files_per_dir empty files and, above
+ *              the last level, fanout subdirectories built the same way.
+ * Inputs:
+ *   - cfg: The configuration.
+ *   - path: The directory to create.
+ *   - level: The depth of path in the tree, 0 for its root.
+ * Returns:
+ *   - None.
+ */
+static void make_tree(const struct bench_config *cfg, const char *path, unsigned int level)
+{
+    char child[PATH_MAX];
+    unsigned int i;
+    int fd;
+
+    if (mkdir(path, 0755) && errno != EEXIST)
+        die(path);
+    for (i = 0; i < cfg->files_per_dir; i++) {
+        snprintf(child, sizeof(child), "%s/f%u", path, i);
+        fd = open(child, O_WRONLY | O_CREAT, 0644);
+        if (fd < 0)
+            die(child);
+        close(fd);
+    }
+    if (level == cfg->depth)
+        return;
+    for (i = 0; i < cfg->fanout; i++) {
+        snprintf(child, sizeof(child), "%s/d%u", path, i);
+        make_tree(cfg, child, level + 1);
+    }
+}
+
+/**
+ * Function: remove_tree
+ * Description: Removes a tree built by make_tree, deepest directories first.
+ * Inputs:
+ *   - cfg: The configuration it was built with.
+ *   - path: The root of the tree.
+ *   - level: The depth of path in the tree, 0 for its root.
+ * Returns:
+ *   - None.
+ */
+static void remove_tree(const struct bench_config *cfg, const char *path, unsigned int level)
+{
+    char child[PATH_MAX];
+    unsigned int i;
+
+    for (i = 0; level < cfg->depth && i < cfg->fanout; i++) {
+        snprintf(child, sizeof(child), "%s/d%u", path, i);
+        remove_tree(cfg, child, level + 1);
+    }
+    for (i = 0; i < cfg->files_per_dir; i++) {
+        snprintf(child, sizeof(child), "%s/f%u", path, i);
+        unlink(child);
+    }
+    rmdir(path);
+}
+
+/**
+ * Function: walk_tree
+ * Description: Reads every directory of a tree, timing each one from opendir
+ *              to closedir, and descends into the subdirectories.
+ * Inputs:
+ *   - path: The root of the tree.
+ *   - lat: Where the directories are recorded.
+ *   - entries: Incremented for every entry read, dots excluded.
+ * Returns:
+ *   - None.
+ */
+static void walk_tree(const char *path, struct bench_lat *lat, uint64_t *entries)
+{
+    char child[PATH_MAX];
+    char (*subdirs)[NAME_MAX + 1] = NULL;
+    size_t nr = 0, cap = 0, i;
+    struct dirent *de;
+    uint64_t start;
+    DIR *d;
+
+    start = now_ns();
+    d = opendir(path);
+    if (!d) {
+        lat_add(lat, start, 0);
+        return;
+    }
+    while ((de = readdir(d))) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        (*entries)++;
+        if (de->d_type != DT_DIR)
+            continue;
+        if (nr == cap) {
+            cap = cap ? cap * 2 : 16;
+            subdirs = realloc(subdirs, cap * sizeof(*subdirs));
+            if (!subdirs)
+                die("realloc");
+        }
+        snprintf(subdirs[nr++], NAME_MAX + 1, "%s", de->d_name);
+    }
+    closedir(d);
+    lat_add(lat, start, 1);
+
+    for (i = 0; i < nr; i++) {
+        snprintf(child, sizeof(child), "%s/%s", path, subdirs[i]);
+        walk_tree(child, lat, entries);
+    }
+    free(subdirs);
+}
+
+/**
+ * Function: bench_readdir
+ * Description: Builds a tree of directories, fanout per level over depth
+ *              levels, untimed, then walks it twice. The first walk follows
+ *              the creation, the second one runs with every directory already
+ *              read once; both are reported. The tree is removed afterwards.
+ * Inputs:
+ *   - cfg: The configuration.
+ * Returns:
+ *   - None.
+ */
+static void bench_readdir(const struct bench_config *cfg)
+{
+    char root[PATH_MAX], extra[64];
+    size_t nr_dirs = 1, level_dirs = 1;
+    struct bench_lat lat;
+    uint64_t entries, start;
+    unsigned int i, pass;
+
+    for (i = 0; i < cfg->depth; i++) {
+        level_dirs *= cfg->fanout;
+        nr_dirs += level_dirs;
+    }
+    snprintf(root, sizeof(root), "%s", bench_path(cfg, "tree"));
+    make_tree(cfg, root, 0);
+
+    for (pass = 0; pass < 2; pass++) {
+        entries = 0;
+        lat_init(&lat, nr_dirs);
+        start = now_ns();
+        walk_tree(root, &lat, &entries);
+        snprintf(extra, sizeof(extra), ",\"entries\":%llu", (unsigned long long)entries);
+        report(pass ? "readdir_warm" : "readdir", 0, 1, &lat, 0, now_ns() - start, extra);
+        lat_free(&lat);
+    }
+    remove_tree(cfg, root, 0);
+}
+
+/**
+ * Struct: bench_workload
+ * Description: A workload selectable by name on the command line.
+ */
+struct bench_workload {
+    const char *name;
+    void (*run)(const struct bench_config *cfg);
+};
+
+static const struct bench_workload osfs_workloads[] = {
+    { "seq_write", bench_seq_write },
+    { "seq_read", bench_seq_read },
+    { "rand_write", bench_rand_write },
+    { "rand_read", bench_rand_read },
+    { "storm", bench_storm },
+    { "mt_write_private", bench_mt_write_private },
+    { "mt_write_shared", bench_mt_write_shared },
+    { "readdir", bench_readdir },
+};
+
+#define NR_WORKLOADS (sizeof(osfs_workloads) / sizeof(osfs_workloads[0]))
+
+static void usage(void)
+{
+    size_t i;
+
+    fprintf(stderr, "usage: osfs_bench -d dir [-q] [-s file_size_mib] [-n files] "
+                    "[-t threads] [workload...]\nworkloads:");
+    for (i = 0; i < NR_WORKLOADS; i++)
+        fprintf(stderr, " %s", osfs_workloads[i].name);
+    fprintf(stderr, "\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    struct bench_config cfg = {
+        .file_size = 64 << 20,
+        .nr_files = 10000,
+        .threads = 4,
+        .fanout = 8,
+        .depth = 3,
+        .files_per_dir = 16,
+    };
+    size_t i;
+    int opt, j, found;
+
+    // Quick profile for a smoke test, on a small mount; the other flags override it
+    opterr = 0;
+    while ((opt = getopt(argc, argv, "d:qs:n:t:")) != -1) {
+        if (opt != 'q')
+            continue;
+        cfg.file_size = 4 << 20;
+        cfg.nr_files = 1000;
+        cfg.threads = 2;
+        cfg.fanout = 4;
+        cfg.depth = 2;
+        cfg.files_per_dir = 8;
+    }
+    opterr = 1;
+    optind = 1;
+
+    while ((opt = getopt(argc, argv, "d:qs:n:t:")) != -1) {
+        switch (opt) {
+        case 'd':
+            cfg.dir = optarg;
+            break;
+        case 'q':
+            break;
+        case 's':
+            cfg.file_size = strtoull(optarg, NULL, 0) << 20;
+            break;
+        case 'n':
+            cfg.nr_files = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            cfg.threads = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (!cfg.dir || !cfg.file_size || !cfg.nr_files || !cfg.threads)
+        usage();
+
+    for (j = optind; j < argc; j++) {
+        for (i = 0, found = 0; i < NR_WORKLOADS; i++)
+            found |= !strcmp(argv[j], osfs_workloads[i].name);
+        if (!found)
+            usage();
+    }
+
+    report_meta(&cfg);
+    for (i = 0; i < NR_WORKLOADS; i++) {
+        for (j = optind, found = optind == argc; j < argc; j++)
+            found |= !strcmp(argv[j], osfs_workloads[i].name);
+        if (!found)
+            continue;
+        fprintf(stderr, "osfs_bench: %s\n", osfs_workloads[i].name);
+        osfs_workloads[i].run(&cfg);
+    }
+    return 0;
+}
@@ -0,0 +1,471 @@
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/fs.h>
+#include <linux/gfp.h>
+#include <linux/mm.h>
+#include <linux/nodemask.h>
+#include <linux/pagemap.h>
+#include <linux/xarray.h>
+#include "osfs.h"
+
+/*
+ * Data blocks are not backed by memory until they are first written: the
+ * store is an xarray of pages indexed by (block_no >> blocks_per_page_bits),
+ * populated on demand and shrunk again as soon as every block sharing a page
+ * is freed. A block without a page reads as zeros, and freed blocks living
+ * in a page that stays around are zeroed, so a freshly allocated block
+ * always reads as zeros.
+ *
+ * In image mode (sb_info->bdev set) the store is a cache of the data area of
+ * the device instead. A missing page is read from the device on first access,
+ * locked while the read is in flight, and pages stay until unmount, so frees
+ * only zero the block. Blocks the device copy is not valid for, either free
+ * at mount or freed since (image_valid clear), are zeroed after the read so
+ * the invariant above still holds. Modified pages carry OSFS_PAGE_DIRTY until
+ * osfs_flush_data_pages writes them out.
+ *
+ * With the numa= mount option pages are placed on the nodes that were online
+ * at mount: numa=interleave spreads them page by page, and numa=local splits
+ * the blocks into allocation groups of 1 << OSFS_NUMA_GROUP_SHIFT bytes homed
+ * on the nodes in turn, puts each page on its group's home node, and has the
+ * block allocator hand writers blocks from their own node's groups first.
+ */
+#define OSFS_PAGE_DIRTY XA_MARK_0       // Page differs from the device copy
+#define OSFS_PAGE_EIO XA_MARK_1         // Reading the page from the device failed
+
+static inline unsigned int osfs_page_shift(struct osfs_sb_info *sb_info)
+{
+    return PAGE_SHIFT - sb_info->block_bits;
+}
+
+static inline size_t osfs_block_offset(struct osfs_sb_info *sb_info, uint32_t block_no)
+{
+    return ((size_t)block_no << sb_info->block_bits) & ~PAGE_MASK;
+}
+
+/**
+ * Function: osfs_alloc_data_page
+ * Description: Allocates a page of the store on the node the numa= option
+ *              places it on. Pages are charged to the memory cgroup of the
+ *              task bringing them in, as tmpfs pages are: unprivileged users
+ *              can mount the filesystem and fill it.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - index: The index of the page in the store.
+ *   - gfp: Allocation flags.
+ * Returns:
+ *   - The page on success.
+ *   - NULL if memory allocation fails.
+ */
+static struct page *osfs_alloc_data_page(struct osfs_sb_info *sb_info, unsigned long index,
+                                         gfp_t gfp)
+{
+    unsigned int node;
+    int nid;
+
+    gfp |= __GFP_ACCOUNT;
+    switch (sb_info->numa) {
+    case OSFS_NUMA_INTERLEAVE:
+        node = index % sb_info->numa_nr_nodes;
+        break;
+    case OSFS_NUMA_LOCAL:
+        node = osfs_numa_home(sb_info, index << osfs_page_shift(sb_info));
+        break;
+    default:
+        return alloc_page(gfp);
+    }
+
+    // The node may have gone offline since the mount; the page is not pinned to it
+    nid = sb_info->numa_nodes[node].nid;
+    if (!node_online(nid))
+        return alloc_page(gfp);
+    return alloc_pages_node(nid, gfp, 0);
+}
+
+/**
+ * Function: osfs_image_page_io
+ * Description: Reads or writes one page of the store from or to the data area
+ *              of the device. The last page may cover fewer blocks.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - index: The index of the page in the store.
+ *   - page: The page to transfer.
+ *   - op: REQ_OP_READ or REQ_OP_WRITE.
+ *   - gfp: Allocation flags for the bio.
+ * Returns:
+ *   - 0 on success.
+ *   - A negative error code from the block layer on failure.
+ */
+static int osfs_image_page_io(struct osfs_sb_info *sb_info, unsigned long index,
+                              struct page *page, blk_opf_t op, gfp_t gfp)
+{
+    uint64_t first = (uint64_t)index << osfs_page_shift(sb_info);
+    size_t len = min_t(uint64_t, PAGE_SIZE, (sb_info->block_count - first) << sb_info->block_bits);
+    struct bio *bio;
+    int ret;
+
+    bio = bio_alloc(sb_info->bdev, 1, op, gfp);
+    bio->bi_iter.bi_sector = (sb_info->layout.l_data + first) << (sb_info->block_bits - SECTOR_SHIFT);
+    __bio_add_page(bio, page, len, 0);
+    ret = submit_bio_wait(bio);
+    bio_put(bio);
+    return ret;
+}
+
+/**
+ * Function: osfs_image_fault
+ * Description: Brings a page of the store in from the device. The page is
+ *              published locked before the read so concurrent users wait for
+ *              it instead of reading the device twice.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - index: The index of the missing page.
+ *   - gfp: Allocation flags.
+ * Returns:
+ *   - The page on success, possibly one another task brought in.
+ *   - ERR_PTR(-ENOMEM) if memory allocation fails.
+ */
+static struct page *osfs_image_fault(struct osfs_sb_info *sb_info, unsigned long index, gfp_t gfp)
+{
+    unsigned int shift = osfs_page_shift(sb_info);
+    uint32_t first = index << shift;
+    uint32_t last = min_t(uint64_t, (uint64_t)first + (1U << shift), sb_info->block_count);
+    struct page *page, *old;
+    uint32_t block;
+
+    page = osfs_alloc_data_page(sb_info, index, gfp);
+    if (!page)
+        return ERR_PTR(-ENOMEM);
+    __folio_set_locked(page_folio(page));
+
+    old = xa_cmpxchg(&sb_info->data_pages, index, NULL, page, gfp);
+    if (old) {
+        __folio_clear_locked(page_folio(page));
+        __free_page(page);
+        return xa_is_err(old) ? ERR_PTR(xa_err(old)) : old;
+    }
+
+    if (osfs_image_page_io(sb_info, index, page, REQ_OP_READ, gfp)) {
+        pr_err_ratelimited("osfs_image_fault: Failed to read blocks %u-%u\n", first, last - 1);
+        xa_set_mark(&sb_info->data_pages, index, OSFS_PAGE_EIO);
+    }
+
+    // Pairs with the barrier in osfs_block_release: frees racing with the read win
+    smp_mb();
+    for (block = first; block < last; block++) {
+        if (!test_bit(block, sb_info->image_valid))
+            memset(page_address(page) + osfs_block_offset(sb_info, block), 0, sb_info->block_size);
+    }
+    folio_unlock(page_folio(page));
+    return page;
+}
+
+/**
+ * Function: osfs_data_page
+ * Description: Looks up the page backing a data block. In image mode missing
+ *              pages are read from the device and pages being read are waited
+ *              for, unless gfp does not allow blocking.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - index: The index of the page in the store.
+ *   - gfp: Allocation flags for image mode.
+ * Returns:
+ *   - The page on success.
+ *   - NULL in memory mode if the page was never populated.
+ *   - ERR_PTR(-EIO) or ERR_PTR(-ENOMEM) if an image page cannot be read.
+ *   - ERR_PTR(-EAGAIN) if an image page is not in memory yet and gfp does not
+ *     allow blocking.
+ */
+static struct page *osfs_data_page(struct osfs_sb_info *sb_info, unsigned long index, gfp_t gfp)
+{
+    struct page *page;
+
+    page = xa_load(&sb_info->data_pages, index);
+    if (!sb_info->bdev)
+        return page;
+
+    if (!gfpflags_allow_blocking(gfp) && (!page || folio_test_locked(page_folio(page))))
+        return ERR_PTR(-EAGAIN);
+    if (!page) {
+        page = osfs_image_fault(sb_info, index, gfp);
+        if (IS_ERR(page))
+            return page;
+    }
+    folio_wait_locked(page_folio(page));
+    if (xa_get_mark(&sb_info->data_pages, index, OSFS_PAGE_EIO))
+        return ERR_PTR(-EIO);
+    return page;
+}
+
+/**
+ * Function: osfs_block_addr
+ * Description: Returns the address of a data block without populating it in
+ *              memory mode; in image mode the block is read in if needed.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - block_no: The data block number.
+ * Returns:
+ *   - A pointer to the first byte of the block.
+ *   - NULL if the block was never written and therefore reads as zeros, or if
+ *     it cannot be read from the image.
+ */
+void *osfs_block_addr(struct osfs_sb_info *sb_info, uint32_t block_no)
+{
+    struct page *page;
+
+    page = osfs_data_page(sb_info, block_no >> osfs_page_shift(sb_info), GFP_NOFS);
+    if (IS_ERR_OR_NULL(page))
+        return NULL;
+    return page_address(page) + osfs_block_offset(sb_info, block_no);
+}
+
+/**
+ * Function: osfs_block_prepare
+ * Description: Returns the address of a data block, allocating the page that
+ *              backs it if this is the first write to any block on that page.
+ *              In image mode the page is marked dirty; callers writing to the
+ *              block later mark it again with osfs_block_dirty once done.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - block_no: The data block number.
+ *   - gfp: Allocation flags for the backing page.
+ * Returns:
+ *   - A pointer to the first byte of the block on success.
+ *   - ERR_PTR(-ENOMEM) if the backing page cannot be allocated.
+ *   - ERR_PTR(-EIO) if the page cannot be read from the image.
+ *   - ERR_PTR(-EAGAIN) if the page must be read and gfp does not allow blocking.
+ */
+void *osfs_block_prepare(struct osfs_sb_info *sb_info, uint32_t block_no, gfp_t gfp)
+{
+    unsigned long index = block_no >> osfs_page_shift(sb_info);
+    struct page *page, *old;
+
+    page = osfs_data_page(sb_info, index, gfp);
+    if (IS_ERR(page))
+        return page;
+    if (page) {
+        // A block prepared but never written still has to reach the device as zeros
+        osfs_block_dirty(sb_info, block_no);
+        goto out;
+    }
+
+    page = osfs_alloc_data_page(sb_info, index, gfp | __GFP_ZERO);
+    if (!page)
+        return ERR_PTR(-ENOMEM);
+
+    old = xa_cmpxchg(&sb_info->data_pages, index, NULL, page, gfp);
+    if (xa_is_err(old)) {
+        __free_page(page);
+        return ERR_PTR(xa_err(old));
+    }
+    if (old) {
+        // Somebody else populated the page first
+        __free_page(page);
+        page = old;
+    }
+out:
+    return page_address(page) + osfs_block_offset(sb_info, block_no);
+}
+
+/**
+ * Function: osfs_read_blocks
+ * Description: Copies len bytes out of contiguous data blocks starting at
+ *              block_no. Pages that were never populated read as zeros.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - block_no: The first data block to read.
+ *   - dst: The destination buffer.
+ *   - len: The number of bytes to copy.
+ * Returns:
+ *   - 0 on success.
+ *   - A negative error code if a page cannot be read from the image.
+ */
+int osfs_read_blocks(struct osfs_sb_info *sb_info, uint32_t block_no, void *dst, size_t len)
+{
+    size_t offset = osfs_block_offset(sb_info, block_no);
+    unsigned long index = block_no >> osfs_page_shift(sb_info);
+    struct page *page;
+    size_t chunk;
+
+    while (len) {
+        chunk = min_t(size_t, len, PAGE_SIZE - offset);
+        page = osfs_data_page(sb_info, index, GFP_NOFS);
+        if (IS_ERR(page))
+            return PTR_ERR(page);
+        if (page)
+            memcpy(dst, page_address(page) + offset, chunk);
+        else
+            memset(dst, 0, chunk);
+        dst += chunk;
+        len -= chunk;
+        offset = 0;
+        index++;
+    }
+    return 0;
+}
+
+/**
+ * Function: osfs_block_release
+ * Description: Drops the backing of a data block that was just freed. The page
+ *              is returned to the system once no block on it is in use;
+ *              otherwise, and always in image mode, the block is zeroed in
+ *              place. Called with alloc_lock held.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - block_no: The freed data block number.
+ * Returns:
+ *   - None.
+ */
+void osfs_block_release(struct osfs_sb_info *sb_info, uint32_t block_no)
+{
+    unsigned int shift = osfs_page_shift(sb_info);
+    unsigned long index = block_no >> shift;
+    unsigned long first = index << shift;
+    unsigned long last = min_t(unsigned long, first + (1UL << shift), sb_info->block_count);
+    struct page *page;
+
+    if (sb_info->bdev) {
+        // The device copy is stale from now on; see osfs_image_fault
+        clear_bit(block_no, sb_info->image_valid);
+        smp_mb__after_atomic();
+    }
+
+    page = xa_load(&sb_info->data_pages, index);
+    if (!page)
+        return;
+
+    if (!sb_info->bdev && find_next_bit(sb_info->block_bitmap, last, first) >= last) {
+        xa_erase(&sb_info->data_pages, index);
+        __free_page(page);
+        return;
+    }
+    memset(page_address(page) + osfs_block_offset(sb_info, block_no), 0, sb_info->block_size);
+}
+
+/**
+ * Function: osfs_block_dirty
+ * Description: Records that a data block was modified, so that image mode
+ *              writes its page back at the next sync. Call it after the change.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - block_no: The modified data block number.
+ * Returns:
+ *   - None.
+ */
+void osfs_block_dirty(struct osfs_sb_info *sb_info, uint32_t block_no)
+{
+    if (sb_info->bdev)
+        xa_set_mark(&sb_info->data_pages, block_no >> osfs_page_shift(sb_info), OSFS_PAGE_DIRTY);
+}
+
+/**
+ * Function: osfs_flush_data_pages
+ * Description: Writes every modified page of the store to the data area of the
+ *              device. The mark is cleared before the write, so a page changed
+ *              meanwhile is simply written again at the next flush.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ * Returns:
+ *   - 0 on success.
+ *   - The first error returned by the block layer otherwise.
+ */
+int osfs_flush_data_pages(struct osfs_sb_info *sb_info)
+{
+    struct page *page;
+    unsigned long index;
+    int ret = 0, err;
+
+    xa_for_each_marked(&sb_info->data_pages, index, page, OSFS_PAGE_DIRTY) {
+        xa_clear_mark(&sb_info->data_pages, index, OSFS_PAGE_DIRTY);
+        err = osfs_image_page_io(sb_info, index, page, REQ_OP_WRITE, GFP_NOFS);
+        if (err) {
+            xa_set_mark(&sb_info->data_pages, index, OSFS_PAGE_DIRTY);
+            if (!ret)
+                ret = err;
+        }
+    }
+    return ret;
+}
+
+/**
+ * Function: osfs_destroy_data_pages
+ * Description: Frees every page of the data block store at unmount.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ * Returns:
+ *   - None.
+ */
+void osfs_destroy_data_pages(struct osfs_sb_info *sb_info)
+{
+    struct page *page;
+    unsigned long index;
+
+    xa_for_each(&sb_info->data_pages, index, page)
+        __free_page(page);
+    xa_destroy(&sb_info->data_pages);
+}
+
+/**
+ * Function: osfs_numa_init
+ * Description: Records the nodes data pages are placed on for the numa= mount
+ *              option. A machine with a single node has nothing to place, so
+ *              the option is dropped there.
+ * Inputs:
+ *   - sb_info: The superblock information, geometry set.
+ *   - numa: The placement asked for.
+ * Returns:
+ *   - 0 on success; osfs_kill_superblock frees the nodes.
+ *   - -ENOMEM if memory allocation fails.
+ */
+int osfs_numa_init(struct osfs_sb_info *sb_info, enum osfs_numa numa)
+{
+    unsigned int nr_nodes = num_online_nodes(), i = 0;
+    uint64_t first;
+    int nid;
+
+    if (numa == OSFS_NUMA_OFF || nr_nodes < 2)
+        return 0;
+
+    sb_info->numa_nodes = kcalloc(nr_nodes, sizeof(*sb_info->numa_nodes), GFP_KERNEL);
+    if (!sb_info->numa_nodes)
+        return -ENOMEM;
+    sb_info->numa_group_bits = OSFS_NUMA_GROUP_SHIFT - sb_info->block_bits;
+
+    for_each_online_node(nid) {
+        // Nodes coming online meanwhile are left out
+        if (i == nr_nodes)
+            break;
+        // Node i is home to groups i, i + nr_nodes, ...; its search starts in the first
+        first = (uint64_t)i << sb_info->numa_group_bits;
+        sb_info->numa_nodes[i].nid = nid;
+        sb_info->numa_nodes[i].hint = first < sb_info->block_count ? first : 0;
+        i++;
+    }
+    sb_info->numa_nr_nodes = i;
+    sb_info->numa = numa;
+    return 0;
+}
+
+/**
+ * Function: osfs_numa_local
+ * Description: Finds the node of the calling task among the nodes data pages
+ *              are placed on, for the block allocator.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ * Returns:
+ *   - The index of the node in numa_nodes with numa=local.
+ *   - -1 otherwise, or if the node came online after the mount.
+ */
+int osfs_numa_local(struct osfs_sb_info *sb_info)
+{
+    int nid = numa_node_id();
+    unsigned int i;
+
+    if (sb_info->numa != OSFS_NUMA_LOCAL)
+        return -1;
+    for (i = 0; i < sb_info->numa_nr_nodes; i++) {
+        if (sb_info->numa_nodes[i].nid == nid)
+            return i;
+    }
+    return -1;
+}
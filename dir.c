@@ -1,59 +1,669 @@
 #include <linux/fs.h>
 #include <linux/string.h>
+#include <linux/stringhash.h>
 #include <linux/slab.h>
+#include <linux/log2.h>
 #include "osfs.h"
+#include "osfs_trace.h"
+
+/*
+ * Directory layout: a directory is a sequence of blocks mapped through the same
+ * extent map regular files use. Each block is covered by variable-length
+ * entries (see struct osfs_dir_entry), so a position inside the directory is a
+ * byte offset and every entry starts on a boundary returned by the previous
+ * one's rec_len. Directory blocks are written in place in the block store;
+ * their extents, like the entries, are protected by the directory's i_rwsem.
+ */
+
+// A record of 64 KiB, only possible with 64 KiB blocks, is stored as rec_len 0
+static inline uint32_t osfs_rec_len(const struct osfs_dir_entry *entry)
+{
+    return entry->rec_len ? entry->rec_len : 1U << 16;
+}
+
+static inline void osfs_set_rec_len(struct osfs_dir_entry *entry, uint32_t rec_len)
+{
+    entry->rec_len = (uint16_t)rec_len;
+}
+
+static inline bool osfs_dir_entry_valid(const struct osfs_sb_info *sb_info,
+                                        const struct osfs_dir_entry *entry, uint32_t offset)
+{
+    uint32_t rec_len = osfs_rec_len(entry);
+
+    return rec_len >= OSFS_DIR_REC_LEN(0) && IS_ALIGNED(rec_len, OSFS_DIR_ALIGN) &&
+           offset + rec_len <= sb_info->block_size &&
+           (!entry->inode_no || OSFS_DIR_REC_LEN(entry->name_len) <= rec_len);
+}
+
+/**
+ * Function: osfs_dir_block
+ * Description: Maps a block of a directory.
+ * Inputs:
+ *   - sb_info: The superblock information structure.
+ *   - dir_inode: The osfs inode of the directory.
+ *   - lblk: The block index inside the directory.
+ *   - cursor: Optional extent lookup hint (may be NULL).
+ * Returns:
+ *   - The address of the block on success.
+ *   - NULL if the directory has no such block.
+ */
+static void *osfs_dir_block(struct osfs_sb_info *sb_info, struct osfs_inode *dir_inode,
+                            uint32_t lblk, struct osfs_extent_cursor *cursor)
+{
+    uint32_t pblk;
+
+    if (osfs_extent_lookup(dir_inode, lblk, cursor, &pblk, NULL))
+        return NULL;
+    return osfs_block_addr(sb_info, pblk);
+}
+
+/**
+ * Function: osfs_dir_block_dirty
+ * Description: Records that the directory block holding a position changed,
+ *              for the data store and for the journal.
+ * Inputs:
+ *   - sb_info: The superblock information structure.
+ *   - dir_inode: The osfs inode of the directory.
+ *   - pos: A position inside the modified block.
+ * Returns:
+ *   - None.
+ */
+static void osfs_dir_block_dirty(struct osfs_sb_info *sb_info, struct osfs_inode *dir_inode,
+                                 uint32_t pos)
+{
+    uint32_t pblk;
+
+    if (!osfs_extent_lookup(dir_inode, pos >> sb_info->block_bits, NULL, &pblk, NULL)) {
+        osfs_block_dirty(sb_info, pblk);
+        osfs_journal_block(sb_info, pblk);
+    }
+}
+
+/**
+ * Function: osfs_dir_next
+ * Description: Finds the first used entry of a directory at or after *pos,
+ *              which must be an entry boundary, skipping unused records.
+ * Inputs:
+ *   - sb_info: The superblock information structure.
+ *   - dir_inode: The osfs inode of the directory.
+ *   - cursor: Optional extent lookup hint (may be NULL).
+ *   - pos: In: where to start; out: the position of the returned entry.
+ * Returns:
+ *   - The entry on success.
+ *   - NULL if no used entry follows *pos.
+ *   - ERR_PTR(-EIO) if the directory is corrupted.
+ */
+static struct osfs_dir_entry *osfs_dir_next(struct osfs_sb_info *sb_info, struct osfs_inode *dir_inode,
+                                            struct osfs_extent_cursor *cursor, uint32_t *pos)
+{
+    struct osfs_dir_entry *entry;
+    uint32_t offset;
+    void *block;
+
+    while (*pos < dir_inode->i_size) {
+        block = osfs_dir_block(sb_info, dir_inode, *pos >> sb_info->block_bits, cursor);
+        offset = *pos & (sb_info->block_size - 1);
+        entry = block + offset;
+        if (!block || !osfs_dir_entry_valid(sb_info, entry, offset)) {
+            pr_err("osfs_dir_next: Corrupted entry at %u in directory %u\n", *pos,
+                   osfs_ino(sb_info, dir_inode));
+            return ERR_PTR(-EIO);
+        }
+        if (entry->inode_no)
+            return entry;
+        *pos += osfs_rec_len(entry);
+    }
+    return NULL;
+}
+
+// Iterates over the used entries of a directory; entry may end as an ERR_PTR
+#define osfs_dir_for_each_entry(sb_info, dir_inode, cursor, entry, pos)          \
+    for ((pos) = 0;                                                             \
+         ((entry) = osfs_dir_next(sb_info, dir_inode, cursor, &(pos))) && !IS_ERR(entry); \
+         (pos) += osfs_rec_len(entry))
+
+/*
+ * Directory index: an open-addressing hash table mapping the full_name_hash()
+ * of a name to the position of its directory entry. It only lives in memory,
+ * hanging off the in-core inode (struct osfs_inode_info), and goes away with
+ * it: it is built from the directory blocks on first use and kept up to date by
+ * osfs_add_dir_entry and osfs_dir_remove_entry. A removed name leaves a
+ * tombstone in its slot, so probe sequences through it stay intact; tombstones
+ * are reused by later insertions and dropped when the index is rebuilt.
+ * Lookups run under the directory's i_rwsem held shared and modifications
+ * under it held exclusive, so concurrent lookups only race to publish the
+ * freshly built index, which cmpxchg settles. Past the slots, the index also
+ * records the largest free record of each block, so insertions go straight to
+ * a block with room, whichever it is.
+ */
+#define OSFS_DIR_SLOT_EMPTY U32_MAX     // ds_pos of an unused slot
+#define OSFS_DIR_SLOT_DELETED (U32_MAX - 1) // ds_pos of the slot of a removed name
+#define OSFS_DIR_INDEX_MIN 16           // Smallest number of slots
+
+struct osfs_dir_slot {
+    uint32_t ds_hash;                   // full_name_hash() of the name
+    uint32_t ds_pos;                    // Position of the entry in the directory
+};
+
+struct osfs_dir_index {
+    uint32_t di_mask;                   // Number of slots - 1
+    uint32_t di_count;                  // Slots holding a name
+    uint32_t di_deleted;                // Tombstones
+    uint32_t di_nr_blocks;              // Blocks di_free has room for
+    uint32_t *di_free;                  // Largest free record of each block, after di_slots
+    struct osfs_dir_slot di_slots[];
+};
+
+static inline uint32_t osfs_name_hash(const char *name, size_t name_len)
+{
+    return full_name_hash(NULL, name, name_len);
+}
+
+static inline bool osfs_dir_entry_matches(const struct osfs_dir_entry *entry,
+                                          const char *name, size_t name_len)
+{
+    return entry->name_len == name_len && memcmp(entry->name, name, name_len) == 0;
+}
+
+static void osfs_dir_index_add(struct osfs_dir_index *index, const struct osfs_dir_entry *entry,
+                               uint32_t pos)
+{
+    uint32_t hash = osfs_name_hash(entry->name, entry->name_len);
+    struct osfs_dir_slot *slot = &index->di_slots[hash & index->di_mask];
+
+    while (slot->ds_pos != OSFS_DIR_SLOT_EMPTY && slot->ds_pos != OSFS_DIR_SLOT_DELETED)
+        slot = &index->di_slots[(slot - index->di_slots + 1) & index->di_mask];
+    if (slot->ds_pos == OSFS_DIR_SLOT_DELETED)
+        index->di_deleted--;
+    slot->ds_hash = hash;
+    slot->ds_pos = pos;
+    index->di_count++;
+}
+
+/**
+ * Function: osfs_dir_block_free
+ * Description: Measures the largest record a directory block can take, in an
+ *              unused record or in the slack after a used one.
+ * Inputs:
+ *   - sb_info: The superblock information structure.
+ *   - block: The directory block.
+ * Returns:
+ *   - The length of the largest record that fits, 0 if the block is corrupted.
+ */
+static uint32_t osfs_dir_block_free(struct osfs_sb_info *sb_info, void *block)
+{
+    struct osfs_dir_entry *entry;
+    uint32_t offset, used, best = 0;
+
+    for (offset = 0; offset < sb_info->block_size; offset += osfs_rec_len(entry)) {
+        entry = block + offset;
+        if (!osfs_dir_entry_valid(sb_info, entry, offset))
+            return 0;
+        used = entry->inode_no ? OSFS_DIR_REC_LEN(entry->name_len) : 0;
+        best = max(best, osfs_rec_len(entry) - used);
+    }
+    return best;
+}
+
+/**
+ * Function: osfs_dir_index_build
+ * Description: Builds the index of a directory from its entries, sized for a
+ *              load factor of at most one half, and the free space of its
+ *              blocks, with room for the directory to grow.
+ * Inputs:
+ *   - sb_info: The superblock information structure.
+ *   - dir_inode: The osfs inode of the directory.
+ * Returns:
+ *   - The new index on success.
+ *   - NULL if memory allocation fails or the directory is corrupted.
+ */
+static struct osfs_dir_index *osfs_dir_index_build(struct osfs_sb_info *sb_info,
+                                                   struct osfs_inode *dir_inode)
+{
+    struct osfs_extent_cursor cursor = { 0 };
+    struct osfs_dir_entry *entry;
+    struct osfs_dir_index *index;
+    uint32_t nr_slots, nr_blocks, count = 0, pos, i;
+    void *block;
+
+    osfs_dir_for_each_entry(sb_info, dir_inode, &cursor, entry, pos)
+        count++;
+    if (IS_ERR(entry))
+        return NULL;
+
+    nr_slots = roundup_pow_of_two(max_t(uint32_t, count * 2, OSFS_DIR_INDEX_MIN));
+    nr_blocks = roundup_pow_of_two(dir_inode->i_blocks + 1);
+    index = kvmalloc(size_add(struct_size(index, di_slots, nr_slots),
+                              array_size(nr_blocks, sizeof(*index->di_free))), GFP_KERNEL);
+    if (!index)
+        return NULL;
+
+    index->di_mask = nr_slots - 1;
+    index->di_count = 0;
+    index->di_deleted = 0;
+    index->di_nr_blocks = nr_blocks;
+    index->di_free = (uint32_t *)&index->di_slots[nr_slots];
+    for (i = 0; i < nr_slots; i++)
+        index->di_slots[i].ds_pos = OSFS_DIR_SLOT_EMPTY;
+    for (i = 0; i < dir_inode->i_blocks; i++) {
+        block = osfs_dir_block(sb_info, dir_inode, i, &cursor);
+        if (!block) {
+            kvfree(index);
+            return NULL;
+        }
+        index->di_free[i] = osfs_dir_block_free(sb_info, block);
+    }
+    for (; i < nr_blocks; i++)
+        index->di_free[i] = 0;
+
+    osfs_dir_for_each_entry(sb_info, dir_inode, &cursor, entry, pos)
+        osfs_dir_index_add(index, entry, pos);
+    return index;
+}
+
+/**
+ * Function: osfs_dir_index_get
+ * Description: Returns the index of a directory, building it on first use.
+ * Inputs:
+ *   - sb_info: The superblock information structure.
+ *   - dir: The inode of the directory.
+ * Returns:
+ *   - The index on success.
+ *   - NULL if it cannot be built; callers fall back to a linear scan.
+ */
+static struct osfs_dir_index *osfs_dir_index_get(struct osfs_sb_info *sb_info, struct inode *dir)
+{
+    struct osfs_inode_info *info = OSFS_I(dir);
+    struct osfs_dir_index *index, *old;
+
+    index = READ_ONCE(info->i_dir_index);
+    if (index)
+        return index;
+
+    index = osfs_dir_index_build(sb_info, dir->i_private);
+    if (!index)
+        return NULL;
+
+    old = cmpxchg(&info->i_dir_index, NULL, index);
+    if (old) {
+        kvfree(index);
+        index = old;
+    }
+    return index;
+}
+
+/**
+ * Function: osfs_dir_index_insert
+ * Description: Records the entry just written at pos and the space left in its
+ *              block. The index is rebuilt, without its tombstones and sized
+ *              for the names and blocks it holds, when names and tombstones
+ *              take more than half of it or the directory grew past the
+ *              blocks it covers; it is dropped if that fails so that the next
+ *              access rebuilds it.
+ * Inputs:
+ *   - sb_info: The superblock information structure.
+ *   - dir: The inode of the directory, already holding the entry.
+ *   - entry: The new entry.
+ *   - pos: The position of the new entry.
+ * Returns:
+ *   - None.
+ */
+static void osfs_dir_index_insert(struct osfs_sb_info *sb_info, struct inode *dir,
+                                  const struct osfs_dir_entry *entry, uint32_t pos)
+{
+    struct osfs_inode_info *info = OSFS_I(dir);
+    struct osfs_dir_index *index = info->i_dir_index;
+    uint32_t lblk = pos >> sb_info->block_bits;
+
+    if (!index)
+        return;
+
+    if ((index->di_count + index->di_deleted + 1) * 2 > index->di_mask + 1 ||
+        lblk >= index->di_nr_blocks) {
+        info->i_dir_index = NULL;
+        kvfree(index);
+        info->i_dir_index = osfs_dir_index_build(sb_info, dir->i_private);
+        return;
+    }
+    osfs_dir_index_add(index, entry, pos);
+    index->di_free[lblk] =
+        osfs_dir_block_free(sb_info, (void *)entry - (pos & (sb_info->block_size - 1)));
+}
+
+/**
+ * Function: osfs_dir_index_delete
+ * Description: Turns the slot of a removed entry into a tombstone.
+ * Inputs:
+ *   - dir: The inode of the directory.
+ *   - entry: The entry being removed, its name still in place.
+ *   - pos: The position of the entry.
+ * Returns:
+ *   - None.
+ */
+static void osfs_dir_index_delete(struct inode *dir, const struct osfs_dir_entry *entry,
+                                  uint32_t pos)
+{
+    struct osfs_dir_index *index = OSFS_I(dir)->i_dir_index;
+    uint32_t i;
+
+    if (!index)
+        return;
+
+    for (i = osfs_name_hash(entry->name, entry->name_len) & index->di_mask;
+         index->di_slots[i].ds_pos != OSFS_DIR_SLOT_EMPTY; i = (i + 1) & index->di_mask) {
+        if (index->di_slots[i].ds_pos == pos) {
+            index->di_slots[i].ds_pos = OSFS_DIR_SLOT_DELETED;
+            index->di_count--;
+            index->di_deleted++;
+            return;
+        }
+    }
+}
+
+/**
+ * Function: osfs_dir_index_set_free
+ * Description: Records the space left in a directory block after a removal.
+ * Inputs:
+ *   - sb_info: The superblock information structure.
+ *   - dir: The inode of the directory.
+ *   - lblk: The block index inside the directory.
+ *   - block: The block.
+ * Returns:
+ *   - None.
+ */
+static void osfs_dir_index_set_free(struct osfs_sb_info *sb_info, struct inode *dir,
+                                    uint32_t lblk, void *block)
+{
+    struct osfs_dir_index *index = OSFS_I(dir)->i_dir_index;
+
+    if (index && lblk < index->di_nr_blocks)
+        index->di_free[lblk] = osfs_dir_block_free(sb_info, block);
+}
+
+/**
+ * Function: osfs_dir_index_free
+ * Description: Drops the in-memory index of a directory.
+ * Inputs:
+ *   - dir: The inode of the directory.
+ * Returns:
+ *   - None.
+ */
+void osfs_dir_index_free(struct inode *dir)
+{
+    kvfree(xchg(&OSFS_I(dir)->i_dir_index, NULL));
+}
+
+/**
+ * Function: osfs_dir_find_entry
+ * Description: Finds the entry of a name in a directory, through the index when
+ *              available and by a linear scan otherwise.
+ * Inputs:
+ *   - sb_info: The superblock information structure.
+ *   - dir: The inode of the directory.
+ *   - name: The name to look for.
+ *   - name_len: The length of the name.
+ *   - posp: Optional pointer to store the position of the entry (may be NULL).
+ * Returns:
+ *   - The entry on success.
+ *   - NULL if the directory has no entry with that name.
+ *   - ERR_PTR(-EIO) if the directory is corrupted.
+ */
+static struct osfs_dir_entry *osfs_dir_find_entry(struct osfs_sb_info *sb_info, struct inode *dir,
+                                                  const char *name, size_t name_len,
+                                                  uint32_t *posp)
+{
+    struct osfs_inode *dir_inode = dir->i_private;
+    struct osfs_extent_cursor cursor = { 0 };
+    struct osfs_dir_entry *entry;
+    struct osfs_dir_index *index;
+    struct osfs_dir_slot *slot;
+    uint32_t hash, pos, i;
+
+    index = osfs_dir_index_get(sb_info, dir);
+    if (!index) {
+        osfs_dir_for_each_entry(sb_info, dir_inode, &cursor, entry, pos) {
+            if (osfs_dir_entry_matches(entry, name, name_len))
+                goto found;
+        }
+        return entry;
+    }
+
+    hash = osfs_name_hash(name, name_len);
+    for (i = hash & index->di_mask; index->di_slots[i].ds_pos != OSFS_DIR_SLOT_EMPTY;
+         i = (i + 1) & index->di_mask) {
+        slot = &index->di_slots[i];
+        if (slot->ds_pos == OSFS_DIR_SLOT_DELETED || slot->ds_hash != hash)
+            continue;
+        pos = slot->ds_pos;
+        entry = osfs_dir_block(sb_info, dir_inode, pos >> sb_info->block_bits, NULL);
+        if (!entry)
+            return ERR_PTR(-EIO);
+        entry = (void *)entry + (pos & (sb_info->block_size - 1));
+        if (osfs_dir_entry_matches(entry, name, name_len))
+            goto found;
+    }
+    return NULL;
+
+found:
+    if (posp)
+        *posp = pos;
+    return entry;
+}
+
+/**
+ * Function: osfs_dir_find_space
+ * Description: Finds room for an entry of rec_len bytes in the first block of
+ *              a directory that has it, either an unused record or the slack
+ *              after a used one, which is split off. The index tells which
+ *              blocks have room; without it every block is scanned.
+ * Inputs:
+ *   - sb_info: The superblock information structure.
+ *   - dir: The inode of the directory.
+ *   - rec_len: The record length the new entry needs.
+ *   - pos: Pointer to store the position of the returned record.
+ * Returns:
+ *   - The record to fill on success; its rec_len is already set.
+ *   - NULL if every block is full (or the directory has no block).
+ *   - ERR_PTR(-EIO) if the directory is corrupted.
+ */
+static struct osfs_dir_entry *osfs_dir_find_space(struct osfs_sb_info *sb_info, struct inode *dir,
+                                                  uint32_t rec_len, uint32_t *pos)
+{
+    struct osfs_dir_index *index = OSFS_I(dir)->i_dir_index;
+    struct osfs_inode *dir_inode = dir->i_private;
+    struct osfs_extent_cursor cursor = { 0 };
+    struct osfs_dir_entry *entry, *next;
+    uint32_t lblk, offset, used;
+    void *block;
+
+    for (lblk = 0; lblk < dir_inode->i_blocks; lblk++) {
+        if (index && lblk < index->di_nr_blocks && index->di_free[lblk] < rec_len)
+            continue;
+
+        block = osfs_dir_block(sb_info, dir_inode, lblk, &cursor);
+        if (!block)
+            return ERR_PTR(-EIO);
+
+        for (offset = 0; offset < sb_info->block_size; offset += osfs_rec_len(entry)) {
+            entry = block + offset;
+            if (!osfs_dir_entry_valid(sb_info, entry, offset)) {
+                pr_err("osfs_dir_find_space: Corrupted entry in directory %u\n",
+                       osfs_ino(sb_info, dir_inode));
+                return ERR_PTR(-EIO);
+            }
+
+            used = entry->inode_no ? OSFS_DIR_REC_LEN(entry->name_len) : 0;
+            if (osfs_rec_len(entry) - used < rec_len)
+                continue;
+
+            *pos = (lblk << sb_info->block_bits) + offset;
+            if (!used)
+                return entry;
+
+            next = (void *)entry + used;
+            osfs_set_rec_len(next, osfs_rec_len(entry) - used);
+            osfs_set_rec_len(entry, used);
+            *pos += used;
+            return next;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Function: osfs_dir_grow
+ * Description: Appends a block to a directory, placed right after its last one
+ *              when possible, and covers it with a single unused record.
+ * Inputs:
+ *   - sb_info: The superblock information structure.
+ *   - dir: The VFS inode of the directory.
+ *   - pos: Pointer to store the position of the new record.
+ * Returns:
+ *   - The unused record spanning the new block on success.
+ *   - ERR_PTR(-ENOSPC) if no data block is free or the directory is at its
+ *     maximum size.
+ *   - ERR_PTR(-ENOMEM) if memory allocation fails.
+ */
+static struct osfs_dir_entry *osfs_dir_grow(struct osfs_sb_info *sb_info, struct inode *dir,
+                                            uint32_t *pos)
+{
+    struct osfs_inode *dir_inode = dir->i_private;
+    uint32_t goal = OSFS_NO_GOAL;
+    struct osfs_dir_entry *entry;
+    struct osfs_extent *last;
+    uint32_t block_no, allocated;
+    int ret;
+
+    // Positions are 32 bits wide
+    if (dir_inode->i_size + sb_info->block_size > U32_MAX)
+        return ERR_PTR(-ENOSPC);
+
+    if (dir_inode->i_nr_extents) {
+        last = &osfs_extent_array(dir_inode)[dir_inode->i_nr_extents - 1];
+        goal = last->e_pblk + last->e_len;
+    }
+
+    ret = osfs_alloc_data_run(sb_info, goal, 1, &block_no, &allocated);
+    if (ret)
+        return ERR_PTR(ret);
+
+    entry = osfs_block_prepare(sb_info, block_no, GFP_KERNEL);
+    if (IS_ERR(entry)) {
+        osfs_free_data_block(sb_info, block_no);
+        return entry;
+    }
+
+    ret = osfs_extent_append(dir_inode, dir_inode->i_blocks, block_no, 1);
+    if (ret) {
+        osfs_free_data_block(sb_info, block_no);
+        return ERR_PTR(ret);
+    }
+
+    entry->inode_no = 0;
+    osfs_set_rec_len(entry, sb_info->block_size);
+    entry->name_len = 0;
+    entry->file_type = FT_UNKNOWN;
+
+    *pos = dir_inode->i_size;
+    dir_inode->i_blocks++;
+    dir_inode->i_size += sb_info->block_size;
+    i_size_write(dir, dir_inode->i_size);
+    return entry;
+}
+
+/**
+ * Function: osfs_dir_shrink
+ * Description: Frees the blocks left empty at the end of a directory, each
+ *              covered by a single unused record, and shortens it to match.
+ * Inputs:
+ *   - sb_info: The superblock information structure.
+ *   - dir: The VFS inode of the directory.
+ * Returns:
+ *   - true if any block was freed.
+ */
+static bool osfs_dir_shrink(struct osfs_sb_info *sb_info, struct inode *dir)
+{
+    struct osfs_inode *dir_inode = dir->i_private;
+    struct osfs_dir_entry *entry;
+    uint32_t lblk = dir_inode->i_blocks;
+
+    while (lblk) {
+        entry = osfs_dir_block(sb_info, dir_inode, lblk - 1, NULL);
+        if (!entry || entry->inode_no || osfs_rec_len(entry) != sb_info->block_size)
+            break;
+        lblk--;
+    }
+    if (lblk == dir_inode->i_blocks)
+        return false;
+
+    // Only trims the tail of the extents, which needs no allocation
+    osfs_extent_free_range(sb_info, dir_inode, lblk, U32_MAX);
+    dir_inode->i_size = (uint64_t)lblk << sb_info->block_bits;
+    i_size_write(dir, dir_inode->i_size);
+    osfs_journal_inode(sb_info, dir->i_ino);
+    return true;
+}
 
 /**
  * Function: osfs_lookup
- * Description: Looks up a file within a directory.
+ * Description: Looks up a file within a directory. A name that does not exist
+ *              is hashed as a negative dentry, so later lookups of it are
+ *              answered by the dcache, in RCU-walk, without coming here. Every
+ *              change to a directory goes through the VFS, which turns them
+ *              positive or drops them, so osfs needs no d_revalidate.
  * Inputs:
  *   - dir: The inode of the directory to search in.
  *   - dentry: The dentry representing the file to look up.
  *   - flags: Flags for the lookup operation.
  * Returns:
- *   - A pointer to the dentry if the file is found.
- *   - NULL if the file is not found, allowing the VFS to handle it.
+ *   - NULL with dentry hashed, positive if the file is found, negative if not.
+ *   - Another dentry already aliasing a found directory.
+ *   - ERR_PTR(-ENAMETOOLONG) if the name is too long.
+ *   - ERR_PTR(-EIO) if the directory is corrupted.
  */
 static struct dentry *osfs_lookup(struct inode *dir, struct dentry *dentry, unsigned int flags)
 {
     struct osfs_sb_info *sb_info = dir->i_sb->s_fs_info;
-    struct osfs_inode *parent_inode = dir->i_private;
-    void *dir_data_block;
-    struct osfs_dir_entry *dir_entries;
-    int dir_entry_count;
-    int i;
-    struct inode *inode = NULL;
-
-    pr_info("osfs_lookup: Looking up '%.*s' in inode %lu\n",
-            (int)dentry->d_name.len, dentry->d_name.name, dir->i_ino);
-
-    // Read the parent directory's data block
-    dir_data_block = sb_info->data_blocks + parent_inode->i_block * BLOCK_SIZE;
-
-    // Calculate the number of directory entries
-    dir_entry_count = parent_inode->i_size / sizeof(struct osfs_dir_entry);
-    dir_entries = (struct osfs_dir_entry *)dir_data_block;
-
-    // Traverse the directory entries to find a matching filename
-    for (i = 0; i < dir_entry_count; i++) {
-        if (strlen(dir_entries[i].filename) == dentry->d_name.len &&
-            strncmp(dir_entries[i].filename, dentry->d_name.name, dentry->d_name.len) == 0) {
-            // File found, get inode
-            inode = osfs_iget(dir->i_sb, dir_entries[i].inode_no);
-            if (IS_ERR(inode)) {
-                pr_err("osfs_lookup: Error getting inode %u\n", dir_entries[i].inode_no);
-                return ERR_CAST(inode);
-            }
-            return d_splice_alias(inode, dentry);
-        }
+    u64 stat_start = osfs_stat_start();
+    struct osfs_dir_entry *entry;
+    struct inode *inode;
+    unsigned long ino = 0;
+    struct dentry *ret;
+
+    if (dentry->d_name.len > MAX_FILENAME_LEN)
+        return ERR_PTR(-ENAMETOOLONG);
+
+    // Find the entry with a matching filename
+    entry = osfs_dir_find_entry(sb_info, dir, dentry->d_name.name, dentry->d_name.len,
+                                NULL);
+    if (IS_ERR(entry)) {
+        ret = ERR_CAST(entry);
+        goto out;
     }
 
-    return NULL;
+    // File found, get inode; left NULL a miss makes the dentry negative
+    inode = NULL;
+    if (entry) {
+        inode = osfs_iget(dir->i_sb, entry->inode_no);
+        if (IS_ERR(inode)) {
+            pr_err_ratelimited("osfs_lookup: Error getting inode %u\n", entry->inode_no);
+            ret = ERR_CAST(inode);
+            goto out;
+        }
+        ino = inode->i_ino;
+    }
+    ret = d_splice_alias(inode, dentry);
+out:
+    trace_osfs_lookup(dir, dentry, ino);
+    osfs_stat_end(sb_info, OSFS_STAT_LOOKUP, stat_start);
+    return ret;
 }
 
 /**
  * Function: osfs_iterate
- * Description: Iterates over the entries in a directory.
+ * Description: Iterates over the entries in a directory. Past the two dots,
+ *              ctx->pos is the position of the next entry plus 2.
  * Inputs:
  *   - filp: The file pointer representing the directory.
  *   - ctx: The directory context used for iteration.
@@ -66,35 +676,46 @@ static int osfs_iterate(struct file *filp, struct dir_context *ctx)
     struct inode *inode = file_inode(filp);
     struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
     struct osfs_inode *osfs_inode = inode->i_private;
-    void *dir_data_block;
-    struct osfs_dir_entry *dir_entries;
-    int dir_entry_count;
-    int i;
-
-    if (ctx->pos == 0) {
-        if (!dir_emit_dots(filp, ctx))
-            return 0;
-    }
-
-    dir_data_block = sb_info->data_blocks + osfs_inode->i_block * BLOCK_SIZE;
-    dir_entry_count = osfs_inode->i_size / sizeof(struct osfs_dir_entry);
-    dir_entries = (struct osfs_dir_entry *)dir_data_block;
+    struct osfs_extent_cursor cursor = { 0 };
+    struct osfs_dir_entry *entry;
+    uint32_t pos, offset, off;
+    void *block;
 
-    /* Adjust the index based on ctx->pos */
-    i = ctx->pos - 2;
+    // Resumes between the dots too; past them ctx->pos is at least 2
+    if (!dir_emit_dots(filp, ctx))
+        return 0;
+    if (ctx->pos - 2 >= osfs_inode->i_size)
+        return 0;
+    pos = ctx->pos - 2;
 
-    for (; i < dir_entry_count; i++) {
-        struct osfs_dir_entry *entry = &dir_entries[i];
-        unsigned int type = DT_UNKNOWN;
-
-        if (!dir_emit(ctx, entry->filename, strlen(entry->filename), entry->inode_no, type)) {
-            pr_err("osfs_iterate: dir_emit failed for entry '%s'\n", entry->filename);
-            return -EINVAL;
+    // A seek may have left pos inside an entry: resync on its block
+    offset = pos & (sb_info->block_size - 1);
+    if (offset) {
+        block = osfs_dir_block(sb_info, osfs_inode, pos >> sb_info->block_bits, &cursor);
+        if (!block)
+            return -EIO;
+        pos -= offset;
+        for (off = 0; off < offset; off += osfs_rec_len(entry)) {
+            entry = block + off;
+            if (!osfs_dir_entry_valid(sb_info, entry, off))
+                return -EIO;
         }
+        pos += off;
+    }
+
+    for (; (entry = osfs_dir_next(sb_info, osfs_inode, &cursor, &pos)) && !IS_ERR(entry);
+         pos += osfs_rec_len(entry)) {
+        // The type recorded at creation spares callers a stat() per entry
+        unsigned int type = fs_ftype_to_dtype(entry->file_type);
 
-        ctx->pos++;
+        ctx->pos = pos + 2;
+        if (!dir_emit(ctx, entry->name, entry->name_len, entry->inode_no, type))
+            return 0;
     }
+    if (IS_ERR(entry))
+        return PTR_ERR(entry);
 
+    ctx->pos = pos + 2;
     return 0;
 }
 
@@ -105,9 +726,10 @@ static int osfs_iterate(struct file *filp, struct dir_context *ctx)
  *   - dir: The inode of the directory where the new inode will be created.
  *   - mode: The mode (permissions and type) for the new inode.
  * Returns:
- *   - A pointer to the newly created inode on success.
+ *   - A pointer to the newly created inode on success, still I_NEW: callers
+ *     bind it with d_instantiate_new, or drop it with discard_new_inode.
  *   - ERR_PTR(-EINVAL) if the file type is not supported.
- *   - ERR_PTR(-ENOSPC) if there are no free inodes or blocks.
+ *   - ERR_PTR(-ENOSPC) if there are no free inodes.
  *   - ERR_PTR(-ENOMEM) if memory allocation fails.
  *   - ERR_PTR(-EIO) if an I/O error occurs.
  */
@@ -117,16 +739,15 @@ struct inode *osfs_new_inode(const struct inode *dir, umode_t mode)
     struct osfs_sb_info *sb_info = sb->s_fs_info;
     struct inode *inode;
     struct osfs_inode *osfs_inode;
-    int ino, ret;
+    struct osfs_inode_meta *meta;
+    int ino;
 
     /* Check if the mode is supported */
-    if (!S_ISDIR(mode) && !S_ISREG(mode) && !S_ISLNK(mode)) {
-        pr_err("File type not supported (only directory, regular file and symlink supported)\n");
+    if (!S_ISDIR(mode) && !S_ISREG(mode) && !S_ISLNK(mode))
         return ERR_PTR(-EINVAL);
-    }
 
-    /* Check if there are free inodes and blocks */
-    if (sb_info->nr_free_inodes == 0 || sb_info->nr_free_blocks == 0)
+    /* Check if there are free inodes; blocks are only allocated on first write */
+    if (percpu_counter_read_positive(&sb_info->nr_free_inodes) == 0)
         return ERR_PTR(-ENOSPC);
 
     /* Allocate a new inode number */
@@ -136,13 +757,25 @@ struct inode *osfs_new_inode(const struct inode *dir, umode_t mode)
 
     /* Allocate a new VFS inode */
     inode = new_inode(sb);
-    if (!inode)
+    if (!inode) {
+        osfs_put_free_inode(sb_info, ino);
         return ERR_PTR(-ENOMEM);
+    }
 
     /* Initialize inode owner and permissions */
     inode_init_owner(&nop_mnt_idmap, inode, dir, mode);
     inode->i_ino = ino;
     inode->i_sb = sb;
+
+    /*
+     * Hash it locked: the previous user of the number may still be evicting,
+     * and osfs_iget waits for that one to go, then for this one to be set up
+     */
+    if (insert_inode_locked(inode) < 0) {
+        pr_err("osfs_new_inode: Inode %d is free but still in use\n", ino);
+        iput(inode);
+        return ERR_PTR(-EIO);
+    }
     inode->i_blocks = 0;
     simple_inode_init_ts(inode);
 
@@ -155,6 +788,7 @@ struct inode *osfs_new_inode(const struct inode *dir, umode_t mode)
     } else if (S_ISREG(mode)) {
         inode->i_op = &osfs_file_inode_operations;
         inode->i_fop = &osfs_file_operations;
+        inode->i_mapping->a_ops = &osfs_aops;
         set_nlink(inode, 1);
         inode->i_size = 0;
     } else if (S_ISLNK(mode)) {
@@ -163,35 +797,29 @@ struct inode *osfs_new_inode(const struct inode *dir, umode_t mode)
         inode->i_size = 0;
     }
 
-    /* Get osfs_inode */
+    /* Get both halves of the osfs inode */
     osfs_inode = osfs_get_osfs_inode(sb, ino);
-    if (!osfs_inode) {
+    meta = osfs_get_inode_meta(sb, ino);
+    if (!osfs_inode || !meta) {
         pr_err("osfs_new_inode: Failed to get osfs_inode for inode %d\n", ino);
-        iput(inode);
+        discard_new_inode(inode);
         return ERR_PTR(-EIO);
     }
     memset(osfs_inode, 0, sizeof(*osfs_inode));
+    memset(meta, 0, sizeof(*meta));
 
     /* Initialize osfs_inode */
-    osfs_inode->i_ino = ino;
     osfs_inode->i_mode = inode->i_mode;
-    osfs_inode->i_uid = i_uid_read(inode);
-    osfs_inode->i_gid = i_gid_read(inode);
+    osfs_inode->i_links_count = inode->i_nlink;
     osfs_inode->i_size = inode->i_size;
-    osfs_inode->i_blocks = 1; // Simplified handling
-    osfs_inode->__i_atime = osfs_inode->__i_mtime = osfs_inode->__i_ctime = current_time(inode);
+    osfs_inode->i_blocks = 0;
+    meta->i_ino = ino;
+    meta->i_uid = i_uid_read(inode);
+    meta->i_gid = i_gid_read(inode);
+    meta->__i_atime = meta->__i_mtime = meta->__i_ctime = current_time(inode);
     inode->i_private = osfs_inode;
 
-    /* Allocate data block */
-    ret = osfs_alloc_data_block(sb_info, &osfs_inode->i_block);
-    if (ret) {
-        pr_err("osfs_new_inode: Failed to allocate data block\n");
-        iput(inode);
-        return ERR_PTR(ret);
-    }
-
-    /* Update superblock information */
-    sb_info->nr_free_inodes--;
+    osfs_journal_inode(sb_info, ino);
 
     /* Mark inode as dirty */
     mark_inode_dirty(inode);
@@ -199,50 +827,174 @@ struct inode *osfs_new_inode(const struct inode *dir, umode_t mode)
     return inode;
 }
 
-static int osfs_add_dir_entry(struct inode *dir, uint32_t inode_no, const char *name, size_t name_len)
+/**
+ * Function: osfs_add_dir_entry
+ * Description: Adds an entry to a directory, in the first block with room for
+ *              it or in a newly appended block.
+ * Inputs:
+ *   - dir: The inode of the directory.
+ *   - inode_no: The inode number the entry points to.
+ *   - mode: The mode of that inode, whose type is recorded in the entry.
+ *   - name: The name of the entry.
+ *   - name_len: The length of the name, at most MAX_FILENAME_LEN.
+ * Returns:
+ *   - 0 on success.
+ *   - -EEXIST if the directory already has an entry with that name.
+ *   - -ENOSPC if the directory cannot grow.
+ *   - A negative error code on other failures.
+ */
+static int osfs_add_dir_entry(struct inode *dir, uint32_t inode_no, umode_t mode,
+                              const char *name, size_t name_len)
 {
     struct osfs_sb_info *sb_info = dir->i_sb->s_fs_info;
     struct osfs_inode *parent_inode = dir->i_private;
-    void *dir_data_block;
-    struct osfs_dir_entry *dir_entries;
-    int dir_entry_count;
-    int i;
+    struct osfs_dir_entry *entry;
+    uint32_t pos;
 
-    // Read the parent directory's data block
-    dir_data_block = sb_info->data_blocks + parent_inode->i_block * BLOCK_SIZE;
+    // Check if a file with the same name exists
+    entry = osfs_dir_find_entry(sb_info, dir, name, name_len, NULL);
+    if (IS_ERR(entry))
+        return PTR_ERR(entry);
+    if (entry)
+        return -EEXIST;
 
-    // Calculate the existing number of directory entries
-    dir_entry_count = parent_inode->i_size / sizeof(struct osfs_dir_entry);
-    if (dir_entry_count >= MAX_DIR_ENTRIES) {
-        pr_err("osfs_add_dir_entry: Parent directory is full\n");
-        return -ENOSPC;
-    }
+    // Take room in any block, or append a block when they are all full
+    entry = osfs_dir_find_space(sb_info, dir, OSFS_DIR_REC_LEN(name_len), &pos);
+    if (!entry)
+        entry = osfs_dir_grow(sb_info, dir, &pos);
+    if (IS_ERR(entry))
+        return PTR_ERR(entry);
 
-    dir_entries = (struct osfs_dir_entry *)dir_data_block;
+    // Fill in the new directory entry
+    entry->inode_no = inode_no;
+    entry->name_len = name_len;
+    entry->file_type = fs_umode_to_ftype(mode);
+    memcpy(entry->name, name, name_len);
+    // Covers the split or the initialisation of the block done above as well
+    osfs_dir_block_dirty(sb_info, parent_inode, pos);
+    osfs_dir_index_insert(sb_info, dir, entry, pos);
+    // The directory may have grown; later changes in the same handle are covered too
+    osfs_journal_inode(sb_info, dir->i_ino);
 
-    // Check if a file with the same name exists
-    for (i = 0; i < dir_entry_count; i++) {
-        if (strlen(dir_entries[i].filename) == name_len &&
-            strncmp(dir_entries[i].filename, name, name_len) == 0) {
-            pr_warn("osfs_add_dir_entry: File '%.*s' already exists\n", (int)name_len, name);
-            return -EEXIST;
+    return 0;
+}
+
+/**
+ * Function: osfs_dir_remove_entry
+ * Description: Removes the entry of a name from a directory. The record is
+ *              merged into the one before it in its block, or marked unused
+ *              when it starts the block; nothing else moves, so the cost only
+ *              depends on the block size, and the index slot becomes a
+ *              tombstone. Blocks this leaves empty at the end of the
+ *              directory are freed.
+ * Inputs:
+ *   - dir: The inode of the directory.
+ *   - name: The name of the entry.
+ *   - name_len: The length of the name.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOENT if the directory has no entry with that name.
+ *   - -EIO if the directory is corrupted.
+ */
+static int osfs_dir_remove_entry(struct inode *dir, const char *name, size_t name_len)
+{
+    struct osfs_sb_info *sb_info = dir->i_sb->s_fs_info;
+    struct osfs_inode *dir_inode = dir->i_private;
+    struct osfs_dir_entry *entry, *prev;
+    uint32_t pos, offset, off;
+    void *block;
+
+    entry = osfs_dir_find_entry(sb_info, dir, name, name_len, &pos);
+    if (IS_ERR(entry))
+        return PTR_ERR(entry);
+    if (!entry)
+        return -ENOENT;
+
+    // Find the record before the entry, if the entry does not start its block
+    offset = pos & (sb_info->block_size - 1);
+    block = (void *)entry - offset;
+    prev = NULL;
+    if (offset) {
+        off = 0;
+        prev = block;
+        while (osfs_dir_entry_valid(sb_info, prev, off) && off + osfs_rec_len(prev) < offset) {
+            off += osfs_rec_len(prev);
+            prev = block + off;
+        }
+        if (!osfs_dir_entry_valid(sb_info, prev, off) || off + osfs_rec_len(prev) != offset) {
+            pr_err("osfs_dir_remove_entry: Corrupted block in directory %lu\n", dir->i_ino);
+            return -EIO;
         }
     }
 
-    // Add a new directory entry
-    strncpy(dir_entries[dir_entry_count].filename, name, name_len);
-    dir_entries[dir_entry_count].filename[name_len] = '\0';
-    dir_entries[dir_entry_count].inode_no = inode_no;
-
-    // Update the size of the parent directory
-    parent_inode->i_size += sizeof(struct osfs_dir_entry);
+    // The slot is found through the name, still in place
+    osfs_dir_index_delete(dir, entry, pos);
+    if (prev)
+        osfs_set_rec_len(prev, osfs_rec_len(prev) + osfs_rec_len(entry));
+    else
+        entry->inode_no = 0;
+    osfs_dir_index_set_free(sb_info, dir, pos >> sb_info->block_bits, block);
 
+    // A last block left empty goes, with the empty ones before it
+    if ((pos >> sb_info->block_bits) + 1 != dir_inode->i_blocks || !osfs_dir_shrink(sb_info, dir))
+        osfs_dir_block_dirty(sb_info, dir_inode, pos);
     return 0;
 }
 
+/**
+ * Function: osfs_dir_empty
+ * Description: Tells whether a directory has no entry besides the dots, which
+ *              are not stored.
+ * Inputs:
+ *   - dir: The inode of the directory.
+ * Returns:
+ *   - 0 if it is empty.
+ *   - -ENOTEMPTY if it holds an entry.
+ *   - -EIO if the directory is corrupted.
+ */
+static int osfs_dir_empty(struct inode *dir)
+{
+    struct osfs_dir_index *index = READ_ONCE(OSFS_I(dir)->i_dir_index);
+    struct osfs_dir_entry *entry;
+    uint32_t pos = 0;
+
+    if (index)
+        return index->di_count ? -ENOTEMPTY : 0;
+    entry = osfs_dir_next(dir->i_sb->s_fs_info, dir->i_private, NULL, &pos);
+    if (IS_ERR(entry))
+        return PTR_ERR(entry);
+    return entry ? -ENOTEMPTY : 0;
+}
 
 /**
- * Function: osfs_create
+ * Function: osfs_inode_changed
+ * Description: Stamps the change time of an inode, and the modification time
+ *              of a directory whose entries changed, then records them and the
+ *              link count in the osfs inode and the running transaction.
+ * Inputs:
+ *   - inode: The inode.
+ *   - modified: Whether the contents changed too.
+ * Returns:
+ *   - None.
+ */
+static void osfs_inode_changed(struct inode *inode, bool modified)
+{
+    struct osfs_inode_meta *meta = osfs_get_inode_meta(inode->i_sb, inode->i_ino);
+    struct osfs_inode *osfs_inode = inode->i_private;
+    struct timespec64 now = inode_set_ctime_current(inode);
+
+    if (modified)
+        inode_set_mtime_to_ts(inode, now);
+    osfs_inode->i_links_count = inode->i_nlink;
+    meta->__i_mtime = inode_get_mtime(inode);
+    meta->__i_ctime = now;
+    mark_inode_dirty(inode);
+    osfs_journal_inode(inode->i_sb->s_fs_info, inode->i_ino);
+}
+
+
+/**
+ * Function: __osfs_create
  * Description: Creates a new file within a directory.
  * Inputs:
  *   - idmap: The mount namespace ID map.
@@ -257,61 +1009,79 @@ static int osfs_add_dir_entry(struct inode *dir, uint32_t inode_no, const char *
  *   - -ENOSPC if the parent directory is full.
  *   - A negative error code from osfs_new_inode on failure.
  */
-static int osfs_create(struct mnt_idmap *idmap, struct inode *dir, struct dentry *dentry, umode_t mode, bool excl)
+static int __osfs_create(struct mnt_idmap *idmap, struct inode *dir, struct dentry *dentry, umode_t mode, bool excl)
 {   
     // Step1: Parse the parent directory passed by the VFS 
     // struct osfs_inode *parent_inode = dir->i_private;
+    struct osfs_sb_info *sb_info = dir->i_sb->s_fs_info;
     struct osfs_inode *osfs_inode;
     struct inode *inode;
     int ret;
 
     // Step2: Validate the file name length
     int len = dentry->d_name.len;
-    if (len > MAX_FILENAME_LEN) {
-        pr_err("osfs_create: File name too long\n");
+    if (len > MAX_FILENAME_LEN)
         return -ENAMETOOLONG;
-    }
 
-    // Step3: Allocate and initialize VFS & osfs inode
+    // Step3: Allocate and initialize VFS & osfs inode, in one transaction with the entry
+    osfs_journal_start(sb_info);
     inode = osfs_new_inode(dir, mode);
     if (IS_ERR(inode)) {
-        pr_err("osfs_create: Failed to create new inode\n");
+        osfs_journal_stop(sb_info);
         return PTR_ERR(inode);
     }
     
 
     osfs_inode = inode->i_private;
     if (!osfs_inode) {
+        osfs_journal_stop(sb_info);
         pr_err("osfs_create: Failed to get osfs_inode for inode %lu\n", inode->i_ino);
-        iput(inode);
+        discard_new_inode(inode);
         return -EIO;
     }
-    // init osfs_inode attribute
-    osfs_inode->i_block = 0; 
-    osfs_inode->i_size = 0;
-    osfs_inode->i_blocks = 0;
 
     // Step4: Parent directory entry update for the new file
+    ret = osfs_add_dir_entry(dir, inode->i_ino, inode->i_mode, dentry->d_name.name, len);
+    osfs_journal_stop(sb_info);
     if (ret) {
-        pr_err("osfs_create: Failed to add directory entry\n");
-        iput(inode);
+        // Unlinked, the inode number is freed with the inode
+        clear_nlink(inode);
+        discard_new_inode(inode);
         return ret;
     }
-
-    // Step 5: Update the parent directory's metadata
-    osfs_add_dir_entry(dir, inode->i_ino, dentry->d_name.name, len);
     
-    // Step 6: Bind the inode to the VFS dentry
-    d_instantiate(dentry, inode);
+    // Step5: Bind the inode to the VFS dentry
+    d_instantiate_new(dentry, inode);
+    return 0;
+}
 
-    pr_info("osfs_create: File '%.*s' created with inode %lu\n",
-            (int)dentry->d_name.len, dentry->d_name.name, inode->i_ino);
+/**
+ * Function: osfs_create
+ * Description: Creates a new file within a directory, see __osfs_create, and
+ *              accounts for it in the statistics and the trace.
+ * Inputs:
+ *   - idmap: The mount namespace ID map.
+ *   - dir: The inode of the parent directory.
+ *   - dentry: The dentry representing the new file.
+ *   - mode: The mode (permissions and type) for the new file.
+ *   - excl: Whether the creation should be exclusive.
+ * Returns:
+ *   - The result of __osfs_create.
+ */
+static int osfs_create(struct mnt_idmap *idmap, struct inode *dir, struct dentry *dentry, umode_t mode, bool excl)
+{
+    u64 stat_start = osfs_stat_start();
+    int ret;
 
-    return 0;
+    ret = __osfs_create(idmap, dir, dentry, mode, excl);
+    if (!ret)
+        trace_osfs_create(dir, dentry, d_inode(dentry));
+    osfs_stat_end(dir->i_sb->s_fs_info, OSFS_STAT_CREATE, stat_start);
+    return ret;
 }
 
 /**
- * Function: osfs_mkdir
+ * Function: __osfs_mkdir
  * Description: Creates a new directory within a parent directory.
  * Inputs:
  *   - idmap: The mount namespace ID map.
@@ -325,94 +1095,294 @@ static int osfs_create(struct mnt_idmap *idmap, struct inode *dir, struct dentry
  *   - -ENOSPC if the parent directory is full.
  *   - A negative error code from osfs_new_inode on failure.
  */
-static int osfs_mkdir(struct mnt_idmap *idmap, struct inode *dir, struct dentry *dentry, umode_t mode)
+static int __osfs_mkdir(struct mnt_idmap *idmap, struct inode *dir, struct dentry *dentry, umode_t mode)
 {
+    struct osfs_sb_info *sb_info = dir->i_sb->s_fs_info;
     struct inode *inode;
     int ret;
 
     // Step1: Validate the directory name length
     int len = dentry->d_name.len;
-    if (len > MAX_FILENAME_LEN) {
-        pr_err("osfs_mkdir: Directory name too long\n");
+    if (len > MAX_FILENAME_LEN)
         return -ENAMETOOLONG;
-    }
 
-    // Step2: Allocate and initialize VFS & osfs inode
+    // Step2: Allocate and initialize VFS & osfs inode, in one transaction with the entry
+    osfs_journal_start(sb_info);
     inode = osfs_new_inode(dir, mode | S_IFDIR);
     if (IS_ERR(inode)) {
-        pr_err("osfs_mkdir: Failed to create new inode\n");
+        osfs_journal_stop(sb_info);
         return PTR_ERR(inode);
     }
 
     // Step3: Add directory entry for the new directory
-    ret = osfs_add_dir_entry(dir, inode->i_ino, dentry->d_name.name, len);
+    ret = osfs_add_dir_entry(dir, inode->i_ino, inode->i_mode, dentry->d_name.name, len);
     if (ret) {
-        pr_err("osfs_mkdir: Failed to add directory entry\n");
-        iput(inode);
+        osfs_journal_stop(sb_info);
+        clear_nlink(inode);
+        discard_new_inode(inode);
         return ret;
     }
 
-    // Step4: Update the parent directory's metadata
+    // Step4: Update the parent directory's metadata, logged with the entry
     inc_nlink(dir);
+    ((struct osfs_inode *)dir->i_private)->i_links_count = dir->i_nlink;
     mark_inode_dirty(dir);
+    osfs_journal_stop(sb_info);
 
     // Step5: Bind the inode to the VFS dentry
-    d_instantiate(dentry, inode);
+    d_instantiate_new(dentry, inode);
+    return 0;
+}
 
-    pr_info("osfs_mkdir: Directory '%.*s' created with inode %lu\n",
-            (int)dentry->d_name.len, dentry->d_name.name, inode->i_ino);
+/**
+ * Function: osfs_mkdir
+ * Description: Creates a new directory, see __osfs_mkdir, and accounts for it
+ *              in the statistics and the trace.
+ * Inputs:
+ *   - idmap: The mount namespace ID map.
+ *   - dir: The inode of the parent directory.
+ *   - dentry: The dentry representing the new directory.
+ *   - mode: The mode (permissions and type) for the new directory.
+ * Returns:
+ *   - The result of __osfs_mkdir.
+ */
+static int osfs_mkdir(struct mnt_idmap *idmap, struct inode *dir, struct dentry *dentry, umode_t mode)
+{
+    u64 stat_start = osfs_stat_start();
+    int ret;
 
-    return 0;
+    ret = __osfs_mkdir(idmap, dir, dentry, mode);
+    if (!ret)
+        trace_osfs_create(dir, dentry, d_inode(dentry));
+    osfs_stat_end(dir->i_sb->s_fs_info, OSFS_STAT_MKDIR, stat_start);
+    return ret;
 }
 
 /**
  * Function: osfs_unlink
- * Description: Unlinks (deletes) a file.
+ * Description: Removes the entry of a file from its directory and drops a
+ *              link. The file itself goes when its last link and its last
+ *              user do, in osfs_evict_inode.
  * Inputs:
  *   - dir: The directory inode containing the file to be unlinked.
  *   - dentry: The dentry representing the file to be unlinked.
  * Returns:
  *   - 0 on success.
- *   - -ENOENT if the file does not exist.
+ *   - -ENOENT if the directory has no such entry.
+ *   - -EIO if the directory is corrupted.
  */
 static int osfs_unlink(struct inode *dir, struct dentry *dentry)
 {
+    struct osfs_sb_info *sb_info = dir->i_sb->s_fs_info;
     struct inode *inode = d_inode(dentry);
-    struct osfs_inode *osfs_inode = inode->i_private;
-    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    u64 stat_start = osfs_stat_start();
+    int ret;
 
-    // Step1: Check if the file exists
-    if (!inode)
-        return -ENOENT;
+    osfs_journal_start(sb_info);
+    ret = osfs_dir_remove_entry(dir, dentry->d_name.name, dentry->d_name.len);
+    if (!ret) {
+        drop_nlink(inode);
+        osfs_inode_changed(inode, false);
+        osfs_inode_changed(dir, true);
+    }
+    osfs_journal_stop(sb_info);
+
+    osfs_stat_end(sb_info, OSFS_STAT_UNLINK, stat_start);
+    return ret;
+}
 
-    // Step2: Free the data block if allocated
-    if (osfs_inode->i_blocks > 0) {
-        osfs_free_data_block(sb_info, osfs_inode->i_block);
-        osfs_inode->i_blocks = 0;
+/**
+ * Function: osfs_rmdir
+ * Description: Removes an empty directory. Its blocks are freed with it, in
+ *              osfs_evict_inode.
+ * Inputs:
+ *   - dir: The parent directory.
+ *   - dentry: The dentry of the directory to remove.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOTEMPTY if the directory holds entries.
+ *   - -ENOENT if the parent has no such entry.
+ *   - -EIO if a directory is corrupted.
+ */
+static int osfs_rmdir(struct inode *dir, struct dentry *dentry)
+{
+    struct osfs_sb_info *sb_info = dir->i_sb->s_fs_info;
+    struct inode *inode = d_inode(dentry);
+    u64 stat_start = osfs_stat_start();
+    int ret;
+
+    ret = osfs_dir_empty(inode);
+    if (ret)
+        goto out;
+
+    osfs_journal_start(sb_info);
+    ret = osfs_dir_remove_entry(dir, dentry->d_name.name, dentry->d_name.len);
+    if (!ret) {
+        clear_nlink(inode);
+        osfs_inode_changed(inode, false);
+        drop_nlink(dir);
+        osfs_inode_changed(dir, true);
     }
+    osfs_journal_stop(sb_info);
+out:
+    osfs_stat_end(sb_info, OSFS_STAT_UNLINK, stat_start);
+    return ret;
+}
 
-    // Step3: Remove the dentry from the directory
-    d_drop(dentry);
+/**
+ * Function: osfs_link
+ * Description: Adds a hard link to a file.
+ * Inputs:
+ *   - old_dentry: A dentry of the file.
+ *   - dir: The directory to add the link to.
+ *   - dentry: The negative dentry of the new name.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENAMETOOLONG if the name is too long.
+ *   - -ENOSPC if the directory cannot grow.
+ *   - A negative error code from osfs_add_dir_entry on other failures.
+ */
+static int osfs_link(struct dentry *old_dentry, struct inode *dir, struct dentry *dentry)
+{
+    struct osfs_sb_info *sb_info = dir->i_sb->s_fs_info;
+    struct inode *inode = d_inode(old_dentry);
+    u64 stat_start = osfs_stat_start();
+    int ret;
 
-    // Step4: Update the inode attributes
-    clear_nlink(inode);
-    mark_inode_dirty(inode);
+    if (dentry->d_name.len > MAX_FILENAME_LEN)
+        return -ENAMETOOLONG;
 
-    return 0;
+    osfs_journal_start(sb_info);
+    ret = osfs_add_dir_entry(dir, inode->i_ino, inode->i_mode, dentry->d_name.name,
+                             dentry->d_name.len);
+    if (!ret) {
+        inc_nlink(inode);
+        osfs_inode_changed(inode, false);
+        osfs_inode_changed(dir, true);
+    }
+    osfs_journal_stop(sb_info);
+
+    if (!ret) {
+        ihold(inode);
+        d_instantiate(dentry, inode);
+    }
+    osfs_stat_end(sb_info, OSFS_STAT_LINK, stat_start);
+    return ret;
 }
 
+/**
+ * Function: osfs_rename
+ * Description: Moves an entry to a new name, possibly in another directory,
+ *              in one journal handle. An existing target is replaced in place:
+ *              its entry is pointed at the moved inode, so the name never
+ *              disappears, which is what write-then-rename publishing relies
+ *              on. Otherwise the new entry is added before the old one is
+ *              removed, so a failure leaves everything as it was.
+ * Inputs:
+ *   - idmap: The idmap of the mount.
+ *   - old_dir: The directory holding the entry.
+ *   - old_dentry: The dentry of the entry.
+ *   - new_dir: The directory to move the entry to.
+ *   - new_dentry: The dentry of the new name, negative or to be replaced.
+ *   - flags: RENAME_* flags; only RENAME_NOREPLACE is supported.
+ * Returns:
+ *   - 0 on success.
+ *   - -EINVAL for unsupported flags.
+ *   - -ENAMETOOLONG if the new name is too long.
+ *   - -ENOTEMPTY if the target is a directory holding entries.
+ *   - -ENOSPC if the new directory cannot grow.
+ *   - -EIO if a directory is corrupted.
+ */
+static int osfs_rename(struct mnt_idmap *idmap, struct inode *old_dir, struct dentry *old_dentry,
+                       struct inode *new_dir, struct dentry *new_dentry, unsigned int flags)
+{
+    struct osfs_sb_info *sb_info = old_dir->i_sb->s_fs_info;
+    struct inode *inode = d_inode(old_dentry);
+    struct inode *new_inode = d_inode(new_dentry);
+    bool is_dir = S_ISDIR(inode->i_mode);
+    u64 stat_start = osfs_stat_start();
+    struct osfs_dir_entry *entry;
+    uint32_t pos;
+    int ret;
+
+    // RENAME_NOREPLACE is enforced by the VFS: the target is negative
+    if (flags & ~RENAME_NOREPLACE)
+        return -EINVAL;
+    if (new_dentry->d_name.len > MAX_FILENAME_LEN)
+        return -ENAMETOOLONG;
+    if (new_inode && is_dir) {
+        ret = osfs_dir_empty(new_inode);
+        if (ret)
+            return ret;
+    }
+
+    osfs_journal_start(sb_info);
+    // Check the old entry first: once the new one is in, removing it must not fail
+    entry = osfs_dir_find_entry(sb_info, old_dir, old_dentry->d_name.name,
+                                old_dentry->d_name.len, NULL);
+    ret = IS_ERR(entry) ? PTR_ERR(entry) : entry ? 0 : -ENOENT;
+    if (ret)
+        goto out;
 
+    if (new_inode) {
+        entry = osfs_dir_find_entry(sb_info, new_dir, new_dentry->d_name.name,
+                                    new_dentry->d_name.len, &pos);
+        ret = IS_ERR(entry) ? PTR_ERR(entry) : entry ? 0 : -ENOENT;
+        if (ret)
+            goto out;
+        entry->inode_no = inode->i_ino;
+        entry->file_type = fs_umode_to_ftype(inode->i_mode);
+        osfs_dir_block_dirty(sb_info, new_dir->i_private, pos);
+    } else {
+        ret = osfs_add_dir_entry(new_dir, inode->i_ino, inode->i_mode, new_dentry->d_name.name,
+                                 new_dentry->d_name.len);
+        if (ret)
+            goto out;
+    }
+
+    ret = osfs_dir_remove_entry(old_dir, old_dentry->d_name.name, old_dentry->d_name.len);
+    if (ret)
+        goto out;
+
+    if (new_inode) {
+        if (is_dir) {
+            clear_nlink(new_inode);
+            drop_nlink(old_dir);
+        } else {
+            drop_nlink(new_inode);
+        }
+        osfs_inode_changed(new_inode, false);
+    } else if (is_dir && old_dir != new_dir) {
+        drop_nlink(old_dir);
+        inc_nlink(new_dir);
+    }
+    osfs_inode_changed(inode, false);
+    osfs_inode_changed(old_dir, true);
+    if (new_dir != old_dir)
+        osfs_inode_changed(new_dir, true);
+out:
+    osfs_journal_stop(sb_info);
+    osfs_stat_end(sb_info, OSFS_STAT_RENAME, stat_start);
+    return ret;
+}
 
 const struct inode_operations osfs_dir_inode_operations = {
     .lookup = osfs_lookup,
     .create = osfs_create,
-    // Add other operations as needed
+    .link = osfs_link,
+    .unlink = osfs_unlink,
     .mkdir = osfs_mkdir,
-    .rmdir = osfs_unlink,
+    .rmdir = osfs_rmdir,
+    .rename = osfs_rename,
+    .getattr = osfs_getattr,
+    // Add other operations as needed
 };
 
 const struct file_operations osfs_dir_operations = {
     .iterate_shared = osfs_iterate,
     .llseek = generic_file_llseek,
+    .fsync = osfs_fsync,
+    .unlocked_ioctl = osfs_ioctl,
+    .compat_ioctl = osfs_ioctl,
     // Add other operations as needed
 };
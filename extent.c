@@ -0,0 +1,811 @@
+#include <linux/fs.h>
+#include <linux/log2.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include "osfs.h"
+
+static struct kmem_cache *osfs_extent_cachep;
+static struct kmem_cache *osfs_inline_cachep;
+
+/**
+ * Function: osfs_init_extent_cache
+ * Description: Creates the slab caches holding the first spilled extent array
+ *              of each file, OSFS_EXTENT_CHUNK extents long, and the contents
+ *              of inline files.
+ * Inputs:
+ *   - None.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if a cache cannot be created.
+ */
+int osfs_init_extent_cache(void)
+{
+    osfs_extent_cachep = kmem_cache_create("osfs_extent_cache",
+                                           OSFS_EXTENT_CHUNK * sizeof(struct osfs_extent), 0,
+                                           SLAB_ACCOUNT, NULL);
+    if (!osfs_extent_cachep)
+        return -ENOMEM;
+    osfs_inline_cachep = kmem_cache_create("osfs_inline_cache", OSFS_INLINE_DATA_MAX, 0,
+                                           SLAB_ACCOUNT, NULL);
+    if (!osfs_inline_cachep) {
+        kmem_cache_destroy(osfs_extent_cachep);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+/**
+ * Function: osfs_destroy_extent_cache
+ * Description: Destroys the extent array and inline data caches.
+ * Inputs:
+ *   - None.
+ * Returns:
+ *   - None.
+ */
+void osfs_destroy_extent_cache(void)
+{
+    kmem_cache_destroy(osfs_inline_cachep);
+    kmem_cache_destroy(osfs_extent_cachep);
+}
+
+/**
+ * Function: osfs_extent_release_array
+ * Description: Frees the spilled extent array of an inode, if any, and empties
+ *              its extent map. The data blocks are left alone.
+ * Inputs:
+ *   - osfs_inode: The osfs inode owning the extents.
+ * Returns:
+ *   - None.
+ */
+void osfs_extent_release_array(struct osfs_inode *osfs_inode)
+{
+    if (osfs_inode->i_extents) {
+        if (osfs_inode->i_extent_cap == OSFS_EXTENT_CHUNK)
+            kmem_cache_free(osfs_extent_cachep, osfs_inode->i_extents);
+        else
+            kvfree(osfs_inode->i_extents);
+    }
+    osfs_inode->i_extents = NULL;
+    osfs_inode->i_extent_cap = 0;
+    osfs_inode->i_nr_extents = 0;
+}
+
+/**
+ * Function: osfs_extent_alloc_array
+ * Description: Gives an inode with an empty extent map room for nr extents, in
+ *              the same tier osfs_extent_grow would have reached, e.g. before
+ *              loading them from an image.
+ * Inputs:
+ *   - osfs_inode: The osfs inode, holding no extents.
+ *   - nr: The number of extents to make room for.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if memory allocation fails.
+ */
+int osfs_extent_alloc_array(struct osfs_inode *osfs_inode, uint32_t nr)
+{
+    struct osfs_extent *ext;
+    uint32_t cap;
+
+    if (nr <= OSFS_INLINE_EXTENTS)
+        return 0;
+
+    if (nr <= OSFS_EXTENT_CHUNK) {
+        cap = OSFS_EXTENT_CHUNK;
+        ext = kmem_cache_alloc(osfs_extent_cachep, GFP_KERNEL);
+    } else {
+        cap = roundup_pow_of_two(nr);
+        ext = kvmalloc_array(cap, sizeof(*ext), GFP_KERNEL);
+    }
+    if (!ext)
+        return -ENOMEM;
+
+    osfs_inode->i_extents = ext;
+    osfs_inode->i_extent_cap = cap;
+    return 0;
+}
+
+/**
+ * Function: osfs_extent_grow
+ * Description: Makes room for more extents. The inline array spills into an
+ *              osfs_extent_cache object, which is then replaced by arrays of
+ *              twice the size, so appends reallocate O(log n) times.
+ * Inputs:
+ *   - osfs_inode: The osfs inode owning the extents.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if memory allocation fails.
+ */
+static int osfs_extent_grow(struct osfs_inode *osfs_inode)
+{
+    uint32_t nr = osfs_inode->i_nr_extents;
+    struct osfs_extent *ext;
+    uint32_t cap;
+
+    if (!osfs_inode->i_extents) {
+        cap = OSFS_EXTENT_CHUNK;
+        ext = kmem_cache_alloc(osfs_extent_cachep, GFP_KERNEL);
+    } else {
+        cap = osfs_inode->i_extent_cap * 2;
+        ext = kvmalloc_array(cap, sizeof(*ext), GFP_KERNEL);
+    }
+    if (!ext)
+        return -ENOMEM;
+
+    memcpy(ext, osfs_extent_array(osfs_inode), nr * sizeof(*ext));
+    osfs_extent_release_array(osfs_inode);
+    osfs_inode->i_extents = ext;
+    osfs_inode->i_extent_cap = cap;
+    osfs_inode->i_nr_extents = nr;
+    return 0;
+}
+
+/**
+ * Function: osfs_extent_lookup
+ * Description: Finds the extent mapping a file block. The extent array is kept
+ *              sorted by e_lblk, so the search is a binary search. A cursor, when
+ *              given, remembers the last extent hit so sequential I/O resolves
+ *              in O(1) by checking that extent and its successor first.
+ * Inputs:
+ *   - osfs_inode: The osfs inode owning the extents.
+ *   - lblk: The block index inside the file.
+ *   - cursor: Optional lookup hint, updated on success (may be NULL).
+ *   - pblk: Pointer to store the data block number backing lblk.
+ *   - count: Optional pointer to store how many blocks, starting at lblk, are
+ *            physically contiguous within the extent.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOENT if no data block backs lblk.
+ */
+int osfs_extent_lookup(struct osfs_inode *osfs_inode, uint32_t lblk,
+                       struct osfs_extent_cursor *cursor, uint32_t *pblk, uint32_t *count)
+{
+    struct osfs_extent *ext = osfs_extent_array(osfs_inode);
+    uint32_t lo = 0, hi = osfs_inode->i_nr_extents;
+    uint32_t idx;
+
+    if (cursor) {
+        idx = READ_ONCE(cursor->ec_index);
+        if (idx < hi && lblk >= ext[idx].e_lblk) {
+            if (lblk < ext[idx].e_lblk + ext[idx].e_len)
+                goto found;
+            if (idx + 1 < hi && lblk >= ext[idx + 1].e_lblk &&
+                lblk < ext[idx + 1].e_lblk + ext[idx + 1].e_len) {
+                idx++;
+                goto found;
+            }
+            // Random access forward of the hint: only search the tail
+            lo = idx + 1;
+        }
+    }
+
+    while (lo < hi) {
+        idx = lo + (hi - lo) / 2;
+        if (lblk < ext[idx].e_lblk)
+            hi = idx;
+        else if (lblk >= ext[idx].e_lblk + ext[idx].e_len)
+            lo = idx + 1;
+        else
+            goto found;
+    }
+    return -ENOENT;
+
+found:
+    if (cursor)
+        WRITE_ONCE(cursor->ec_index, idx);
+    *pblk = ext[idx].e_pblk + (lblk - ext[idx].e_lblk);
+    if (count)
+        *count = ext[idx].e_len - (lblk - ext[idx].e_lblk);
+    return 0;
+}
+
+/**
+ * Function: osfs_extent_after
+ * Description: Finds the first extent starting after a file block, where an
+ *              extent for a hole at that block would be inserted.
+ * Inputs:
+ *   - osfs_inode: The osfs inode owning the extents.
+ *   - lblk: The block index inside the file.
+ * Returns:
+ *   - The index of that extent, i_nr_extents if there is none.
+ */
+static uint32_t osfs_extent_after(struct osfs_inode *osfs_inode, uint32_t lblk)
+{
+    struct osfs_extent *ext = osfs_extent_array(osfs_inode);
+    uint32_t lo = 0, hi = osfs_inode->i_nr_extents, idx;
+
+    while (lo < hi) {
+        idx = lo + (hi - lo) / 2;
+        if (lblk < ext[idx].e_lblk)
+            hi = idx;
+        else
+            lo = idx + 1;
+    }
+    return lo;
+}
+
+/**
+ * Function: osfs_extent_append
+ * Description: Appends a run of data blocks at the end of a file's extent array,
+ *              merging it into the last extent when both are contiguous and
+ *              growing the array when it is full.
+ * Inputs:
+ *   - osfs_inode: The osfs inode owning the extents.
+ *   - lblk: The first file block of the run (must follow every existing extent).
+ *   - pblk: The first data block of the run.
+ *   - len: The number of blocks in the run.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if the extent array cannot be grown.
+ */
+int osfs_extent_append(struct osfs_inode *osfs_inode, uint32_t lblk, uint32_t pblk, uint32_t len)
+{
+    struct osfs_extent *ext;
+
+    uint32_t cap = osfs_inode->i_extents ? osfs_inode->i_extent_cap : OSFS_INLINE_EXTENTS;
+    int ret;
+
+    if (osfs_inode->i_nr_extents) {
+        ext = &osfs_extent_array(osfs_inode)[osfs_inode->i_nr_extents - 1];
+        if (ext->e_lblk + ext->e_len == lblk && ext->e_pblk + ext->e_len == pblk) {
+            ext->e_len += len;
+            return 0;
+        }
+    }
+
+    if (osfs_inode->i_nr_extents == cap) {
+        ret = osfs_extent_grow(osfs_inode);
+        if (ret)
+            return ret;
+    }
+
+    ext = &osfs_extent_array(osfs_inode)[osfs_inode->i_nr_extents++];
+    ext->e_lblk = lblk;
+    ext->e_pblk = pblk;
+    ext->e_len = len;
+    return 0;
+}
+
+/**
+ * Function: osfs_extent_insert
+ * Description: Maps a run of data blocks into a hole of a file, merging it
+ *              with the extents before and after it when they continue it both
+ *              logically and physically.
+ * Inputs:
+ *   - osfs_inode: The osfs inode owning the extents.
+ *   - lblk: The first file block of the run, which must be unmapped up to
+ *           lblk + len.
+ *   - pblk: The first data block of the run.
+ *   - len: The number of blocks in the run.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if the extent array cannot be grown.
+ */
+static int osfs_extent_insert(struct osfs_inode *osfs_inode, uint32_t lblk, uint32_t pblk,
+                              uint32_t len)
+{
+    uint32_t idx = osfs_extent_after(osfs_inode, lblk), nr = osfs_inode->i_nr_extents, cap;
+    struct osfs_extent *ext = osfs_extent_array(osfs_inode);
+    bool prev, next;
+    int ret;
+
+    if (idx == nr)
+        return osfs_extent_append(osfs_inode, lblk, pblk, len);
+
+    prev = idx && ext[idx - 1].e_lblk + ext[idx - 1].e_len == lblk &&
+           ext[idx - 1].e_pblk + ext[idx - 1].e_len == pblk;
+    next = lblk + len == ext[idx].e_lblk && pblk + len == ext[idx].e_pblk;
+    if (prev && next) {
+        ext[idx - 1].e_len += len + ext[idx].e_len;
+        memmove(&ext[idx], &ext[idx + 1], (nr - idx - 1) * sizeof(*ext));
+        osfs_inode->i_nr_extents--;
+        return 0;
+    }
+    if (prev) {
+        ext[idx - 1].e_len += len;
+        return 0;
+    }
+    if (next) {
+        ext[idx].e_lblk = lblk;
+        ext[idx].e_pblk = pblk;
+        ext[idx].e_len += len;
+        return 0;
+    }
+
+    cap = osfs_inode->i_extents ? osfs_inode->i_extent_cap : OSFS_INLINE_EXTENTS;
+    if (nr == cap) {
+        ret = osfs_extent_grow(osfs_inode);
+        if (ret)
+            return ret;
+        ext = osfs_extent_array(osfs_inode);
+    }
+    memmove(&ext[idx + 1], &ext[idx], (nr - idx) * sizeof(*ext));
+    ext[idx].e_lblk = lblk;
+    ext[idx].e_pblk = pblk;
+    ext[idx].e_len = len;
+    osfs_inode->i_nr_extents++;
+    return 0;
+}
+
+/**
+ * Function: osfs_extent_free_range
+ * Description: Unmaps the blocks of a file in [start, end) and drops its
+ *              references to the data blocks behind them, which are freed
+ *              unless clones still share them. Extents reaching into the range
+ *              are trimmed; only one strictly containing it needs a new entry,
+ *              which is made before anything is freed.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - osfs_inode: The osfs inode owning the extents.
+ *   - start: The first file block to unmap.
+ *   - end: The file block after the last one to unmap.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if the extent array cannot be grown; nothing is unmapped then.
+ */
+int osfs_extent_free_range(struct osfs_sb_info *sb_info, struct osfs_inode *osfs_inode,
+                           uint32_t start, uint32_t end)
+{
+    uint32_t idx = osfs_extent_after(osfs_inode, start), i, n, s, t, last, cap;
+    struct osfs_extent *ext = osfs_extent_array(osfs_inode), e;
+    int ret;
+
+    // Punching the middle of an extent: split it at end first
+    if (idx && ext[idx - 1].e_lblk < start && ext[idx - 1].e_lblk + ext[idx - 1].e_len > end) {
+        cap = osfs_inode->i_extents ? osfs_inode->i_extent_cap : OSFS_INLINE_EXTENTS;
+        if (osfs_inode->i_nr_extents == cap) {
+            ret = osfs_extent_grow(osfs_inode);
+            if (ret)
+                return ret;
+            ext = osfs_extent_array(osfs_inode);
+        }
+        e = ext[idx - 1];
+        memmove(&ext[idx + 1], &ext[idx], (osfs_inode->i_nr_extents - idx) * sizeof(*ext));
+        osfs_inode->i_nr_extents++;
+        ext[idx - 1].e_len = end - e.e_lblk;
+        ext[idx].e_lblk = end;
+        ext[idx].e_pblk = e.e_pblk + (end - e.e_lblk);
+        ext[idx].e_len = e.e_lblk + e.e_len - end;
+    }
+
+    // Every extent now keeps at most one end, so the array compacts in place
+    for (i = 0, n = 0; i < osfs_inode->i_nr_extents; i++) {
+        e = ext[i];
+        last = e.e_lblk + e.e_len;
+        if (last <= start || e.e_lblk >= end) {
+            ext[n++] = e;
+            continue;
+        }
+        s = max(start, e.e_lblk);
+        t = min(end, last);
+        osfs_free_data_run(sb_info, e.e_pblk + (s - e.e_lblk), t - s);
+        osfs_inode->i_blocks -= t - s;
+        if (e.e_lblk < s) {
+            ext[n] = e;
+            ext[n++].e_len = s - e.e_lblk;
+        } else if (t < last) {
+            ext[n].e_lblk = t;
+            ext[n].e_pblk = e.e_pblk + (t - e.e_lblk);
+            ext[n++].e_len = last - t;
+        }
+    }
+    if (n)
+        osfs_inode->i_nr_extents = n;
+    else
+        osfs_extent_release_array(osfs_inode);
+    return 0;
+}
+
+/**
+ * Function: osfs_extent_remap_block
+ * Description: Points one file block at another data block, splitting the
+ *              extent covering it into up to three so the array stays sorted.
+ * Inputs:
+ *   - osfs_inode: The osfs inode owning the extents.
+ *   - lblk: The file block to remap, which must be mapped.
+ *   - pblk: The data block to map it to.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOENT if lblk is not mapped.
+ *   - -ENOMEM if the extent array cannot be grown.
+ */
+int osfs_extent_remap_block(struct osfs_inode *osfs_inode, uint32_t lblk, uint32_t pblk)
+{
+    struct osfs_extent *ext = osfs_extent_array(osfs_inode);
+    uint32_t lo = 0, hi = osfs_inode->i_nr_extents;
+    uint32_t idx, need, cap, last;
+    struct osfs_extent old;
+    int ret;
+
+    while (lo < hi) {
+        idx = lo + (hi - lo) / 2;
+        if (lblk < ext[idx].e_lblk)
+            hi = idx;
+        else if (lblk >= ext[idx].e_lblk + ext[idx].e_len)
+            lo = idx + 1;
+        else
+            break;
+    }
+    if (lo >= hi)
+        return -ENOENT;
+
+    old = ext[idx];
+    if (old.e_len == 1) {
+        ext[idx].e_pblk = pblk;
+        return 0;
+    }
+
+    // One new extent at either end of the old one, two in its middle
+    last = old.e_lblk + old.e_len - 1;
+    need = (lblk == old.e_lblk || lblk == last) ? 1 : 2;
+    cap = osfs_inode->i_extents ? osfs_inode->i_extent_cap : OSFS_INLINE_EXTENTS;
+    while (osfs_inode->i_nr_extents + need > cap) {
+        ret = osfs_extent_grow(osfs_inode);
+        if (ret)
+            return ret;
+        cap = osfs_inode->i_extent_cap;
+    }
+
+    ext = osfs_extent_array(osfs_inode);
+    memmove(&ext[idx + 1 + need], &ext[idx + 1],
+            (osfs_inode->i_nr_extents - idx - 1) * sizeof(*ext));
+    osfs_inode->i_nr_extents += need;
+
+    if (lblk > old.e_lblk) {
+        ext[idx].e_len = lblk - old.e_lblk;
+        idx++;
+    }
+    ext[idx].e_lblk = lblk;
+    ext[idx].e_pblk = pblk;
+    ext[idx].e_len = 1;
+    if (lblk < last) {
+        idx++;
+        ext[idx].e_lblk = lblk + 1;
+        ext[idx].e_pblk = old.e_pblk + (lblk + 1 - old.e_lblk);
+        ext[idx].e_len = last - lblk;
+    }
+    return 0;
+}
+
+/**
+ * Function: osfs_extent_unshare
+ * Description: Breaks the sharing of a file block with the clones of the file
+ *              before it is modified: the block is copied into a newly
+ *              allocated one, which the file block is remapped to, and the
+ *              file's reference to the shared block is dropped. Called with
+ *              the extent lock held for writing.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - osfs_inode: The osfs inode owning the extents.
+ *   - lblk: The file block about to be modified.
+ * Returns:
+ *   - 0 on success, or if lblk is unmapped or not shared.
+ *   - -ENOSPC if no data block is free for the copy.
+ *   - A negative error code on other failures.
+ */
+int osfs_extent_unshare(struct osfs_sb_info *sb_info, struct osfs_inode *osfs_inode,
+                        uint32_t lblk)
+{
+    uint32_t old, new, goal = OSFS_NO_GOAL, allocated;
+    void *data_block;
+    int ret;
+
+    if (osfs_extent_lookup(osfs_inode, lblk, NULL, &old, NULL) ||
+        !osfs_block_shared(sb_info, old))
+        return 0;
+
+    // Keep the copy next to the block before it, so sequential runs survive
+    if (lblk && !osfs_extent_lookup(osfs_inode, lblk - 1, NULL, &goal, NULL))
+        goal++;
+    ret = osfs_alloc_data_run(sb_info, goal, 1, &new, &allocated);
+    if (ret)
+        return ret;
+
+    data_block = osfs_block_prepare(sb_info, new, GFP_KERNEL);
+    ret = IS_ERR(data_block) ? PTR_ERR(data_block) :
+          osfs_read_blocks(sb_info, old, data_block, sb_info->block_size);
+    if (!ret)
+        ret = osfs_extent_remap_block(osfs_inode, lblk, new);
+    if (ret) {
+        osfs_free_data_block(sb_info, new);
+        return ret;
+    }
+    osfs_block_dirty(sb_info, new);
+    osfs_free_data_block(sb_info, old);
+    return 0;
+}
+
+/**
+ * Function: osfs_prealloc_window
+ * Description: Sizes the preallocation window of a growing file. The window
+ *              tracks the file size, so streaming writers reserve ever longer
+ *              contiguous runs ahead of themselves.
+ * Inputs:
+ *   - osfs_inode: The osfs inode being extended.
+ *   - want: The number of blocks the current write needs.
+ * Returns:
+ *   - The number of blocks to reserve beyond want.
+ */
+static uint32_t osfs_prealloc_window(struct osfs_inode *osfs_inode, uint32_t want)
+{
+    uint32_t size = osfs_inode->i_blocks + want;
+
+    return clamp_t(uint32_t, roundup_pow_of_two(size), OSFS_PREALLOC_MIN, OSFS_PREALLOC_MAX);
+}
+
+/**
+ * Function: osfs_extent_reserve
+ * Description: Makes sure the file blocks in [lblk, end) are backed by data
+ *              blocks, filling the holes of the range. Past the last extent,
+ *              new blocks come from the file's preallocation window when it
+ *              has any; otherwise a run of want + window blocks is requested
+ *              right after the last extent, and whatever the file does not
+ *              need yet becomes the new window. Holes between extents are
+ *              filled with runs placed right after the block before them.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - osfs_inode: The osfs inode to grow.
+ *   - lblk: The first file block that must be allocated.
+ *   - end: The file block after the last one that must be allocated.
+ * Returns:
+ *   - 0 on success; on failure, the blocks already mapped stay.
+ *   - -ENOMEM if the extent array cannot be grown.
+ *   - -ENOSPC if there are not enough free data blocks.
+ */
+int osfs_extent_reserve(struct osfs_sb_info *sb_info, struct osfs_inode *osfs_inode,
+                        uint32_t lblk, uint32_t end)
+{
+    struct osfs_extent *ext;
+    uint32_t want, goal, block_no, allocated, take, idx;
+    int ret;
+
+    while (lblk < end) {
+        if (!osfs_extent_lookup(osfs_inode, lblk, NULL, &block_no, &take)) {
+            lblk += min(take, end - lblk);
+            continue;
+        }
+        ext = osfs_extent_array(osfs_inode);
+        idx = osfs_extent_after(osfs_inode, lblk);
+        want = (idx < osfs_inode->i_nr_extents ? min(end, ext[idx].e_lblk) : end) - lblk;
+
+        if (idx < osfs_inode->i_nr_extents) {
+            goal = idx ? ext[idx - 1].e_pblk + ext[idx - 1].e_len : OSFS_NO_GOAL;
+            ret = osfs_alloc_data_run(sb_info, goal, want, &block_no, &take);
+            if (ret)
+                return ret;
+            ret = osfs_extent_insert(osfs_inode, lblk, block_no, take);
+            if (ret) {
+                osfs_free_data_run(sb_info, block_no, take);
+                return ret;
+            }
+        } else {
+            if (!osfs_inode->i_pa_len) {
+                goal = idx ? ext[idx - 1].e_pblk + ext[idx - 1].e_len : OSFS_NO_GOAL;
+                ret = osfs_alloc_data_run(sb_info, goal,
+                                          want + osfs_prealloc_window(osfs_inode, want),
+                                          &block_no, &allocated);
+                if (ret)
+                    return ret;
+                osfs_inode->i_pa_start = block_no;
+                osfs_inode->i_pa_len = allocated;
+                percpu_counter_add(&sb_info->nr_prealloc_blocks, allocated);
+            }
+
+            take = min(want, osfs_inode->i_pa_len);
+            ret = osfs_extent_append(osfs_inode, lblk, osfs_inode->i_pa_start, take);
+            if (ret)
+                return ret;
+            osfs_inode->i_pa_start += take;
+            osfs_inode->i_pa_len -= take;
+            percpu_counter_sub(&sb_info->nr_prealloc_blocks, take);
+        }
+        osfs_inode->i_blocks += take;
+        lblk += take;
+    }
+    return 0;
+}
+
+/**
+ * Function: osfs_extent_discard_prealloc
+ * Description: Returns the unused part of a file's preallocation window to the
+ *              free pool, e.g. when its last writer closes it.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - osfs_inode: The osfs inode owning the window.
+ * Returns:
+ *   - None.
+ */
+void osfs_extent_discard_prealloc(struct osfs_sb_info *sb_info, struct osfs_inode *osfs_inode)
+{
+    if (!osfs_inode->i_pa_len)
+        return;
+    osfs_free_data_run(sb_info, osfs_inode->i_pa_start, osfs_inode->i_pa_len);
+    percpu_counter_sub(&sb_info->nr_prealloc_blocks, osfs_inode->i_pa_len);
+    osfs_inode->i_pa_len = 0;
+}
+
+/**
+ * Function: osfs_reclaim_prealloc
+ * Description: Takes back the preallocation windows of other files when an
+ *              allocation runs out of blocks, as the windows would otherwise
+ *              only come back when their files are closed. Files whose extent
+ *              lock is held are being written to and keep theirs; the lock is
+ *              only tried, as the caller holds its own.
+ * Inputs:
+ *   - sb: The superblock of the filesystem.
+ *   - self: The file allocating, whose window is already used up.
+ * Returns:
+ *   - true if any block came back.
+ */
+bool osfs_reclaim_prealloc(struct super_block *sb, struct inode *self)
+{
+    struct osfs_sb_info *sb_info = sb->s_fs_info;
+    struct osfs_inode *osfs_inode;
+    struct inode *inode;
+    bool freed = false;
+    unsigned long ino;
+
+    // Nothing to scan the inode table for
+    if (percpu_counter_sum_positive(&sb_info->nr_prealloc_blocks) == 0)
+        return false;
+
+    for_each_set_bit(ino, sb_info->inode_bitmap, sb_info->inode_count) {
+        if (ino == self->i_ino || !READ_ONCE(sb_info->inode_table[ino].i_pa_len))
+            continue;
+        // Windows only exist while their files are in core
+        inode = ilookup(sb, ino);
+        if (!inode)
+            continue;
+        if (down_write_trylock(&OSFS_I(inode)->i_extent_sem)) {
+            osfs_inode = inode->i_private;
+            if (osfs_inode && osfs_inode->i_pa_len) {
+                osfs_extent_discard_prealloc(sb_info, osfs_inode);
+                freed = true;
+            }
+            up_write(&OSFS_I(inode)->i_extent_sem);
+        }
+        iput(inode);
+        cond_resched();
+    }
+    return freed;
+}
+
+/**
+ * Function: osfs_inline_get
+ * Description: Returns the contents of an inline file. Called with the extent
+ *              lock of the file held.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - ino: The inode number.
+ * Returns:
+ *   - The OSFS_INLINE_DATA_MAX bytes of the file, NULL while they are zeros.
+ */
+void *osfs_inline_get(struct osfs_sb_info *sb_info, uint32_t ino)
+{
+    return xa_load(&sb_info->inline_data, ino);
+}
+
+/**
+ * Function: osfs_inline_prepare
+ * Description: Returns the contents of an inline file, allocating them zeroed
+ *              on first use, so a write into them cannot fail. Called with the
+ *              extent lock of the file held for writing.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - ino: The inode number.
+ *   - gfp: Allocation flags.
+ * Returns:
+ *   - The OSFS_INLINE_DATA_MAX bytes of the file on success.
+ *   - ERR_PTR(-ENOMEM) if memory allocation fails.
+ */
+void *osfs_inline_prepare(struct osfs_sb_info *sb_info, uint32_t ino, gfp_t gfp)
+{
+    void *data = xa_load(&sb_info->inline_data, ino);
+    int ret;
+
+    if (data)
+        return data;
+    data = kmem_cache_zalloc(osfs_inline_cachep, gfp);
+    if (!data)
+        return ERR_PTR(-ENOMEM);
+    ret = xa_err(xa_store(&sb_info->inline_data, ino, data, gfp));
+    if (ret) {
+        kmem_cache_free(osfs_inline_cachep, data);
+        return ERR_PTR(ret);
+    }
+    return data;
+}
+
+/**
+ * Function: osfs_inline_release
+ * Description: Frees the contents of an inline file, if any.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - ino: The inode number.
+ * Returns:
+ *   - None.
+ */
+void osfs_inline_release(struct osfs_sb_info *sb_info, uint32_t ino)
+{
+    void *data = xa_erase(&sb_info->inline_data, ino);
+
+    if (data)
+        kmem_cache_free(osfs_inline_cachep, data);
+}
+
+/**
+ * Function: osfs_inline_spill
+ * Description: Moves the contents of an inline file into a first data block
+ *              allocated for them, before the file stops being inline: it
+ *              grows past OSFS_INLINE_DATA_MAX or gets other blocks. Files that
+ *              are not inline, or whose contents are still zeros, are left
+ *              alone. Called with the extent lock held for writing.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - osfs_inode: The osfs inode.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOSPC if no data block is free.
+ *   - -ENOMEM if the memory behind the block cannot be allocated.
+ */
+int osfs_inline_spill(struct osfs_sb_info *sb_info, struct osfs_inode *osfs_inode)
+{
+    uint32_t ino = osfs_ino(sb_info, osfs_inode), pblk;
+    void *data = osfs_inline_get(sb_info, ino), *data_block;
+    int ret;
+
+    if (!data || !osfs_inode_inline(osfs_inode))
+        return 0;
+    ret = osfs_extent_reserve(sb_info, osfs_inode, 0, 1);
+    if (ret)
+        return ret;
+    osfs_extent_lookup(osfs_inode, 0, NULL, &pblk, NULL);
+    data_block = osfs_block_prepare(sb_info, pblk, GFP_KERNEL);
+    if (IS_ERR(data_block))
+        return PTR_ERR(data_block);
+    memcpy(data_block, data, OSFS_INLINE_DATA_MAX);
+    osfs_block_dirty(sb_info, pblk);
+    osfs_inline_release(sb_info, ino);
+    return 0;
+}
+
+/**
+ * Function: osfs_inline_destroy
+ * Description: Frees the contents of every inline file, at unmount.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ * Returns:
+ *   - None.
+ */
+void osfs_inline_destroy(struct osfs_sb_info *sb_info)
+{
+    unsigned long ino;
+    void *data;
+
+    xa_for_each(&sb_info->inline_data, ino, data)
+        kmem_cache_free(osfs_inline_cachep, data);
+    xa_destroy(&sb_info->inline_data);
+}
+
+/**
+ * Function: osfs_extent_free_all
+ * Description: Releases every data block of a file, its preallocation window,
+ *              its extent array and its inline data.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - osfs_inode: The osfs inode to empty.
+ * Returns:
+ *   - None.
+ */
+void osfs_extent_free_all(struct osfs_sb_info *sb_info, struct osfs_inode *osfs_inode)
+{
+    struct osfs_extent *ext = osfs_extent_array(osfs_inode);
+    uint32_t i;
+
+    osfs_extent_discard_prealloc(sb_info, osfs_inode);
+    for (i = 0; i < osfs_inode->i_nr_extents; i++)
+        osfs_free_data_run(sb_info, ext[i].e_pblk, ext[i].e_len);
+    osfs_extent_release_array(osfs_inode);
+    osfs_inode->i_blocks = 0;
+    osfs_inline_release(sb_info, osfs_ino(sb_info, osfs_inode));
+}
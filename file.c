@@ -1,240 +1,1483 @@
+#include <linux/falloc.h>
+#include <linux/file.h>
 #include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/splice.h>
+#include <linux/pagemap.h>
+#include <linux/highmem.h>
+#include <linux/writeback.h>
 #include <linux/uaccess.h>
 #include "osfs.h"
+#include "osfs_trace.h"
 
 /**
- * Function: osfs_read
- * Description: Reads data from a file.
+ * Function: osfs_file_cursor
+ * Description: Returns the extent lookup hint of an open file.
  * Inputs:
- *   - filp: The file pointer representing the file to read from.
- *   - buf: The user-space buffer to copy the data into.
- *   - len: The number of bytes to read.
- *   - ppos: The file position pointer.
+ *   - file: The open file (may be NULL, e.g. for readahead without a file).
  * Returns:
- *   - The number of bytes read on success.
- *   - 0 if the end of the file is reached.
- *   - -EFAULT if copying data to user space fails.
+ *   - The cursor allocated by osfs_file_open, or NULL.
+ */
+static struct osfs_extent_cursor *osfs_file_cursor(struct file *file)
+{
+    return file ? file->private_data : NULL;
+}
+
+/**
+ * Function: osfs_fill_folio
+ * Description: Copies the data blocks backing a folio into it. Extents that are
+ *              physically adjacent are merged so every contiguous run of data
+ *              blocks is a single copy. Holes and bytes past EOF read as zeros.
+ *              An inline file is copied from its inline data.
+ * Inputs:
+ *   - inode: The inode owning the folio.
+ *   - folio: The locked folio to fill.
+ *   - cursor: Optional extent lookup hint.
+ * Returns:
+ *   - 0 on success; the folio is marked uptodate.
+ *   - A negative error code if a data block cannot be read from the image.
  */
-static ssize_t osfs_read(struct file *filp, char __user *buf, size_t len, loff_t *ppos)
+static int osfs_fill_folio(struct inode *inode, struct folio *folio,
+                           struct osfs_extent_cursor *cursor)
 {
-    struct inode *inode = file_inode(filp);
     struct osfs_inode *osfs_inode = inode->i_private;
     struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    loff_t pos = folio_pos(folio);
+    loff_t i_size = i_size_read(inode);
+    unsigned int blkbits = inode->i_blkbits;
+    size_t offset = 0, end = folio_size(folio), run;
+    uint32_t lblk, pblk, next_pblk, nr, count;
     void *data_block;
-    ssize_t bytes_read;
+    char *kaddr;
+    int ret = 0;
 
-    // If the file has not been allocated a data block, it indicates the file is empty
-    if (osfs_inode->i_blocks == 0)
-        return 0;
+    if (i_size <= pos)
+        end = 0;
+    else if (i_size - pos < end)
+        end = i_size - pos;
 
-    if (*ppos >= osfs_inode->i_size)
-        return 0;
+    down_read(&OSFS_I(inode)->i_extent_sem);
+    kaddr = kmap_local_folio(folio, 0);
+    if (osfs_inode_inline(osfs_inode)) {
+        data_block = osfs_inline_get(sb_info, inode->i_ino);
+        end = pos ? 0 : min_t(size_t, end, OSFS_INLINE_DATA_MAX);
+        if (data_block)
+            memcpy(kaddr, data_block, end);
+        else
+            memset(kaddr, 0, end);
+        offset = end;
+    }
+    while (offset < end) {
+        lblk = (pos + offset) >> blkbits;
+        if (osfs_extent_lookup(osfs_inode, lblk, cursor, &pblk, &nr)) {
+            memset(kaddr + offset, 0, 1U << blkbits);
+            offset += 1U << blkbits;
+            continue;
+        }
 
-    if (*ppos + len > osfs_inode->i_size)
-        len = osfs_inode->i_size - *ppos;
-
-    // data_block = sb_info->data_blocks + osfs_inode->i_block * BLOCK_SIZE + *ppos;
-    // if (copy_to_user(buf, data_block, len))
-    //     return -EFAULT;
-
-    // MODED
-    int32_t idx_of_block = *ppos / BLOCK_SIZE;
-    int32_t offset_in_block = *ppos % BLOCK_SIZE;
-    int32_t idx_of_iblock = 0;
-    while(idx_of_block > 0) {
-        if (idx_of_block >= osfs_inode->i_blocks_length[idx_of_iblock]) {
-            idx_of_block -= osfs_inode->i_blocks_length[idx_of_iblock];
-            idx_of_iblock++;
-        } else {
+        // Extend the run across following extents that continue physically
+        while (offset + ((size_t)nr << blkbits) < end &&
+               !osfs_extent_lookup(osfs_inode, lblk + nr, cursor, &next_pblk, &count) &&
+               next_pblk == pblk + nr)
+            nr += count;
+
+        run = min_t(size_t, (size_t)nr << blkbits, end - offset);
+        ret = osfs_read_blocks(sb_info, pblk, kaddr + offset, run);
+        if (ret)
+            break;
+        offset += run;
+    }
+
+    // Never expose whatever lies behind EOF in the last block
+    if (end < folio_size(folio))
+        memset(kaddr + end, 0, folio_size(folio) - end);
+    kunmap_local(kaddr);
+    up_read(&OSFS_I(inode)->i_extent_sem);
+
+    if (ret)
+        return ret;
+    flush_dcache_folio(folio);
+    folio_mark_uptodate(folio);
+    return 0;
+}
+
+/**
+ * Function: osfs_read_folio
+ * Description: Fills a page cache folio from the file's data blocks.
+ * Inputs:
+ *   - file: The file being read (may be NULL).
+ *   - folio: The locked folio to fill.
+ * Returns:
+ *   - 0 on success.
+ */
+static int osfs_read_folio(struct file *file, struct folio *folio)
+{
+    int ret;
+
+    ret = osfs_fill_folio(folio->mapping->host, folio, osfs_file_cursor(file));
+    folio_unlock(folio);
+    return ret;
+}
+
+/**
+ * Function: osfs_readahead
+ * Description: Fills every folio of a readahead window with one walk of the
+ *              extent array, carrying the cursor from folio to folio.
+ * Inputs:
+ *   - rac: The readahead control describing the window.
+ * Returns:
+ *   - None.
+ */
+static void osfs_readahead(struct readahead_control *rac)
+{
+    struct inode *inode = rac->mapping->host;
+    struct osfs_extent_cursor local = { 0 };
+    struct osfs_extent_cursor *cursor = osfs_file_cursor(rac->file);
+    struct folio *folio;
+
+    if (!cursor)
+        cursor = &local;
+
+    while ((folio = readahead_folio(rac)) != NULL) {
+        osfs_fill_folio(inode, folio, cursor);
+        folio_unlock(folio);
+    }
+}
+
+/**
+ * Function: osfs_prepare_range
+ * Description: Fast path of osfs_reserve_range, under the extent lock held
+ *              shared: when every block of the range is already allocated to
+ *              the file and not shared, e.g. for rewrites, only the memory
+ *              behind the blocks is allocated.
+ * Inputs:
+ *   - inode: The inode of the file.
+ *   - lblk: The first file block of the range.
+ *   - end: The file block after the last one of the range.
+ *   - end_pos: The file position the write ends at.
+ *   - gfp: Allocation flags; without blocking allowed, the lock is only tried.
+ *   - cursor: Optional extent lookup hint.
+ * Returns:
+ *   - 0 if the range is ready.
+ *   - -EAGAIN if a block needs the slow path, or the lock or memory is not
+ *     available without blocking.
+ *   - A negative error code if a block cannot be brought in.
+ */
+static int osfs_prepare_range(struct inode *inode, uint32_t lblk, uint32_t end, loff_t end_pos,
+                              gfp_t gfp, struct osfs_extent_cursor *cursor)
+{
+    struct osfs_inode *osfs_inode = inode->i_private;
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    uint32_t pblk;
+    void *data_block;
+    int ret = 0;
+
+    if (gfpflags_allow_blocking(gfp))
+        down_read(&OSFS_I(inode)->i_extent_sem);
+    else if (!down_read_trylock(&OSFS_I(inode)->i_extent_sem))
+        return -EAGAIN;
+
+    // Two shared holders could both allocate the inline data
+    if (osfs_inode_inline(osfs_inode)) {
+        if (end_pos > OSFS_INLINE_DATA_MAX || !osfs_inline_get(sb_info, inode->i_ino))
+            ret = -EAGAIN;
+        goto out;
+    }
+    for (; lblk < end; lblk++) {
+        if (osfs_extent_lookup(osfs_inode, lblk, cursor, &pblk, NULL) ||
+            osfs_block_shared(sb_info, pblk)) {
+            ret = -EAGAIN;
+            break;
+        }
+        data_block = osfs_block_prepare(sb_info, pblk, gfp);
+        if (IS_ERR(data_block)) {
+            ret = PTR_ERR(data_block);
             break;
         }
     }
-    data_block = sb_info->data_blocks + osfs_inode->i_blocks_ptr[idx_of_iblock] * BLOCK_SIZE + idx_of_block * BLOCK_SIZE + offset_in_block;
-    if (copy_to_user(buf, data_block, len))
-        return -EFAULT;
+out:
+    up_read(&OSFS_I(inode)->i_extent_sem);
+    return ret;
+}
 
-    *ppos += len;
-    bytes_read = len;
+/**
+ * Function: osfs_reserve_blocks
+ * Description: Maps the holes of [lblk, end) in a file to data blocks, after
+ *              moving any inline data into a block. When this runs out of
+ *              blocks, the preallocation windows of other files are taken
+ *              back and it is tried once more. Called with the extent lock
+ *              held for writing.
+ * Inputs:
+ *   - inode: The inode of the file.
+ *   - lblk: The first file block to map.
+ *   - end: The file block after the last one to map.
+ * Returns:
+ *   - 0 on success; on failure, the blocks already mapped stay.
+ *   - -ENOSPC if there are not enough free data blocks.
+ *   - -ENOMEM if memory allocation fails.
+ */
+static int osfs_reserve_blocks(struct inode *inode, uint32_t lblk, uint32_t end)
+{
+    struct osfs_inode *osfs_inode = inode->i_private;
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    int ret;
 
-    return bytes_read;
+    ret = osfs_inline_spill(sb_info, osfs_inode);
+    if (!ret)
+        ret = osfs_extent_reserve(sb_info, osfs_inode, lblk, end);
+    if (ret == -ENOSPC && osfs_reclaim_prealloc(inode->i_sb, inode)) {
+        ret = osfs_inline_spill(sb_info, osfs_inode);
+        if (!ret)
+            ret = osfs_extent_reserve(sb_info, osfs_inode, lblk, end);
+    }
+    return ret;
 }
 
+/**
+ * Function: osfs_reserve_range
+ * Description: Allocates the data blocks behind the page cache folios a write
+ *              covers and the memory backing them, so that writing the folios
+ *              back cannot fail. Blocks shared with clones of the file are
+ *              copied first, holes elsewhere in the file stay. A file that
+ *              stays within OSFS_INLINE_DATA_MAX only gets its inline data
+ *              allocated; one growing past it moves its inline data into its
+ *              first block. A whole write is reserved at once, so its extents
+ *              are walked once whatever the number of segments; on failure
+ *              the blocks already reserved stay, see osfs_release_unwritten.
+ *              A write that must not block is only served by
+ *              osfs_prepare_range.
+ * Inputs:
+ *   - inode: The inode of the file.
+ *   - pos: The file position the write starts at.
+ *   - end_pos: The file position the write ends at.
+ *   - nowait: Whether the caller must not block (IOCB_NOWAIT).
+ *   - cursor: Optional extent lookup hint.
+ * Returns:
+ *   - 0 on success.
+ *   - -EAGAIN if nowait is set and the write would block.
+ *   - -ENOSPC if the data blocks cannot be allocated.
+ *   - -ENOMEM if the memory behind the blocks cannot be allocated.
+ */
+static int osfs_reserve_range(struct inode *inode, loff_t pos, loff_t end_pos, bool nowait,
+                              struct osfs_extent_cursor *cursor)
+{
+    struct osfs_inode *osfs_inode = inode->i_private;
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    uint32_t lblk = round_down(pos, PAGE_SIZE) >> inode->i_blkbits;
+    uint32_t end = round_up(end_pos, PAGE_SIZE) >> inode->i_blkbits;
+    uint32_t pblk;
+    void *data_block;
+    int ret;
+
+    ret = osfs_prepare_range(inode, lblk, end, end_pos, nowait ? GFP_NOWAIT : GFP_KERNEL,
+                             cursor);
+    if (nowait && ret == -ENOMEM)
+        return -EAGAIN;
+    if (ret != -EAGAIN || nowait)
+        return ret;
+
+    down_write(&OSFS_I(inode)->i_extent_sem);
+    if (osfs_inode_inline(osfs_inode) && end_pos <= OSFS_INLINE_DATA_MAX) {
+        data_block = osfs_inline_prepare(sb_info, inode->i_ino, GFP_KERNEL);
+        up_write(&OSFS_I(inode)->i_extent_sem);
+        return PTR_ERR_OR_ZERO(data_block);
+    }
+
+    ret = osfs_reserve_blocks(inode, lblk, end);
+
+    while (!ret && lblk < end) {
+        ret = osfs_extent_unshare(sb_info, osfs_inode, lblk);
+        if (ret)
+            break;
+        if (osfs_extent_lookup(osfs_inode, lblk, cursor, &pblk, NULL)) {
+            ret = -EIO;
+            break;
+        }
+        data_block = osfs_block_prepare(sb_info, pblk, GFP_KERNEL);
+        if (IS_ERR(data_block))
+            ret = PTR_ERR(data_block);
+        lblk++;
+    }
+    up_write(&OSFS_I(inode)->i_extent_sem);
+    return ret;
+}
 
 /**
- * Function: osfs_write
- * Description: Writes data to a file.
+ * Function: osfs_get_write_folio
+ * Description: Returns the locked page cache folio a write goes into, read
+ *              in first when the write only covers part of it.
  * Inputs:
- *   - filp: The file pointer representing the file to write to.
- *   - buf: The user-space buffer containing the data to write.
- *   - len: The number of bytes to write.
- *   - ppos: The file position pointer.
+ *   - file: The file being written.
+ *   - mapping: The address space of the file.
+ *   - pos: The file position of the write.
+ *   - len: The number of bytes to write into this folio.
+ *   - fgp: FGP_* flags for __filemap_get_folio, FGP_NOWAIT for writes that
+ *          must not block.
  * Returns:
- *   - The number of bytes written on success.
- *   - -EFAULT if copying data from user space fails.
- *   - Adjusted length if the write exceeds the block size.
+ *   - The locked folio on success.
+ *   - ERR_PTR(-EAGAIN) if FGP_NOWAIT is set and the folio must be read in.
+ *   - ERR_PTR(-ENOMEM) if the folio cannot be allocated.
+ *   - Another ERR_PTR if the folio cannot be read in.
+ */
+static struct folio *osfs_get_write_folio(struct file *file, struct address_space *mapping,
+                                          loff_t pos, unsigned len, fgf_t fgp)
+{
+    struct folio *folio;
+    int ret;
+
+    folio = __filemap_get_folio(mapping, pos >> PAGE_SHIFT, fgp, mapping_gfp_mask(mapping));
+    if (IS_ERR(folio))
+        return folio;
+
+    // Partial writes must merge with what is already stored
+    if (!folio_test_uptodate(folio) && len != folio_size(folio)) {
+        ret = (fgp & FGP_NOWAIT) ? -EAGAIN :
+              osfs_fill_folio(mapping->host, folio, osfs_file_cursor(file));
+        if (ret) {
+            folio_unlock(folio);
+            folio_put(folio);
+            return ERR_PTR(ret);
+        }
+    }
+    return folio;
+}
+
+/**
+ * Function: osfs_write_begin
+ * Description: Prepares a page cache folio for a buffered write. Data blocks
+ *              for the whole folio are allocated up front so writeback never
+ *              has to allocate.
+ * Inputs:
+ *   - file: The file being written.
+ *   - mapping: The address space of the file.
+ *   - pos: The file position of the write.
+ *   - len: The number of bytes to write into this folio.
+ *   - pagep: Pointer to return the locked page.
+ *   - fsdata: Unused.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOSPC if the data blocks cannot be allocated.
+ *   - -ENOMEM if the folio cannot be allocated.
+ */
+static int osfs_write_begin(struct file *file, struct address_space *mapping,
+                            loff_t pos, unsigned len, struct page **pagep, void **fsdata)
+{
+    struct folio *folio;
+    int ret;
+
+    ret = osfs_reserve_range(mapping->host, pos, pos + len, false, osfs_file_cursor(file));
+    if (ret)
+        return ret;
+
+    folio = osfs_get_write_folio(file, mapping, pos, len, FGP_WRITEBEGIN);
+    if (IS_ERR(folio))
+        return PTR_ERR(folio);
+
+    *pagep = &folio->page;
+    return 0;
+}
+
+/**
+ * Function: osfs_write_end
+ * Description: Completes a buffered write: extends the file size and marks the
+ *              folio dirty so writeback copies it into the data blocks.
+ * Inputs:
+ *   - file: The file being written.
+ *   - mapping: The address space of the file.
+ *   - pos: The file position of the write.
+ *   - len: The number of bytes requested.
+ *   - copied: The number of bytes actually copied into the folio.
+ *   - page: The locked page returned by osfs_write_begin.
+ *   - fsdata: Unused.
+ * Returns:
+ *   - The number of bytes committed.
+ */
+static int osfs_write_end(struct file *file, struct address_space *mapping,
+                          loff_t pos, unsigned len, unsigned copied,
+                          struct page *page, void *fsdata)
+{
+    struct folio *folio = page_folio(page);
+    struct inode *inode = mapping->host;
+    struct osfs_inode *osfs_inode = inode->i_private;
+    loff_t last_pos = pos + copied;
+
+    if (!folio_test_uptodate(folio)) {
+        // A short copy into an unread folio would leave holes of garbage; retry
+        if (copied < len) {
+            copied = 0;
+            goto out;
+        }
+        folio_mark_uptodate(folio);
+    }
+
+    if (last_pos > inode->i_size) {
+        i_size_write(inode, last_pos);
+        osfs_inode->i_size = last_pos;
+    }
+    folio_mark_dirty(folio);
+
+out:
+    folio_unlock(folio);
+    folio_put(folio);
+    return copied;
+}
+
+/**
+ * Function: osfs_write_folio
+ * Description: Copies a dirty folio back into the file's data blocks, or into
+ *              the inline data of an inline file. The part of the last block
+ *              beyond EOF is zeroed; blocks punched out of the folio are
+ *              skipped, the punch zeroed them in the folio. Once the data is
+ *              in the block store, the journal may record the size covering it.
+ * Inputs:
+ *   - folio: The locked folio to write back.
+ *   - wbc: The writeback control.
+ *   - data: The extent lookup cursor shared by the writeback pass.
+ * Returns:
+ *   - 0 on success.
+ *   - -EIO if an inline file has no inline data.
+ *   - -ENOMEM if the memory behind a data block cannot be allocated.
  */
-static ssize_t osfs_write(struct file *filp, const char __user *buf, size_t len, loff_t *ppos)
-{   
-    //Step1: Retrieve the inode and filesystem information
-    struct inode *inode = file_inode(filp);
+static int osfs_write_folio(struct folio *folio, struct writeback_control *wbc, void *data)
+{
+    struct inode *inode = folio->mapping->host;
     struct osfs_inode *osfs_inode = inode->i_private;
     struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    loff_t pos = folio_pos(folio);
+    loff_t i_size = i_size_read(inode);
+    size_t len = folio_size(folio);
+    size_t blocksize = i_blocksize(inode);
+    size_t offset, chunk;
+    uint32_t pblk;
     void *data_block;
-    ssize_t bytes_written;
-    // int ret;
-
-    // Step2: Check if a data block has been allocated; if not, allocate one
-    // if (osfs_inode->i_blocks == 0) {
-    //     osfs_inode->i_block = osfs_alloc_data_block(sb_info, &osfs_inode->i_block);
-    //     if (osfs_inode->i_block < 0)
-    //         return -ENOSPC; // No space left on device
-    //     osfs_inode->i_blocks = 1;
-    // }
-
-    
-    // MODED
-    int32_t block_needed = (*ppos + len) / BLOCK_SIZE + ((*ppos + len) % BLOCK_SIZE == 0 ? 0 : 1);
-
-    if (osfs_inode->i_blocks < block_needed) {
-        if (osfs_inode->i_blocks == 0) {
-            // alloc data blocks
-            osfs_inode->i_blocks_ptr = (uint32_t *)kmalloc(sizeof(uint32_t) * block_needed, GFP_KERNEL);
-            osfs_inode->i_blocks_length = (int32_t *)kmalloc(sizeof(uint32_t) * block_needed, GFP_KERNEL);
-            for (int i = 0; i < block_needed; i++) {
-                osfs_inode->i_blocks_ptr[i] = -1;
-                osfs_inode->i_blocks_length[i] = -1;
-            }
+    char *kaddr;
+    int ret = 0;
+
+    // Fully beyond EOF: the folio is being truncated away
+    if (pos >= i_size) {
+        folio_unlock(folio);
+        return 0;
+    }
+    if (i_size - pos < len)
+        len = i_size - pos;
+
+    folio_start_writeback(folio);
+    down_read(&OSFS_I(inode)->i_extent_sem);
+    kaddr = kmap_local_folio(folio, 0);
+    offset = 0;
+    if (osfs_inode_inline(osfs_inode)) {
+        // osfs_reserve_range allocated it; the size keeps the folio at 0 and len within it
+        data_block = osfs_inline_get(sb_info, inode->i_ino);
+        if (data_block) {
+            memcpy(data_block, kaddr, len);
+            memset(data_block + len, 0, OSFS_INLINE_DATA_MAX - len);
         } else {
-            // realloc data blocks
-            int old_block_idx = osfs_inode->i_blocks - 1;
-            osfs_inode->i_blocks_ptr = (uint32_t *)krealloc(osfs_inode->i_blocks_ptr, sizeof(uint32_t) * block_needed, GFP_KERNEL);
-            osfs_inode->i_blocks_length = (int32_t *)krealloc(osfs_inode->i_blocks_length, sizeof(uint32_t) * block_needed, GFP_KERNEL);
-            for (int i = old_block_idx+1; i < block_needed; i++) {
-                osfs_inode->i_blocks_ptr[i] = -1;
-                osfs_inode->i_blocks_length[i] = -1;
-            }
-        }
-        if (osfs_realloc_multiple_data_blocks(sb_info, osfs_inode->i_blocks_ptr, osfs_inode->i_blocks_length, block_needed) < 0) {
-            return -ENOSPC;
-        }
-        osfs_inode->i_blocks = block_needed;
-    }
-        
-
-    // Step3: Limit the write length to fit within one data block
-    // if (*ppos + len > BLOCK_SIZE) {
-    //     len = BLOCK_SIZE - *ppos;
-    // }
-
-
-    // Step4: Write data from user space to the data block
-    // data_block = sb_info->data_blocks + osfs_inode->i_block * BLOCK_SIZE + *ppos;
-    // if (copy_from_user(data_block, buf, len)) {
-    //     return -EFAULT;
-    // }
-
-
-    // MODED
-    osfs_inode->i_size = *ppos + len;
-
-    bytes_written = len;
-
-    // MODED
-    while (len > 0) {
-        int32_t idx_of_block = *ppos / BLOCK_SIZE;
-        int32_t offset_in_block = *ppos % BLOCK_SIZE;
-        int32_t idx_of_iblock = 0;
-        while(idx_of_block > 0) {
-            if (idx_of_block >= osfs_inode->i_blocks_length[idx_of_iblock]) {
-                idx_of_block -= osfs_inode->i_blocks_length[idx_of_iblock];
-                idx_of_iblock++;
-            } else {
+            ret = -EIO;
+        }
+        offset = len;
+    }
+    for (; offset < len; offset += blocksize) {
+        if (osfs_extent_lookup(osfs_inode, (pos + offset) >> inode->i_blkbits,
+                               data, &pblk, NULL))
+            continue;
+        data_block = osfs_block_prepare(sb_info, pblk, GFP_NOFS);
+        if (IS_ERR(data_block)) {
+            ret = PTR_ERR(data_block);
+            break;
+        }
+        chunk = min_t(size_t, len - offset, blocksize);
+        memcpy(data_block, kaddr + offset, chunk);
+        memset(data_block + chunk, 0, blocksize - chunk);
+        osfs_block_dirty(sb_info, pblk);
+    }
+    kunmap_local(kaddr);
+    up_read(&OSFS_I(inode)->i_extent_sem);
+
+    if (!ret) {
+        spin_lock(&inode->i_lock);
+        if (OSFS_I(inode)->i_disksize < pos + len)
+            OSFS_I(inode)->i_disksize = pos + len;
+        spin_unlock(&inode->i_lock);
+        osfs_journal_inode(sb_info, inode->i_ino);
+    }
+    if (ret)
+        mapping_set_error(folio->mapping, ret);
+    folio_unlock(folio);
+    folio_end_writeback(folio);
+    return ret;
+}
+
+/**
+ * Function: osfs_writepages
+ * Description: Writes the dirty folios of a file back into its data blocks.
+ * Inputs:
+ *   - mapping: The address space to write back.
+ *   - wbc: The writeback control.
+ * Returns:
+ *   - 0 on success.
+ *   - A negative error code on failure.
+ */
+static int osfs_writepages(struct address_space *mapping, struct writeback_control *wbc)
+{
+    struct osfs_extent_cursor cursor = { 0 };
+
+    return write_cache_pages(mapping, wbc, osfs_write_folio, &cursor);
+}
+
+/**
+ * Struct: osfs_aops
+ * Description: Address space operations backing regular files with the page cache.
+ */
+const struct address_space_operations osfs_aops = {
+    .read_folio = osfs_read_folio,
+    .readahead = osfs_readahead,
+    .writepages = osfs_writepages,
+    .write_begin = osfs_write_begin,
+    .write_end = osfs_write_end,
+    .dirty_folio = filemap_dirty_folio,
+    .migrate_folio = filemap_migrate_folio,
+};
+
+/**
+ * Function: osfs_file_read_iter
+ * Description: Buffered read holding the inode lock shared, so a read never
+ *              observes half of a concurrent write; readers still run in parallel.
+ *              With IOCB_NOWAIT the lock is only tried, and the page cache
+ *              fails the read with -EAGAIN rather than waiting for folios.
+ * Inputs:
+ *   - iocb: The I/O control block of the read.
+ *   - to: The destination iterator.
+ * Returns:
+ *   - The number of bytes read on success.
+ *   - -EAGAIN if IOCB_NOWAIT is set and the read would block.
+ *   - A negative error code on failure.
+ */
+static ssize_t osfs_file_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct inode *inode = file_inode(iocb->ki_filp);
+    u64 stat_start = osfs_stat_start();
+    loff_t pos = iocb->ki_pos;
+    size_t count = iov_iter_count(to);
+    ssize_t ret;
+
+    if (iocb->ki_flags & IOCB_NOWAIT) {
+        if (!inode_trylock_shared(inode))
+            return -EAGAIN;
+    } else {
+        inode_lock_shared(inode);
+    }
+    ret = generic_file_read_iter(iocb, to);
+    inode_unlock_shared(inode);
+
+    trace_osfs_read(inode, pos, count, ret);
+    osfs_stat_end(inode->i_sb->s_fs_info, OSFS_STAT_READ, stat_start);
+    return ret;
+}
+
+/**
+ * Function: osfs_release_unwritten
+ * Description: Frees the blocks a buffered write reserved past EOF but did not
+ *              write, when it stopped short. Blocks past mapped_end, where the
+ *              mappings of the file ended before the write, can only be the
+ *              write's own, and past EOF no folio over them is dirty or mapped
+ *              writable, so they simply become holes again. Called with the
+ *              inode lock held.
+ * Inputs:
+ *   - inode: The inode of the file.
+ *   - mapped_end: osfs_extent_end of the file before the write.
+ * Returns:
+ *   - None.
+ */
+static void osfs_release_unwritten(struct inode *inode, uint32_t mapped_end)
+{
+    struct osfs_inode *osfs_inode = inode->i_private;
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    uint32_t from = max_t(uint64_t, mapped_end,
+                          DIV_ROUND_UP_ULL(i_size_read(inode), i_blocksize(inode)));
+
+    down_write(&OSFS_I(inode)->i_extent_sem);
+    // Freeing a tail never splits an extent, so it cannot fail
+    if (osfs_extent_end(osfs_inode) > from) {
+        osfs_extent_free_range(sb_info, osfs_inode, from, U32_MAX);
+        osfs_journal_inode(sb_info, inode->i_ino);
+    }
+    up_write(&OSFS_I(inode)->i_extent_sem);
+}
+
+/**
+ * Function: osfs_perform_write
+ * Description: Copies the data of a buffered write into the page cache, folio
+ *              by folio, after reserving the blocks of the whole write at once.
+ *              When the whole write does not fit, folios are reserved one at a
+ *              time instead and the write ends short at the first that cannot
+ *              be. Whatever a short write reserved past its end and EOF is
+ *              given back. Follows generic_perform_write, except that with
+ *              IOCB_NOWAIT no step may block: the reservation, getting the
+ *              folios and dirty throttling fail with -EAGAIN instead, and the
+ *              write stops there.
+ * Inputs:
+ *   - iocb: The I/O control block of the write, advanced past the bytes written.
+ *   - from: The source iterator.
+ * Returns:
+ *   - The number of bytes written, if any.
+ *   - A negative error code if nothing could be written.
+ */
+static ssize_t osfs_perform_write(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct file *file = iocb->ki_filp;
+    struct address_space *mapping = file->f_mapping;
+    struct inode *inode = mapping->host;
+    bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+    fgf_t fgp = FGP_WRITEBEGIN | (nowait ? FGP_NOWAIT : 0);
+    loff_t pos = iocb->ki_pos;
+    unsigned long offset, bytes;
+    ssize_t written = 0, status;
+    bool per_folio = false;
+    uint32_t mapped_end;
+    struct folio *folio;
+    size_t copied;
+
+    down_read(&OSFS_I(inode)->i_extent_sem);
+    mapped_end = osfs_extent_end(inode->i_private);
+    up_read(&OSFS_I(inode)->i_extent_sem);
+
+    // A write that must not block only takes the fast path, which allocates nothing
+    status = osfs_reserve_range(inode, pos, pos + iov_iter_count(from), nowait,
+                                osfs_file_cursor(file));
+    if (status && !nowait)
+        osfs_release_unwritten(inode, mapped_end);
+    if (status == -ENOSPC)
+        per_folio = true;
+    else if (status)
+        return status;
+
+    do {
+        offset = pos & (PAGE_SIZE - 1);
+        bytes = min_t(unsigned long, PAGE_SIZE - offset, iov_iter_count(from));
+        if (per_folio) {
+            status = osfs_reserve_range(inode, pos, pos + bytes, false, osfs_file_cursor(file));
+            if (status)
                 break;
-            }
         }
-        data_block = sb_info->data_blocks + osfs_inode->i_blocks_ptr[idx_of_iblock] * BLOCK_SIZE + idx_of_block * BLOCK_SIZE + offset_in_block;
-        int32_t write_len = len > BLOCK_SIZE - offset_in_block ? BLOCK_SIZE - offset_in_block : len;
-        if (copy_from_user(data_block, buf, write_len)) {
-            return -EFAULT;
+again:
+        if (unlikely(fault_in_iov_iter_readable(from, bytes) == bytes)) {
+            status = -EFAULT;
+            break;
         }
-        len -= write_len;
-        *ppos += write_len;
-        buf += write_len;
+        if (fatal_signal_pending(current)) {
+            status = -EINTR;
+            break;
+        }
+
+        folio = osfs_get_write_folio(file, mapping, pos, bytes, fgp);
+        if (IS_ERR(folio)) {
+            status = PTR_ERR(folio);
+            break;
+        }
+        if (mapping_writably_mapped(mapping))
+            flush_dcache_folio(folio);
+        copied = copy_page_from_iter_atomic(&folio->page, offset, bytes, from);
+        flush_dcache_folio(folio);
+
+        status = osfs_write_end(file, mapping, pos, bytes, copied, &folio->page, NULL);
+        if (unlikely(status != copied))
+            iov_iter_revert(from, copied - status);
+        cond_resched();
+        if (unlikely(status == 0)) {
+            // Faulting the source in again and retrying a shorter copy
+            if (copied)
+                bytes = copied;
+            goto again;
+        }
+        pos += status;
+        written += status;
+
+        if (nowait) {
+            status = balance_dirty_pages_ratelimited_flags(mapping, BDP_ASYNC);
+            if (status)
+                break;
+        } else {
+            balance_dirty_pages_ratelimited(mapping);
+        }
+    } while (iov_iter_count(from));
+
+    if (iov_iter_count(from) && !nowait)
+        osfs_release_unwritten(inode, mapped_end);
+    if (!written)
+        return status;
+    iocb->ki_pos += written;
+    return written;
+}
+
+/**
+ * Function: osfs_file_write_iter
+ * Description: Buffered write under the inode lock. Every segment of a
+ *              vectored or io_uring write goes through one osfs_perform_write
+ *              pass. With IOCB_NOWAIT the lock is only tried, and only writes
+ *              into blocks the file already owns are done inline; anything
+ *              that needs the allocator fails with -EAGAIN, so io_uring
+ *              retries it from a worker that may block.
+ * Inputs:
+ *   - iocb: The I/O control block of the write.
+ *   - from: The source iterator.
+ * Returns:
+ *   - The number of bytes written on success.
+ *   - -EAGAIN if IOCB_NOWAIT is set and the write would block.
+ *   - A negative error code on failure.
+ */
+static ssize_t osfs_file_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct inode *inode = file_inode(iocb->ki_filp);
+    u64 stat_start = osfs_stat_start();
+    size_t count = iov_iter_count(from);
+    loff_t pos;
+    ssize_t ret;
+
+    if (iocb->ki_flags & IOCB_NOWAIT) {
+        if (!inode_trylock(inode))
+            return -EAGAIN;
+    } else {
+        inode_lock(inode);
     }
+    // For O_APPEND the position is only known once the checks have run
+    pos = iocb->ki_pos;
+    ret = generic_write_checks(iocb, from);
+    if (ret <= 0)
+        goto out;
+    pos = iocb->ki_pos;
+    ret = kiocb_modified(iocb);
+    if (!ret)
+        ret = osfs_perform_write(iocb, from);
+out:
+    inode_unlock(inode);
+
+    if (ret > 0)
+        ret = generic_write_sync(iocb, ret);
+    trace_osfs_write(inode, pos, count, ret);
+    osfs_stat_end(inode->i_sb->s_fs_info, OSFS_STAT_WRITE, stat_start);
+    return ret;
+}
+
+/**
+ * Function: osfs_page_mkwrite
+ * Description: Makes a shared mapping of a file writable at a folio. As for
+ *              buffered writes, the data blocks behind the folio are allocated
+ *              first, so writeback of a folio dirtied through the mapping
+ *              cannot fail.
+ * Inputs:
+ *   - vmf: The write fault.
+ * Returns:
+ *   - VM_FAULT_LOCKED with the folio locked and dirty on success.
+ *   - VM_FAULT_NOPAGE if the folio was truncated meanwhile.
+ *   - VM_FAULT_SIGBUS or VM_FAULT_OOM if the blocks cannot be allocated.
+ */
+static vm_fault_t osfs_page_mkwrite(struct vm_fault *vmf)
+{
+    struct file *file = vmf->vma->vm_file;
+    struct inode *inode = file_inode(file);
+    struct folio *folio = page_folio(vmf->page);
+    vm_fault_t ret = VM_FAULT_LOCKED;
+    int err = 0;
 
+    sb_start_pagefault(inode->i_sb);
+    file_update_time(file);
+    // Keeps clones from sharing the blocks between the reservation and the dirtying
+    filemap_invalidate_lock_shared(inode->i_mapping);
 
+    // Blocks past EOF would only be reclaimed by the next truncate
+    if (folio_pos(folio) < i_size_read(inode))
+        err = osfs_reserve_range(inode, folio_pos(folio),
+                                 min_t(loff_t, folio_pos(folio) + folio_size(folio),
+                                       i_size_read(inode)),
+                                 false, osfs_file_cursor(file));
 
-    // Step5: Update inode & osfs_inode attribute
-    // osfs_inode->i_size = *ppos + len;
-    // *ppos += len;
-    // bytes_written = len;
-    // if (*ppos + len > osfs_inode->i_size) {
-    //     osfs_inode->i_size = *ppos + len;
-    // }
-    // *ppos += len;
-    // bytes_written = len;
+    folio_lock(folio);
+    if (folio->mapping != inode->i_mapping || folio_pos(folio) >= i_size_read(inode)) {
+        folio_unlock(folio);
+        ret = VM_FAULT_NOPAGE;
+        goto out;
+    }
+    if (err) {
+        folio_unlock(folio);
+        ret = vmf_error(err);
+        goto out;
+    }
+    folio_mark_dirty(folio);
+    folio_wait_stable(folio);
+out:
+    filemap_invalidate_unlock_shared(inode->i_mapping);
+    sb_end_pagefault(inode->i_sb);
+    return ret;
+}
 
-    
+/**
+ * Struct: osfs_file_vm_ops
+ * Description: Mappings of regular files go through the page cache, so every
+ *              process mapping a file shares the same folios.
+ */
+static const struct vm_operations_struct osfs_file_vm_ops = {
+    .fault = filemap_fault,
+    .map_pages = filemap_map_pages,
+    .page_mkwrite = osfs_page_mkwrite,
+};
 
-    // Step6: Return the number of bytes written
-    return bytes_written;
+/**
+ * Function: osfs_file_mmap
+ * Description: Maps a regular file into a process.
+ * Inputs:
+ *   - file: The file being mapped.
+ *   - vma: The new mapping.
+ * Returns:
+ *   - 0.
+ */
+static int osfs_file_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    file_accessed(file);
+    vma->vm_ops = &osfs_file_vm_ops;
+    return 0;
 }
 
 /**
- * Function: osfs_unlink
- * Description: Unlinks (deletes) a file.
+ * Function: osfs_file_open
+ * Description: Opens a regular file, attaches its extent lookup cursor and
+ *              advertises non-blocking I/O.
  * Inputs:
- *   - dir: The directory inode containing the file to be unlinked.
- *   - dentry: The dentry representing the file to be unlinked.
+ *   - inode: The inode of the file.
+ *   - filp: The file being opened.
  * Returns:
  *   - 0 on success.
- *   - -ENOENT if the file does not exist.
+ *   - -ENOMEM if the cursor cannot be allocated.
+ *   - A negative error code from generic_file_open on failure.
+ */
+static int osfs_file_open(struct inode *inode, struct file *filp)
+{
+    int ret;
+
+    ret = generic_file_open(inode, filp);
+    if (ret)
+        return ret;
+
+    filp->private_data = kzalloc(sizeof(struct osfs_extent_cursor), GFP_KERNEL);
+    if (!filp->private_data)
+        return -ENOMEM;
+    // See osfs_file_read_iter and osfs_file_write_iter
+    filp->f_mode |= FMODE_NOWAIT | FMODE_BUF_RASYNC | FMODE_BUF_WASYNC;
+    return 0;
+}
+
+/**
+ * Function: osfs_file_release
+ * Description: Releases the extent lookup cursor of an open file. When the last
+ *              writer goes away, the file's preallocation window is returned to
+ *              the free pool.
+ * Inputs:
+ *   - inode: The inode of the file.
+ *   - filp: The file being closed.
+ * Returns:
+ *   - 0.
  */
-static int osfs_unlink(struct inode *dir, struct dentry *dentry)
+static int osfs_file_release(struct inode *inode, struct file *filp)
+{
+    struct osfs_inode *osfs_inode = inode->i_private;
+
+    if ((filp->f_mode & FMODE_WRITE) && atomic_read(&inode->i_writecount) == 1) {
+        down_write(&OSFS_I(inode)->i_extent_sem);
+        osfs_extent_discard_prealloc(inode->i_sb->s_fs_info, osfs_inode);
+        up_write(&OSFS_I(inode)->i_extent_sem);
+    }
+
+    kfree(filp->private_data);
+    filp->private_data = NULL;
+    return 0;
+}
+
+/**
+ * Function: osfs_setattr
+ * Description: Changes the attributes of a regular file, truncating it when
+ *              its size changes, and records them in the osfs inode.
+ * Inputs:
+ *   - idmap: The idmap of the mount.
+ *   - dentry: The dentry of the file.
+ *   - attr: The attributes to change.
+ * Returns:
+ *   - 0 on success.
+ *   - A negative error code from the permission checks or osfs_truncate.
+ */
+static int osfs_setattr(struct mnt_idmap *idmap, struct dentry *dentry, struct iattr *attr)
 {
     struct inode *inode = d_inode(dentry);
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    struct osfs_inode *osfs_inode = inode->i_private;
+    struct osfs_inode_meta *meta = osfs_get_inode_meta(inode->i_sb, inode->i_ino);
+    int ret;
+
+    ret = setattr_prepare(idmap, dentry, attr);
+    if (ret)
+        return ret;
+    if ((attr->ia_valid & ATTR_SIZE) && attr->ia_size != i_size_read(inode)) {
+        ret = osfs_truncate(inode, attr->ia_size);
+        if (ret)
+            return ret;
+    }
+    setattr_copy(idmap, inode, attr);
+
+    osfs_inode->i_mode = inode->i_mode;
+    meta->i_uid = i_uid_read(inode);
+    meta->i_gid = i_gid_read(inode);
+    meta->__i_atime = inode_get_atime(inode);
+    meta->__i_mtime = inode_get_mtime(inode);
+    meta->__i_ctime = inode_get_ctime(inode);
+    mark_inode_dirty(inode);
+    osfs_journal_inode(sb_info, inode->i_ino);
+    return 0;
+}
+
+/**
+ * Function: osfs_getattr
+ * Description: Reports the attributes of a file or directory. The block count
+ *              comes from the osfs inode, which allocations, hole punching and
+ *              truncation keep current, in the 512-byte units of st_blocks;
+ *              inline data takes no block.
+ * Inputs:
+ *   - idmap: The idmap of the mount.
+ *   - path: The path of the file.
+ *   - stat: The attributes to fill.
+ *   - request_mask: STATX_* fields asked for.
+ *   - query_flags: AT_STATX_* synchronisation flags.
+ * Returns:
+ *   - 0.
+ */
+int osfs_getattr(struct mnt_idmap *idmap, const struct path *path, struct kstat *stat,
+                 u32 request_mask, unsigned int query_flags)
+{
+    struct inode *inode = d_inode(path->dentry);
+    struct osfs_inode *osfs_inode = inode->i_private;
+
+    generic_fillattr(idmap, request_mask, inode, stat);
+    stat->blocks = (u64)READ_ONCE(osfs_inode->i_blocks) << (inode->i_blkbits - 9);
+    return 0;
+}
+
+/**
+ * Function: osfs_remap_file_range
+ * Description: Clones a range of a file into another one (or the same one)
+ *              by sharing its data blocks, which are copied on the first write
+ *              to either file. Clones are appended to the destination: the
+ *              range must start at or after the end of its last extent.
+ *              Both inodes and their mappings are locked throughout; the
+ *              destination's cached pages from the clone on are dropped.
+ * Inputs:
+ *   - file_in: The source file.
+ *   - pos_in: The source position, block aligned.
+ *   - file_out: The destination file.
+ *   - pos_out: The destination position, block aligned.
+ *   - len: The number of bytes, block aligned unless the range reaches the
+ *          end of the source; 0 up to the end of the source.
+ *   - remap_flags: REMAP_FILE_* flags.
+ * Returns:
+ *   - The number of bytes cloned on success.
+ *   - -EOPNOTSUPP for deduplication, in image mode, and when the range does
+ *     not extend the destination's blocks or covers holes of the source.
+ *   - A negative error code from the range checks or allocation failure.
+ */
+static loff_t osfs_remap_file_range(struct file *file_in, loff_t pos_in,
+                                    struct file *file_out, loff_t pos_out,
+                                    loff_t len, unsigned int remap_flags)
+{
+    struct inode *src = file_inode(file_in), *dst = file_inode(file_out);
+    struct osfs_sb_info *sb_info = dst->i_sb->s_fs_info;
+    struct osfs_inode *src_inode = src->i_private, *dst_inode = dst->i_private;
+    uint32_t lblk, dst_lblk, nr_blocks, done = 0, pblk, count;
+    loff_t end;
+    int ret;
+
+    if (remap_flags & ~(REMAP_FILE_DEDUP | REMAP_FILE_ADVISORY))
+        return -EINVAL;
+    // The extents area of an image is sized for blocks with a single owner
+    if ((remap_flags & REMAP_FILE_DEDUP) || sb_info->bdev)
+        return -EOPNOTSUPP;
+
+    lock_two_nondirectories(src, dst);
+    filemap_invalidate_lock_two(src->i_mapping, dst->i_mapping);
+    ret = generic_remap_file_range_prep(file_in, pos_in, file_out, pos_out, &len, remap_flags);
+    if (ret || !len)
+        goto out;
+
+    // Whole pages: a partial one would keep stale contents over the clone
+    end = round_down(pos_out, PAGE_SIZE);
+    ret = filemap_write_and_wait_range(dst->i_mapping, end, LLONG_MAX);
+    if (ret)
+        goto out;
+    truncate_inode_pages_range(dst->i_mapping, end, LLONG_MAX);
+
+    lblk = pos_in >> src->i_blkbits;
+    dst_lblk = pos_out >> dst->i_blkbits;
+    nr_blocks = DIV_ROUND_UP(len, i_blocksize(src));
+
+    down_write(&OSFS_I(dst)->i_extent_sem);
+    if (src != dst)
+        down_read_nested(&OSFS_I(src)->i_extent_sem, SINGLE_DEPTH_NESTING);
+
+    ret = -EOPNOTSUPP;
+    // Holes of the source would have to be punched into the destination
+    for (done = 0; done < nr_blocks; done += count) {
+        if (osfs_extent_lookup(src_inode, lblk + done, NULL, &pblk, &count))
+            goto unlock;
+    }
+
+    // A clone following the data of an inline destination moves it to a block
+    if (dst_lblk) {
+        ret = osfs_inline_spill(sb_info, dst_inode);
+        if (ret)
+            goto unlock;
+        ret = -EOPNOTSUPP;
+    }
+    if (dst_lblk < osfs_extent_end(dst_inode))
+        goto unlock;
+
+    // Lookups are repeated: cloning a file onto its own tail moves its array
+    for (done = 0, ret = 0; done < nr_blocks && !ret; done += count) {
+        osfs_extent_lookup(src_inode, lblk + done, NULL, &pblk, &count);
+        count = min(count, nr_blocks - done);
+        ret = osfs_share_data_run(sb_info, pblk, count);
+        if (ret)
+            break;
+        ret = osfs_extent_append(dst_inode, dst_lblk + done, pblk, count);
+        if (ret) {
+            osfs_free_data_run(sb_info, pblk, count);
+            break;
+        }
+        dst_inode->i_blocks += count;
+    }
+
+    if (done) {
+        // A clone at the start of an inline destination replaces its data
+        if (!dst_lblk)
+            osfs_inline_release(sb_info, dst->i_ino);
+        len = min_t(loff_t, len, (loff_t)done << dst->i_blkbits);
+        end = pos_out + len;
+        if (end > i_size_read(dst)) {
+            i_size_write(dst, end);
+            dst_inode->i_size = end;
+        }
+        spin_lock(&dst->i_lock);
+        if (OSFS_I(dst)->i_disksize < end)
+            OSFS_I(dst)->i_disksize = end;
+        spin_unlock(&dst->i_lock);
+        mark_inode_dirty(dst);
+        ret = 0;
+    }
+
+unlock:
+    if (src != dst)
+        up_read(&OSFS_I(src)->i_extent_sem);
+    up_write(&OSFS_I(dst)->i_extent_sem);
+out:
+    filemap_invalidate_unlock_two(src->i_mapping, dst->i_mapping);
+    unlock_two_nondirectories(src, dst);
+    return ret ? ret : len;
+}
+
+/**
+ * Function: osfs_copy_file_range
+ * Description: Copies a range between two files of the same mount inside the
+ *              kernel. Whole blocks are cloned when the destination allows it
+ *              (see osfs_remap_file_range); otherwise the data goes through the
+ *              page cache of both files.
+ * Inputs:
+ *   - file_in: The source file.
+ *   - pos_in: The source position.
+ *   - file_out: The destination file.
+ *   - pos_out: The destination position.
+ *   - len: The number of bytes to copy.
+ *   - flags: Must be 0.
+ * Returns:
+ *   - The number of bytes copied on success.
+ *   - -EXDEV if the files are on different mounts, so the VFS falls back.
+ *   - A negative error code on other failures.
+ */
+static ssize_t osfs_copy_file_range(struct file *file_in, loff_t pos_in,
+                                    struct file *file_out, loff_t pos_out,
+                                    size_t len, unsigned int flags)
+{
+    loff_t cloned;
+
+    if (file_inode(file_in)->i_sb != file_inode(file_out)->i_sb)
+        return -EXDEV;
+
+    cloned = osfs_remap_file_range(file_in, pos_in, file_out, pos_out, len,
+                                   REMAP_FILE_CAN_SHORTEN);
+    if (cloned > 0)
+        return cloned;
+    return splice_copy_file_range(file_in, pos_in, file_out, pos_out, len);
+}
+
+/**
+ * Function: osfs_zero_block_range
+ * Description: Zeroes bytes of a file in the block store that a truncate or a
+ *              hole punch leaves inside a partial block; the caller zeroes the
+ *              page cache. Holes and blocks never written read as zeros
+ *              already. An inline file has its inline data zeroed. Called with
+ *              the extent lock held for writing, once the block was unshared.
+ * Inputs:
+ *   - inode: The inode of the file.
+ *   - pos: The first byte to zero.
+ *   - len: The number of bytes, within the block of pos.
+ * Returns:
+ *   - None.
+ */
+static void osfs_zero_block_range(struct inode *inode, loff_t pos, size_t len)
+{
+    struct osfs_inode *osfs_inode = inode->i_private;
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    uint32_t pblk;
+    void *data_block;
+
+    if (osfs_inode_inline(osfs_inode)) {
+        data_block = osfs_inline_get(sb_info, inode->i_ino);
+        if (data_block && pos < OSFS_INLINE_DATA_MAX)
+            memset(data_block + pos, 0, min_t(size_t, len, OSFS_INLINE_DATA_MAX - pos));
+        return;
+    }
+    if (osfs_extent_lookup(osfs_inode, pos >> inode->i_blkbits, NULL, &pblk, NULL))
+        return;
+    data_block = osfs_block_addr(sb_info, pblk);
+    if (!data_block)
+        return;
+    memset(data_block + (pos & (i_blocksize(inode) - 1)), 0, len);
+    osfs_block_dirty(sb_info, pblk);
+}
+
+/**
+ * Function: osfs_set_size
+ * Description: Sets the size of a file for a truncate or an fallocate. The
+ *              size backed by the block store follows a shrink, and follows a
+ *              file with nothing left to write back as it grows, since it
+ *              grows by a hole or by zeroed blocks. Called with the extent
+ *              lock held for writing.
+ * Inputs:
+ *   - inode: The inode of the file.
+ *   - size: The new size.
+ * Returns:
+ *   - None.
+ */
+static void osfs_set_size(struct inode *inode, loff_t size)
+{
+    struct osfs_inode *osfs_inode = inode->i_private;
+    loff_t old = i_size_read(inode);
+
+    i_size_write(inode, size);
+    osfs_inode->i_size = size;
+    spin_lock(&inode->i_lock);
+    if (size < OSFS_I(inode)->i_disksize || OSFS_I(inode)->i_disksize == old)
+        OSFS_I(inode)->i_disksize = size;
+    spin_unlock(&inode->i_lock);
+}
+
+/**
+ * Function: osfs_truncate
+ * Description: Changes the size of a regular file. Shrinking frees the blocks
+ *              past the new end of file and the preallocation window, and
+ *              zeroes the rest of the new last block so growing the file again
+ *              reads zeros. Growing leaves a hole, after moving the data of an
+ *              inline file growing past OSFS_INLINE_DATA_MAX into a block.
+ *              Whatever can fail is done first, while the file is unchanged.
+ *              Called with the inode lock held.
+ * Inputs:
+ *   - inode: The inode of the file.
+ *   - size: The new size.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOSPC if a shared last block or inline data needs a block and none is free.
+ *   - -ENOMEM if memory allocation fails.
+ */
+static int osfs_truncate(struct inode *inode, loff_t size)
+{
     struct osfs_inode *osfs_inode = inode->i_private;
     struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    size_t blocksize = i_blocksize(inode), tail = size & (blocksize - 1);
+    loff_t old = i_size_read(inode);
+    int ret = 0;
+
+    filemap_invalidate_lock(inode->i_mapping);
+    down_write(&OSFS_I(inode)->i_extent_sem);
+    if (size > old) {
+        if (size > OSFS_INLINE_DATA_MAX)
+            ret = osfs_inline_spill(sb_info, osfs_inode);
+    } else if (tail) {
+        ret = osfs_extent_unshare(sb_info, osfs_inode, size >> inode->i_blkbits);
+    }
+    if (!ret)
+        osfs_set_size(inode, size);
+    up_write(&OSFS_I(inode)->i_extent_sem);
+    if (ret)
+        goto out;
 
-    // Step1: Check if the file exists
-    if (!inode)
-        return -ENOENT;
+    if (size > old) {
+        pagecache_isize_extended(inode, old, size);
+        goto out;
+    }
+    truncate_pagecache(inode, size);
 
-    // Step2: Free the data block if allocated
-    // if (osfs_inode->i_blocks > 0) {
-    //     osfs_free_data_block(sb_info, osfs_inode->i_block);
-    //     osfs_inode->i_blocks = 0;
-    // }
+    down_write(&OSFS_I(inode)->i_extent_sem);
+    if (tail || osfs_inode_inline(osfs_inode))
+        osfs_zero_block_range(inode, size, blocksize - tail);
+    osfs_extent_free_range(sb_info, osfs_inode, DIV_ROUND_UP_ULL(size, blocksize), U32_MAX);
+    osfs_extent_discard_prealloc(sb_info, osfs_inode);
+    up_write(&OSFS_I(inode)->i_extent_sem);
+out:
+    filemap_invalidate_unlock(inode->i_mapping);
+    return ret;
+}
 
-    // MODED
-    for (int i = 0; i < osfs_inode->i_blocks; i++) {
-        for (int j = 0; j < osfs_inode->i_blocks_length[i]; j++) {
-            osfs_free_data_block(sb_info, osfs_inode->i_blocks_ptr[i] + j);
+/**
+ * Function: osfs_punch_hole
+ * Description: Turns a range of a file into a hole. Blocks wholly inside the
+ *              range are freed, the parts of the range in the blocks at its
+ *              ends are zeroed, and the page cache of the range is dropped or
+ *              zeroed; a range reaching EOF frees the last block whole.
+ *              Whatever can fail is done before the page cache is touched.
+ *              Called with the inode lock held.
+ * Inputs:
+ *   - inode: The inode of the file.
+ *   - start: The first byte of the hole.
+ *   - end: The byte after the last one of the hole.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOSPC if an end block is shared and no block is free to copy it.
+ *   - -ENOMEM if memory allocation fails.
+ */
+static int osfs_punch_hole(struct inode *inode, loff_t start, loff_t end)
+{
+    struct osfs_inode *osfs_inode = inode->i_private;
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    loff_t size = i_size_read(inode), mask = i_blocksize(inode) - 1;
+    loff_t head_end = (start | mask) + 1;
+    unsigned int blkbits = inode->i_blkbits;
+    uint32_t first, last;
+    int ret = 0;
+
+    if (start >= size)
+        return 0;
+    if (end >= size)
+        end = round_up(size, mask + 1);
+    first = (start + mask) >> blkbits;
+    last = end >> blkbits;
+
+    filemap_invalidate_lock(inode->i_mapping);
+    down_write(&OSFS_I(inode)->i_extent_sem);
+    if (start & mask)
+        ret = osfs_extent_unshare(sb_info, osfs_inode, start >> blkbits);
+    if (!ret && (end & mask))
+        ret = osfs_extent_unshare(sb_info, osfs_inode, end >> blkbits);
+    if (!ret && first < last)
+        ret = osfs_extent_free_range(sb_info, osfs_inode, first, last);
+    up_write(&OSFS_I(inode)->i_extent_sem);
+    if (ret)
+        goto out;
+
+    // Partial pages stay cached: unmap them too, so writing them faults again
+    unmap_mapping_range(inode->i_mapping, round_down(start, PAGE_SIZE),
+                        round_up(end, PAGE_SIZE) - round_down(start, PAGE_SIZE), 0);
+    truncate_pagecache_range(inode, start, end - 1);
+
+    down_write(&OSFS_I(inode)->i_extent_sem);
+    if (osfs_inode_inline(osfs_inode)) {
+        osfs_zero_block_range(inode, start, min_t(loff_t, end, OSFS_INLINE_DATA_MAX) - start);
+    } else {
+        if (start & mask)
+            osfs_zero_block_range(inode, start, min(end, head_end) - start);
+        if ((end & mask) && ((end & ~mask) > start || !(start & mask)))
+            osfs_zero_block_range(inode, end & ~mask, end & mask);
+    }
+    up_write(&OSFS_I(inode)->i_extent_sem);
+out:
+    filemap_invalidate_unlock(inode->i_mapping);
+    return ret;
+}
+
+/**
+ * Function: osfs_allocate_range
+ * Description: Maps every hole in a range of a file to data blocks, in runs as
+ *              long as the allocator finds. The new blocks read as zeros; in
+ *              memory mode they take no memory until written, in image mode
+ *              they are brought in so they reach the device as zeros. A range
+ *              within the inline area of an inline file only needs its inline
+ *              data. Called with the inode lock held.
+ * Inputs:
+ *   - inode: The inode of the file.
+ *   - start: The first byte of the range.
+ *   - end: The byte after the last one of the range.
+ *   - extend: Whether the file grows to end.
+ * Returns:
+ *   - 0 on success; blocks already allocated stay on failure.
+ *   - -ENOSPC if there are not enough free data blocks.
+ *   - -ENOMEM if memory allocation fails.
+ */
+static int osfs_allocate_range(struct inode *inode, loff_t start, loff_t end, bool extend)
+{
+    struct osfs_inode *osfs_inode = inode->i_private;
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    uint32_t lblk = start >> inode->i_blkbits;
+    uint32_t last = DIV_ROUND_UP_ULL(end, i_blocksize(inode)), pblk;
+    loff_t old = i_size_read(inode);
+    void *data_block;
+    int ret;
+
+    down_write(&OSFS_I(inode)->i_extent_sem);
+    if (osfs_inode_inline(osfs_inode) && end <= OSFS_INLINE_DATA_MAX) {
+        data_block = osfs_inline_prepare(sb_info, inode->i_ino, GFP_KERNEL);
+        ret = PTR_ERR_OR_ZERO(data_block);
+    } else {
+        ret = osfs_reserve_blocks(inode, lblk, last);
+        for (; !ret && sb_info->bdev && lblk < last; lblk++) {
+            osfs_extent_lookup(osfs_inode, lblk, NULL, &pblk, NULL);
+            data_block = osfs_block_prepare(sb_info, pblk, GFP_KERNEL);
+            ret = PTR_ERR_OR_ZERO(data_block);
         }
-        osfs_inode->i_blocks_ptr[i] = -1;
-        osfs_inode->i_blocks_length[i] = -1;
     }
+    if (!ret && extend && end > old)
+        osfs_set_size(inode, end);
+    up_write(&OSFS_I(inode)->i_extent_sem);
 
-    // Step3: Remove the dentry from the directory
-    d_drop(dentry);
+    if (!ret && extend && end > old)
+        pagecache_isize_extended(inode, old, end);
+    return ret;
+}
 
-    // Step4: Update the inode attributes
-    clear_nlink(inode);
+/**
+ * Function: osfs_fallocate
+ * Description: Manipulates the blocks of a range of a file:
+ *   - 0 or FALLOC_FL_KEEP_SIZE: allocates the range ahead of writes, e.g. to
+ *     give a spool file long contiguous extents (see osfs_allocate_range), and
+ *     extends the file to its end unless FALLOC_FL_KEEP_SIZE is given.
+ *   - FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE: frees the range, which then
+ *     reads as zeros (see osfs_punch_hole).
+ * Inputs:
+ *   - file: The file.
+ *   - mode: FALLOC_FL_* flags.
+ *   - offset: The first byte of the range.
+ *   - len: The length of the range in bytes.
+ * Returns:
+ *   - 0 on success.
+ *   - -EOPNOTSUPP for other modes.
+ *   - A negative error code on failure.
+ */
+static long osfs_fallocate(struct file *file, int mode, loff_t offset, loff_t len)
+{
+    struct inode *inode = file_inode(file);
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    int ret;
+
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE))
+        return -EOPNOTSUPP;
+
+    inode_lock(inode);
+    ret = file_modified(file);
+    if (ret)
+        goto out;
+    if (mode & FALLOC_FL_PUNCH_HOLE) {
+        ret = osfs_punch_hole(inode, offset, offset + len);
+    } else {
+        if (!(mode & FALLOC_FL_KEEP_SIZE))
+            ret = inode_newsize_ok(inode, offset + len);
+        if (!ret)
+            ret = osfs_allocate_range(inode, offset, offset + len,
+                                      !(mode & FALLOC_FL_KEEP_SIZE));
+    }
     mark_inode_dirty(inode);
+    osfs_journal_inode(sb_info, inode->i_ino);
+out:
+    inode_unlock(inode);
+    return ret;
+}
 
-    return 0;
+/**
+ * Function: osfs_fsync
+ * Description: Writes the dirty folios of a file back into its data blocks
+ *              and, in image mode, commits the journal so the file's size and
+ *              extents reach the device with them. Concurrent callers share
+ *              one commit.
+ * Inputs:
+ *   - file: The file to sync.
+ *   - start: The first byte of the range to write back.
+ *   - end: The last byte of the range to write back.
+ *   - datasync: Whether only the data needs to be durable (ignored, metadata
+ *               is committed as a whole).
+ * Returns:
+ *   - 0 on success, a negative error code otherwise.
+ */
+int osfs_fsync(struct file *file, loff_t start, loff_t end, int datasync)
+{
+    struct osfs_sb_info *sb_info = file_inode(file)->i_sb->s_fs_info;
+    u64 stat_start = osfs_stat_start();
+    int ret;
+
+    if (!sb_info->journal) {
+        ret = generic_file_fsync(file, start, end, datasync);
+    } else {
+        ret = file_write_and_wait_range(file, start, end);
+        if (!ret)
+            ret = osfs_journal_commit(sb_info);
+    }
+    osfs_stat_end(sb_info, OSFS_STAT_FSYNC, stat_start);
+    return ret;
 }
 
+/**
+ * Function: osfs_ioctl
+ * Description: Handles the osfs specific ioctls, on any file or directory:
+ *   - OSFS_IOC_SNAPSHOT: arg is a file descriptor to write a snapshot of the
+ *     whole filesystem to (see osfs_image_snapshot). Needs CAP_SYS_ADMIN.
+ * Inputs:
+ *   - filp: The file the ioctl was issued on.
+ *   - cmd: The ioctl command.
+ *   - arg: The argument of the command.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOTTY for unknown commands.
+ *   - A negative error code on failure.
+ */
+long osfs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct super_block *sb = file_inode(filp)->i_sb;
+    struct fd f;
+    int ret;
+
+    switch (cmd) {
+    case OSFS_IOC_SNAPSHOT:
+        if (!capable(CAP_SYS_ADMIN))
+            return -EPERM;
+        f = fdget(arg);
+        if (!f.file)
+            return -EBADF;
+        ret = osfs_image_snapshot(sb, f.file);
+        fdput(f);
+        return ret;
+    default:
+        return -ENOTTY;
+    }
+}
 
 /**
  * Struct: osfs_file_operations
  * Description: Defines the file operations for regular files in osfs.
  */
 const struct file_operations osfs_file_operations = {
-    .open = generic_file_open, // Use generic open or implement osfs_open if needed
-    .read = osfs_read,
-    .write = osfs_write,
-    .llseek = default_llseek,
+    .open = osfs_file_open,
+    .release = osfs_file_release,
+    .read_iter = osfs_file_read_iter,
+    .write_iter = osfs_file_write_iter,
+    .mmap = osfs_file_mmap,
+    .splice_read = filemap_splice_read,    // Hands page cache folios to the pipe
+    .splice_write = iter_file_splice_write,
+    .copy_file_range = osfs_copy_file_range,
+    .remap_file_range = osfs_remap_file_range, // Clones share blocks until written
+    .fallocate = osfs_fallocate,        // Preallocation and hole punching
+    .llseek = generic_file_llseek,
+    .fsync = osfs_fsync,
+    .unlocked_ioctl = osfs_ioctl,
+    .compat_ioctl = osfs_ioctl,         // The argument is a plain file descriptor
     // Add other operations as needed
 };
 
@@ -242,9 +1485,8 @@ const struct file_operations osfs_file_operations = {
 /**
  * Struct: osfs_file_inode_operations
  * Description: Defines the inode operations for regular files in osfs.
- * Note: Add additional operations such as getattr as needed.
  */
 const struct inode_operations osfs_file_inode_operations = {
-    // Add inode operations here, e.g., .getattr = osfs_getattr,
-    .unlink = osfs_unlink,
+    .getattr = osfs_getattr,
+    .setattr = osfs_setattr,
 };
@@ -0,0 +1,1153 @@
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/file.h>
+#include <linux/fs.h>
+#include <linux/fs_context.h>
+#include <linux/log2.h>
+#include <linux/slab.h>
+#include "osfs.h"
+
+/*
+ * Image mode: the filesystem lives on a block device (use a loop device for a
+ * regular file). The same format is used for snapshots, written to a regular
+ * file by OSFS_IOC_SNAPSHOT and read back by the restore mount option. The
+ * superblock sits in block 0, followed by the areas of struct
+ * osfs_image_layout. At mount the metadata, which is small, is read into
+ * the same in-memory structures memory mode uses, so every other code path is
+ * unchanged; data blocks are read lazily into the page store (data.c). Sync
+ * rewrites the metadata areas as a whole and the modified data pages.
+ *
+ * The metadata areas are accessed through buffer heads in units of block_size,
+ * the data area through bios issued by data.c. Between syncs, metadata changes
+ * are committed to the journal area (journal.c), which a sync empties by
+ * rewriting the metadata in place, a checkpoint. An image that was not
+ * unmounted cleanly has its journal replayed and its block bitmap rebuilt
+ * from the extents when it is mounted again.
+ */
+
+/**
+ * Struct: osfs_image_stream
+ * Description: Sequential reader or writer over consecutive blocks of an
+ *              image, so arrays can be moved to and from an area without
+ *              caring about block boundaries. The image is either the device
+ *              (through buffer heads, the current one kept locked while a
+ *              stream writes it) or a snapshot file (through a bounce buffer).
+ */
+struct osfs_image_stream {
+    struct super_block *sb;
+    struct file *file;                  // Snapshot file, NULL for the device
+    uint64_t block;                     // Next block to map
+    struct buffer_head *bh;             // Current block on the device
+    void *buf;                          // Current block of the file
+    bool mapped;                        // Whether a block is current
+    size_t offset;                      // Position inside the current block
+    bool write;
+    int err;                            // First error writing a block back
+};
+
+static void osfs_stream_open(struct osfs_image_stream *s, struct super_block *sb,
+                             struct file *file, uint64_t block, bool write)
+{
+    memset(s, 0, sizeof(*s));
+    s->sb = sb;
+    s->file = file;
+    s->block = block;
+    s->write = write;
+}
+
+// Releases the current block; a block being written is queued for writeback
+static void osfs_stream_put(struct osfs_image_stream *s)
+{
+    size_t block_size = s->sb->s_blocksize;
+    loff_t pos;
+
+    if (!s->mapped)
+        return;
+    s->mapped = false;
+
+    if (s->file) {
+        pos = (s->block - 1) * block_size;
+        if (s->write && kernel_write(s->file, s->buf, block_size, &pos) != block_size &&
+            !s->err)
+            s->err = -EIO;
+        return;
+    }
+    if (s->write) {
+        set_buffer_uptodate(s->bh);
+        unlock_buffer(s->bh);
+        mark_buffer_dirty(s->bh);
+    }
+    brelse(s->bh);
+    s->bh = NULL;
+}
+
+/**
+ * Function: osfs_stream_map
+ * Description: Makes the next block of the stream current. Blocks being
+ *              written start out zeroed, so padding at the end of an area reads
+ *              back as zeros; so does the part of a file beyond its end.
+ * Inputs:
+ *   - s: The stream, with no current block.
+ * Returns:
+ *   - 0 on success.
+ *   - -EIO if the block cannot be read, -ENOMEM if it cannot be mapped.
+ */
+static int osfs_stream_map(struct osfs_image_stream *s)
+{
+    size_t block_size = s->sb->s_blocksize;
+    loff_t pos = s->block * block_size;
+    ssize_t ret;
+
+    if (s->file) {
+        if (!s->buf) {
+            s->buf = kmalloc(block_size, GFP_KERNEL);
+            if (!s->buf)
+                return -ENOMEM;
+        }
+        memset(s->buf, 0, block_size);
+        if (!s->write) {
+            ret = kernel_read(s->file, s->buf, block_size, &pos);
+            if (ret < 0) {
+                pr_err("osfs_stream_map: Failed to read block %llu\n", s->block);
+                return ret;
+            }
+        }
+    } else if (s->write) {
+        s->bh = sb_getblk(s->sb, s->block);
+        if (!s->bh)
+            return -ENOMEM;
+        lock_buffer(s->bh);
+        memset(s->bh->b_data, 0, block_size);
+    } else {
+        s->bh = sb_bread(s->sb, s->block);
+        if (!s->bh) {
+            pr_err("osfs_stream_map: Failed to read block %llu\n", s->block);
+            return -EIO;
+        }
+    }
+    s->block++;
+    s->offset = 0;
+    s->mapped = true;
+    return 0;
+}
+
+/**
+ * Function: osfs_stream_xfer
+ * Description: Copies the next len bytes of the stream into buf, or buf into
+ *              them.
+ * Inputs:
+ *   - s: The stream.
+ *   - buf: The memory to copy from or to.
+ *   - len: The number of bytes.
+ * Returns:
+ *   - 0 on success, a negative error code from osfs_stream_map otherwise.
+ */
+static int osfs_stream_xfer(struct osfs_image_stream *s, void *buf, size_t len)
+{
+    size_t block_size = s->sb->s_blocksize;
+    void *data;
+    size_t chunk;
+    int ret;
+
+    while (len) {
+        if (!s->mapped || s->offset == block_size) {
+            osfs_stream_put(s);
+            ret = osfs_stream_map(s);
+            if (ret)
+                return ret;
+        }
+
+        data = (s->file ? s->buf : s->bh->b_data) + s->offset;
+        chunk = min(len, block_size - s->offset);
+        if (s->write)
+            memcpy(data, buf, chunk);
+        else
+            memcpy(buf, data, chunk);
+        s->offset += chunk;
+        buf += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+/**
+ * Function: osfs_stream_close
+ * Description: Releases the current block and the resources of a stream.
+ * Inputs:
+ *   - s: The stream.
+ * Returns:
+ *   - 0 on success, -EIO if a block could not be written to a file.
+ */
+static int osfs_stream_close(struct osfs_image_stream *s)
+{
+    osfs_stream_put(s);
+    kfree(s->buf);
+    s->buf = NULL;
+    return s->err;
+}
+
+/**
+ * Function: osfs_image_io
+ * Description: Moves a whole array to or from the area starting at block.
+ * Inputs:
+ *   - sb: The superblock.
+ *   - file: The snapshot file, NULL for the device.
+ *   - block: The first block of the area.
+ *   - buf: The array.
+ *   - len: Its size in bytes.
+ *   - write: Whether the array is written to the image.
+ * Returns:
+ *   - 0 on success, a negative error code otherwise.
+ */
+int osfs_image_io(struct super_block *sb, struct file *file, uint64_t block, void *buf,
+                  size_t len, bool write)
+{
+    struct osfs_image_stream s;
+    int ret, err;
+
+    osfs_stream_open(&s, sb, file, block, write);
+    ret = osfs_stream_xfer(&s, buf, len);
+    err = osfs_stream_close(&s);
+    return ret ?: err;
+}
+
+/**
+ * Function: osfs_image_layout
+ * Description: Computes where the areas of an image with the given geometry
+ *              start. Each area is rounded up to whole blocks.
+ * Inputs:
+ *   - block_size: The size of each block.
+ *   - inode_count: The number of inodes.
+ *   - block_count: The number of data blocks.
+ *   - layout: Filled with the result.
+ * Returns:
+ *   - None.
+ */
+static void osfs_image_layout(uint32_t block_size, uint32_t inode_count, uint32_t block_count,
+                              struct osfs_image_layout *layout)
+{
+#define OSFS_AREA_BLOCKS(bytes) DIV_ROUND_UP_ULL(bytes, block_size)
+    layout->l_journal = 1;
+    layout->l_inode_bitmap = layout->l_journal + osfs_journal_blocks(block_count);
+    layout->l_block_bitmap = layout->l_inode_bitmap +
+        OSFS_AREA_BLOCKS((uint64_t)BITMAP_SIZE(inode_count) * sizeof(unsigned long));
+    layout->l_inode_table = layout->l_block_bitmap +
+        OSFS_AREA_BLOCKS((uint64_t)BITMAP_SIZE(block_count) * sizeof(unsigned long));
+    layout->l_inode_meta = layout->l_inode_table +
+        OSFS_AREA_BLOCKS((uint64_t)inode_count * sizeof(struct osfs_inode));
+    layout->l_inline_data = layout->l_inode_meta +
+        OSFS_AREA_BLOCKS((uint64_t)inode_count * sizeof(struct osfs_inode_meta));
+    // Extents cover disjoint runs of allocated blocks, so there are at most
+    // block_count of them unless files share blocks (memory mode only)
+    layout->l_extents = layout->l_inline_data +
+        OSFS_AREA_BLOCKS((uint64_t)inode_count * OSFS_INLINE_DATA_MAX);
+    layout->l_data = layout->l_extents +
+        OSFS_AREA_BLOCKS((uint64_t)block_count * sizeof(struct osfs_extent));
+    layout->l_end = layout->l_data + block_count;
+#undef OSFS_AREA_BLOCKS
+}
+
+/**
+ * Function: osfs_image_write_super
+ * Description: Writes the superblock of the image, describing the mounted
+ *              geometry, with the given state.
+ * Inputs:
+ *   - sb: The superblock.
+ *   - file: The snapshot file, NULL for the device.
+ *   - state: OSFS_STATE_CLEAN or OSFS_STATE_MOUNTED.
+ * Returns:
+ *   - 0 on success, a negative error code otherwise.
+ */
+static int osfs_image_write_super(struct super_block *sb, struct file *file, uint32_t state)
+{
+    struct osfs_sb_info *sb_info = sb->s_fs_info;
+    struct osfs_disk_super ds = {
+        .s_magic = OSFS_MAGIC,
+        .s_version = OSFS_IMAGE_VERSION,
+        .s_block_size = sb_info->block_size,
+        .s_inode_count = sb_info->inode_count,
+        .s_block_count = sb_info->block_count,
+        .s_inode_size = sizeof(struct osfs_inode),
+        .s_meta_size = sizeof(struct osfs_inode_meta),
+        .s_state = state,
+        .s_long_size = sizeof(unsigned long),
+        .s_layout = sb_info->layout,
+        .s_journal_seq = osfs_journal_seq(sb_info),
+    };
+
+    return osfs_image_io(sb, file, 0, &ds, sizeof(ds), true);
+}
+
+/**
+ * Function: osfs_image_pin_inode
+ * Description: Keeps an allocated inode from changing while it is copied: an
+ *              in-core inode has the lock protecting its extents taken, and one
+ *              that is not in core is held as a new inode, so nobody can bring
+ *              it in meanwhile. Directories only change inside journal handles,
+ *              which callers exclude (or the filesystem is frozen), so they
+ *              need nothing more; taking the directory lock here would invert
+ *              the order of a handle taken under it.
+ * Inputs:
+ *   - sb: The superblock.
+ *   - ino: The inode number.
+ * Returns:
+ *   - The pinned inode, to be passed to osfs_image_unpin_inode.
+ *   - NULL if memory allocation fails.
+ */
+struct inode *osfs_image_pin_inode(struct super_block *sb, uint32_t ino)
+{
+    struct inode *inode;
+
+    inode = iget_locked(sb, ino);
+    if (!inode || (inode->i_state & I_NEW))
+        return inode;
+    down_read(&OSFS_I(inode)->i_extent_sem);
+    return inode;
+}
+
+void osfs_image_unpin_inode(struct inode *inode)
+{
+    // The placeholder was never set up; failing it unhashes and drops it
+    if (inode->i_state & I_NEW) {
+        iget_failed(inode);
+        return;
+    }
+    up_read(&OSFS_I(inode)->i_extent_sem);
+    iput(inode);
+}
+
+/**
+ * Function: osfs_image_copy_inode
+ * Description: Copies an inode table entry into the form stored in images:
+ *              the array pointer cleared, with extents that fit stored inline.
+ *              The size of a regular file is capped to the data written to the
+ *              block store, so a crash never exposes blocks whose contents
+ *              were still in the page cache.
+ * Inputs:
+ *   - osfs_inode: The entry, pinned by osfs_image_pin_inode.
+ *   - inode: The pinned inode, NULL if nothing can change anymore.
+ *   - copy: Filled with the copy.
+ * Returns:
+ *   - true if the extents are spilled and must be stored separately.
+ */
+bool osfs_image_copy_inode(const struct osfs_inode *osfs_inode, struct inode *inode,
+                           struct osfs_inode *copy)
+{
+    bool spilled;
+
+    *copy = *osfs_inode;
+    spilled = copy->i_extents && copy->i_nr_extents > OSFS_INLINE_EXTENTS;
+    if (copy->i_extents && !spilled)
+        memcpy(copy->i_inline_extents, copy->i_extents,
+               copy->i_nr_extents * sizeof(struct osfs_extent));
+    copy->i_extents = NULL;
+    copy->i_extent_cap = 0;
+
+    if (inode && !(inode->i_state & I_NEW) && S_ISREG(inode->i_mode)) {
+        spin_lock(&inode->i_lock);
+        copy->i_size = min_t(uint64_t, copy->i_size, OSFS_I(inode)->i_disksize);
+        spin_unlock(&inode->i_lock);
+    }
+    return spilled;
+}
+
+/**
+ * Function: osfs_image_write_inodes
+ * Description: Writes the inode table, the spilled extent arrays and the inline
+ *              data. Each entry is copied by osfs_image_copy_inode under the
+ *              lock protecting its extents; spilled arrays follow in the
+ *              extents area, in inode order, and every inode has a slot of
+ *              OSFS_INLINE_DATA_MAX bytes in the inline area. Allocated
+ *              inodes are pinned while they are copied, unless the filesystem
+ *              is going away and nothing can change anymore.
+ * Inputs:
+ *   - sb: The superblock.
+ *   - file: The snapshot file, NULL for the device.
+ * Returns:
+ *   - 0 on success, a negative error code otherwise.
+ */
+static int osfs_image_write_inodes(struct super_block *sb, struct file *file)
+{
+    struct osfs_sb_info *sb_info = sb->s_fs_info;
+    bool live = sb->s_flags & SB_ACTIVE;
+    struct osfs_image_stream table, extents, inline_data;
+    struct osfs_inode *osfs_inode, copy;
+    char zero[OSFS_INLINE_DATA_MAX] = { 0 };
+    uint64_t nr_spilled = 0;
+    struct inode *inode;
+    bool spilled;
+    void *data;
+    uint32_t ino;
+    int ret = 0, err;
+
+    osfs_stream_open(&table, sb, file, sb_info->layout.l_inode_table, true);
+    osfs_stream_open(&extents, sb, file, sb_info->layout.l_extents, true);
+    osfs_stream_open(&inline_data, sb, file, sb_info->layout.l_inline_data, true);
+
+    for (ino = 0; ino < sb_info->inode_count && !ret; ino++) {
+        osfs_inode = &sb_info->inode_table[ino];
+        inode = NULL;
+        if (live && ino && test_bit(ino, sb_info->inode_bitmap)) {
+            inode = osfs_image_pin_inode(sb, ino);
+            if (!inode) {
+                ret = -ENOMEM;
+                break;
+            }
+        }
+
+        spilled = osfs_image_copy_inode(osfs_inode, inode, &copy);
+        // Clones can map more extents than the area, sized by block_count, holds
+        if (spilled)
+            nr_spilled += copy.i_nr_extents;
+        if (nr_spilled > sb_info->block_count)
+            ret = -EFBIG;
+        if (!ret)
+            ret = osfs_stream_xfer(&table, &copy, sizeof(copy));
+        if (!ret && spilled)
+            ret = osfs_stream_xfer(&extents, osfs_inode->i_extents,
+                                   copy.i_nr_extents * sizeof(struct osfs_extent));
+        if (!ret) {
+            data = osfs_inode_inline(&copy) ? osfs_inline_get(sb_info, ino) : NULL;
+            ret = osfs_stream_xfer(&inline_data, data ?: zero, OSFS_INLINE_DATA_MAX);
+        }
+
+        if (inode)
+            osfs_image_unpin_inode(inode);
+    }
+
+    err = osfs_stream_close(&table);
+    ret = ret ?: err;
+    err = osfs_stream_close(&extents);
+    ret = ret ?: err;
+    err = osfs_stream_close(&inline_data);
+    return ret ?: err;
+}
+
+/**
+ * Function: osfs_image_write_metadata
+ * Description: Writes the bitmaps, the inode table, the spilled extents and the
+ *              cold inode metadata, everything but the superblock and the data.
+ * Inputs:
+ *   - sb: The superblock.
+ *   - file: The snapshot file, NULL for the device.
+ * Returns:
+ *   - 0 on success, a negative error code otherwise.
+ */
+static int osfs_image_write_metadata(struct super_block *sb, struct file *file)
+{
+    struct osfs_sb_info *sb_info = sb->s_fs_info;
+    size_t meta_size = (size_t)sb_info->inode_count * sizeof(struct osfs_inode_meta);
+    int ret;
+
+    // The bitmaps are copied unlocked; a sync racing with allocations leaves the
+    // image marked mounted, and mounting it again rebuilds the block bitmap
+    ret = osfs_image_io(sb, file, sb_info->layout.l_inode_bitmap, sb_info->inode_bitmap,
+                        BITMAP_SIZE(sb_info->inode_count) * sizeof(unsigned long), true);
+    if (!ret)
+        ret = osfs_image_io(sb, file, sb_info->layout.l_block_bitmap, sb_info->block_bitmap,
+                            BITMAP_SIZE(sb_info->block_count) * sizeof(unsigned long), true);
+    if (!ret)
+        ret = osfs_image_write_inodes(sb, file);
+    if (!ret)
+        ret = osfs_image_io(sb, file, sb_info->layout.l_inode_meta, sb_info->inode_meta,
+                            meta_size, true);
+    return ret;
+}
+
+/**
+ * Function: osfs_image_checkpoint
+ * Description: Writes the image back to the device: the modified data pages,
+ *              then all metadata, then the superblock with the given state and
+ *              the sequence the journal restarts at, and flushes the device
+ *              cache. Called with the journal locked.
+ * Inputs:
+ *   - sb: The superblock.
+ *   - state: The state to record, OSFS_STATE_CLEAN at unmount.
+ * Returns:
+ *   - 0 on success.
+ *   - The first error encountered otherwise; the superblock is then left as
+ *     it was, so a clean state is never recorded over a partial write.
+ */
+int osfs_image_checkpoint(struct super_block *sb, uint32_t state)
+{
+    struct osfs_sb_info *sb_info = sb->s_fs_info;
+    uint64_t zero = 0;
+    int ret;
+
+    ret = osfs_flush_data_pages(sb_info);
+    if (ret)
+        return ret;
+
+    ret = osfs_image_write_metadata(sb, NULL);
+    if (!ret)
+        ret = sync_blockdev(sb->s_bdev);
+    if (ret) {
+        pr_err("osfs_image_checkpoint: Failed to write metadata: %d\n", ret);
+        return ret;
+    }
+
+    // Whatever the journal starts with may match the new sequence (a previous
+    // image on the device); the stream zeroes the rest of the block
+    ret = osfs_image_io(sb, NULL, sb_info->layout.l_journal, &zero, sizeof(zero), true);
+    if (!ret)
+        ret = osfs_image_write_super(sb, NULL, state);
+    if (!ret)
+        ret = sync_blockdev(sb->s_bdev);
+    if (!ret)
+        ret = blkdev_issue_flush(sb->s_bdev);
+    return ret;
+}
+
+/**
+ * Function: osfs_image_sync
+ * Description: Checkpoints the image, quiescing the journal meanwhile. A
+ *              read-only mount writes nothing.
+ * Inputs:
+ *   - sb: The superblock.
+ *   - state: The state to record, OSFS_STATE_CLEAN at unmount.
+ * Returns:
+ *   - 0 on success, a negative error code otherwise.
+ */
+int osfs_image_sync(struct super_block *sb, uint32_t state)
+{
+    struct osfs_sb_info *sb_info = sb->s_fs_info;
+    int ret;
+
+    if (sb_rdonly(sb))
+        return 0;
+
+    osfs_journal_lock(sb_info);
+    ret = osfs_image_checkpoint(sb, state);
+    osfs_journal_unlock(sb_info, !ret);
+    return ret;
+}
+
+/**
+ * Function: osfs_image_check_extents
+ * Description: Checks that the extents of an inode map blocks of the data area.
+ * Inputs:
+ *   - sb_info: The superblock information.
+ *   - osfs_inode: The inode, with its extents loaded.
+ * Returns:
+ *   - true if every extent is in range.
+ */
+static bool osfs_image_check_extents(struct osfs_sb_info *sb_info, struct osfs_inode *osfs_inode)
+{
+    struct osfs_extent *ext = osfs_extent_array(osfs_inode);
+    uint32_t i;
+
+    for (i = 0; i < osfs_inode->i_nr_extents; i++) {
+        if (!ext[i].e_len || ext[i].e_pblk >= sb_info->block_count ||
+            ext[i].e_len > sb_info->block_count - ext[i].e_pblk)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Function: osfs_image_count_refs
+ * Description: Recomputes the reference counts of shared blocks from the
+ *              extents; they are not stored. Nothing is allocated unless some
+ *              block has several owners.
+ * Inputs:
+ *   - sb_info: The superblock information, with the extents loaded.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if memory allocation fails.
+ */
+static int osfs_image_count_refs(struct osfs_sb_info *sb_info)
+{
+    struct osfs_inode *osfs_inode;
+    struct osfs_extent *ext;
+    unsigned long *seen;
+    uint32_t ino, i, b;
+
+    seen = bitmap_zalloc(sb_info->block_count, GFP_KERNEL);
+    if (!seen)
+        return -ENOMEM;
+
+    for_each_set_bit(ino, sb_info->inode_bitmap, sb_info->inode_count) {
+        osfs_inode = &sb_info->inode_table[ino];
+        ext = osfs_extent_array(osfs_inode);
+        for (i = 0; i < osfs_inode->i_nr_extents; i++) {
+            for (b = ext[i].e_pblk; b < ext[i].e_pblk + ext[i].e_len; b++) {
+                if (!__test_and_set_bit(b, seen))
+                    continue;
+                if (!sb_info->block_refs) {
+                    sb_info->block_refs = kvcalloc(sb_info->block_count,
+                                                   sizeof(*sb_info->block_refs), GFP_KERNEL);
+                    if (!sb_info->block_refs) {
+                        bitmap_free(seen);
+                        return -ENOMEM;
+                    }
+                }
+                sb_info->block_refs[b]++;
+            }
+        }
+    }
+    bitmap_free(seen);
+    return 0;
+}
+
+/**
+ * Function: osfs_image_load
+ * Description: Reads the metadata of an image into the structures set up by
+ *              osfs_setup_super, and replays the journal over it when there is
+ *              one. Preallocation windows are given back and the inodes of
+ *              files unlinked while open are freed; after an unclean shutdown,
+ *              or when such inodes gave blocks back, the block bitmap is
+ *              rebuilt from the extents.
+ *              The free counts are recomputed from the bitmaps.
+ * Inputs:
+ *   - sb: The superblock.
+ *   - file: The snapshot file, NULL for the device.
+ *   - clean: Whether the image was unmounted cleanly.
+ * Returns:
+ *   - 0 on success.
+ *   - -EUCLEAN if the metadata is inconsistent.
+ *   - A negative error code on I/O or allocation failure.
+ */
+static int osfs_image_load(struct super_block *sb, struct file *file, bool clean)
+{
+    struct osfs_sb_info *sb_info = sb->s_fs_info;
+    struct osfs_image_stream extents;
+    struct osfs_inode *osfs_inode, *root;
+    char buf[OSFS_INLINE_DATA_MAX];
+    uint64_t nr_extents = 0;
+    unsigned long used;
+    uint32_t ino, i, orphans = 0;
+    void *data;
+    int ret;
+
+    ret = osfs_image_io(sb, file, sb_info->layout.l_inode_bitmap, sb_info->inode_bitmap,
+                        BITMAP_SIZE(sb_info->inode_count) * sizeof(unsigned long), false);
+    if (!ret)
+        ret = osfs_image_io(sb, file, sb_info->layout.l_block_bitmap, sb_info->block_bitmap,
+                            BITMAP_SIZE(sb_info->block_count) * sizeof(unsigned long), false);
+    if (!ret)
+        ret = osfs_image_io(sb, file, sb_info->layout.l_inode_table, sb_info->inode_table,
+                            (size_t)sb_info->inode_count * sizeof(struct osfs_inode), false);
+    if (!ret)
+        ret = osfs_image_io(sb, file, sb_info->layout.l_inode_meta, sb_info->inode_meta,
+                            (size_t)sb_info->inode_count * sizeof(struct osfs_inode_meta), false);
+    if (ret)
+        return ret;
+
+    // Stored pointers are meaningless; only spilled arrays reallocated below are real
+    for (ino = 0; ino < sb_info->inode_count; ino++) {
+        sb_info->inode_table[ino].i_extents = NULL;
+        sb_info->inode_table[ino].i_extent_cap = 0;
+    }
+    // Tail bits past the counts must stay clear for the bitmap helpers
+    clear_bit(0, sb_info->inode_bitmap);
+    bitmap_clear(sb_info->inode_bitmap, sb_info->inode_count,
+                 BITMAP_SIZE(sb_info->inode_count) * BITS_PER_LONG - sb_info->inode_count);
+    bitmap_clear(sb_info->block_bitmap, sb_info->block_count,
+                 BITMAP_SIZE(sb_info->block_count) * BITS_PER_LONG - sb_info->block_count);
+
+    // Inline files that are all zeros keep no buffer
+    osfs_stream_open(&extents, sb, file, sb_info->layout.l_inline_data, false);
+    for (ino = 0; ino < sb_info->inode_count && !ret; ino++) {
+        ret = osfs_stream_xfer(&extents, buf, OSFS_INLINE_DATA_MAX);
+        if (ret || !test_bit(ino, sb_info->inode_bitmap) ||
+            !osfs_inode_inline(&sb_info->inode_table[ino]) ||
+            !memchr_inv(buf, 0, OSFS_INLINE_DATA_MAX))
+            continue;
+        data = osfs_inline_prepare(sb_info, ino, GFP_KERNEL);
+        if (IS_ERR(data))
+            ret = PTR_ERR(data);
+        else
+            memcpy(data, buf, OSFS_INLINE_DATA_MAX);
+    }
+    osfs_stream_close(&extents);
+    if (ret)
+        return ret;
+
+    osfs_stream_open(&extents, sb, file, sb_info->layout.l_extents, false);
+    for_each_set_bit(ino, sb_info->inode_bitmap, sb_info->inode_count) {
+        osfs_inode = &sb_info->inode_table[ino];
+        if (osfs_inode->i_nr_extents > OSFS_INLINE_EXTENTS) {
+            // The extents area holds block_count extents
+            nr_extents += osfs_inode->i_nr_extents;
+            if (nr_extents > sb_info->block_count) {
+                ret = -EUCLEAN;
+                break;
+            }
+            ret = osfs_extent_alloc_array(osfs_inode, osfs_inode->i_nr_extents);
+            if (ret)
+                break;
+            ret = osfs_stream_xfer(&extents, osfs_inode->i_extents,
+                                   osfs_inode->i_nr_extents * sizeof(struct osfs_extent));
+            if (ret)
+                break;
+        }
+    }
+    osfs_stream_close(&extents);
+    if (ret) {
+        if (ret == -EUCLEAN)
+            pr_err("osfs_image_load: Corrupted extents in inode %u\n", ino);
+        return ret;
+    }
+
+    // Committed inodes replace their checkpointed copies before anything is checked
+    if (sb_info->journal) {
+        ret = osfs_journal_replay(sb, false);
+        if (ret)
+            return ret;
+    }
+
+    // Files unlinked while still open are freed by their eviction; a crash
+    // leaves them behind, and their blocks go with the bitmap rebuild below
+    for_each_set_bit(ino, sb_info->inode_bitmap, sb_info->inode_count) {
+        osfs_inode = &sb_info->inode_table[ino];
+        if (ino == ROOT_INODE || osfs_inode->i_links_count)
+            continue;
+        osfs_extent_release_array(osfs_inode);
+        osfs_inline_release(sb_info, ino);
+        memset(osfs_inode, 0, sizeof(*osfs_inode));
+        memset(&sb_info->inode_meta[ino], 0, sizeof(struct osfs_inode_meta));
+        clear_bit(ino, sb_info->inode_bitmap);
+        orphans++;
+    }
+    if (orphans)
+        pr_warn("osfs: Freed %u unlinked inodes left by a crash\n", orphans);
+
+    root = &sb_info->inode_table[ROOT_INODE];
+    if (!test_bit(ROOT_INODE, sb_info->inode_bitmap) || !S_ISDIR(root->i_mode)) {
+        pr_err("osfs_image_load: Root directory missing\n");
+        return -EUCLEAN;
+    }
+
+    for_each_set_bit(ino, sb_info->inode_bitmap, sb_info->inode_count) {
+        if (!osfs_image_check_extents(sb_info, &sb_info->inode_table[ino])) {
+            pr_err("osfs_image_load: Corrupted extents in inode %u\n", ino);
+            return -EUCLEAN;
+        }
+    }
+    ret = osfs_image_count_refs(sb_info);
+    if (ret)
+        return ret;
+
+    if (!clean || orphans) {
+        if (!clean)
+            pr_warn("osfs: Image was not unmounted cleanly, rebuilding the block bitmap\n");
+        bitmap_zero(sb_info->block_bitmap, sb_info->block_count);
+        for_each_set_bit(ino, sb_info->inode_bitmap, sb_info->inode_count) {
+            osfs_inode = &sb_info->inode_table[ino];
+            for (i = 0; i < osfs_inode->i_nr_extents; i++)
+                bitmap_set(sb_info->block_bitmap, osfs_extent_array(osfs_inode)[i].e_pblk,
+                           osfs_extent_array(osfs_inode)[i].e_len);
+        }
+    }
+
+    // Preallocation windows only belong to open files
+    for_each_set_bit(ino, sb_info->inode_bitmap, sb_info->inode_count) {
+        osfs_inode = &sb_info->inode_table[ino];
+        if (!osfs_inode->i_pa_len)
+            continue;
+        if (clean && osfs_inode->i_pa_start < sb_info->block_count &&
+            osfs_inode->i_pa_len <= sb_info->block_count - osfs_inode->i_pa_start)
+            bitmap_clear(sb_info->block_bitmap, osfs_inode->i_pa_start, osfs_inode->i_pa_len);
+        osfs_inode->i_pa_len = 0;
+    }
+
+    if (sb_info->image_valid)
+        bitmap_copy(sb_info->image_valid, sb_info->block_bitmap, sb_info->block_count);
+    osfs_update_block_summary(sb_info, 0, sb_info->block_count);
+
+    // Directory blocks go into the store, over the contents they are read with
+    if (sb_info->journal) {
+        ret = osfs_journal_replay(sb, true);
+        if (ret)
+            return ret;
+    }
+
+    used = bitmap_weight(sb_info->block_bitmap, sb_info->block_count);
+    percpu_counter_set(&sb_info->nr_free_blocks, sb_info->block_count - used);
+    used = bitmap_weight(sb_info->inode_bitmap, sb_info->inode_count);
+    percpu_counter_set(&sb_info->nr_free_inodes, sb_info->inode_count - 1 - used);
+    return 0;
+}
+
+/**
+ * Function: osfs_image_check_super
+ * Description: Validates the superblock of an existing image.
+ * Inputs:
+ *   - fc: The filesystem context, for error reporting.
+ *   - ds: The superblock read from the device.
+ * Returns:
+ *   - 0 if the image can be mounted on this machine.
+ *   - -EINVAL otherwise.
+ */
+static int osfs_image_check_super(struct fs_context *fc, const struct osfs_disk_super *ds)
+{
+    struct osfs_image_layout layout;
+
+    if (ds->s_magic != OSFS_MAGIC)
+        return invalfc(fc, "no osfs image found (use -o format to create one)");
+    if (ds->s_version != OSFS_IMAGE_VERSION)
+        return invalfc(fc, "unsupported image version %u", ds->s_version);
+    if (ds->s_inode_size != sizeof(struct osfs_inode) ||
+        ds->s_meta_size != sizeof(struct osfs_inode_meta) ||
+        ds->s_long_size != sizeof(unsigned long))
+        return invalfc(fc, "image was created on an incompatible machine");
+    if (!is_power_of_2(ds->s_block_size) || ds->s_block_size < OSFS_MIN_BLOCK_SIZE ||
+        ds->s_block_size > PAGE_SIZE || ds->s_inode_count < 2 || !ds->s_block_count)
+        return invalfc(fc, "bad image geometry");
+
+    osfs_image_layout(ds->s_block_size, ds->s_inode_count, ds->s_block_count, &layout);
+    if (memcmp(&layout, &ds->s_layout, sizeof(layout)))
+        return invalfc(fc, "bad image layout");
+    return 0;
+}
+
+/**
+ * Function: osfs_image_fit
+ * Description: Finds the largest number of data blocks whose image fits in a
+ *              device of the given size.
+ * Inputs:
+ *   - block_size: The size of each block.
+ *   - inode_count: The number of inodes.
+ *   - dev_blocks: The size of the device in blocks.
+ * Returns:
+ *   - The number of data blocks, 0 if not even one fits.
+ */
+static uint32_t osfs_image_fit(uint32_t block_size, uint32_t inode_count, uint64_t dev_blocks)
+{
+    struct osfs_image_layout layout;
+    uint64_t lo = 0, hi = min_t(uint64_t, dev_blocks, U32_MAX), mid;
+
+    // l_end grows with block_count
+    while (lo < hi) {
+        mid = lo + (hi - lo + 1) / 2;
+        osfs_image_layout(block_size, inode_count, mid, &layout);
+        if (layout.l_end <= dev_blocks)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+/**
+ * Function: osfs_image_open_root
+ * Description: Attaches the root directory of a loaded image to the superblock.
+ * Inputs:
+ *   - sb: The superblock, with the metadata loaded.
+ * Returns:
+ *   - 0 on success, a negative error code otherwise.
+ */
+static int osfs_image_open_root(struct super_block *sb)
+{
+    struct inode *root;
+
+    root = osfs_iget(sb, ROOT_INODE);
+    if (IS_ERR(root))
+        return PTR_ERR(root);
+    sb->s_root = d_make_root(root);
+    if (!sb->s_root)
+        return -ENOMEM;
+    return 0;
+}
+
+/**
+ * Function: osfs_image_fill_super
+ * Description: Mounts the image on sb->s_bdev, or creates one there with the
+ *              geometry of the mount options when "format" is given; without
+ *              size= a new image fills the device.
+ * Inputs:
+ *   - sb: The superblock to be filled.
+ *   - fc: The filesystem context carrying the parsed mount options.
+ * Returns:
+ *   - 0 on success.
+ *   - -EINVAL if the device holds no usable image or is too small.
+ *   - A negative error code on other failures.
+ */
+int osfs_image_fill_super(struct super_block *sb, struct fs_context *fc)
+{
+    struct osfs_fs_context *ctx = fc->fs_private;
+    struct osfs_sb_info *sb_info;
+    struct osfs_image_layout layout;
+    struct osfs_disk_super ds;
+    struct buffer_head *bh;
+    uint64_t dev_blocks, block_count;
+    uint32_t block_size, inode_count;
+    int ret;
+
+    if (ctx->restore)
+        return invalfc(fc, "restore only applies to memory mode mounts");
+    if (!sb_min_blocksize(sb, OSFS_MIN_BLOCK_SIZE))
+        return invalfc(fc, "unsupported device block size");
+
+    if (ctx->format) {
+        if (sb_rdonly(sb))
+            return invalfc(fc, "format needs a read-write mount");
+        block_size = ctx->block_size;
+        inode_count = ctx->nr_inodes;
+        dev_blocks = bdev_nr_bytes(sb->s_bdev) >> ilog2(block_size);
+        if (ctx->size)
+            block_count = ctx->size >> ilog2(block_size);
+        else
+            block_count = osfs_image_fit(block_size, inode_count, dev_blocks);
+        if (block_count == 0 || block_count > U32_MAX)
+            return invalfc(fc, "size must hold between 1 and %u blocks", U32_MAX);
+        osfs_image_layout(block_size, inode_count, block_count, &layout);
+        if (layout.l_end > dev_blocks)
+            return invalfc(fc, "device too small for the requested geometry");
+    } else {
+        bh = sb_bread(sb, 0);
+        if (!bh)
+            return -EIO;
+        memcpy(&ds, bh->b_data, sizeof(ds));
+        brelse(bh);
+
+        ret = osfs_image_check_super(fc, &ds);
+        if (ret)
+            return ret;
+        block_size = ds.s_block_size;
+        inode_count = ds.s_inode_count;
+        block_count = ds.s_block_count;
+        layout = ds.s_layout;
+        if (layout.l_end > bdev_nr_bytes(sb->s_bdev) >> ilog2(block_size))
+            return invalfc(fc, "device is smaller than the image");
+    }
+
+    if (!sb_set_blocksize(sb, block_size))
+        return invalfc(fc, "block_size %u is not supported by the device", block_size);
+
+    ret = osfs_setup_super(sb, block_size, inode_count, block_count, ctx->numa);
+    if (ret)
+        return ret;
+    sb_info = sb->s_fs_info;
+    sb_info->bdev = sb->s_bdev;
+    sb_info->layout = layout;
+    // Nothing on a fresh image is valid yet; data pages read in as zeros
+    sb_info->image_valid = bitmap_zalloc(block_count, GFP_KERNEL);
+    if (!sb_info->image_valid)
+        return -ENOMEM;
+    ret = osfs_journal_init(sb, ctx->format ? 1 : ds.s_journal_seq);
+    if (ret)
+        return ret;
+
+    if (ctx->format) {
+        ret = osfs_make_root(sb);
+        if (!ret)
+            ret = osfs_image_sync(sb, OSFS_STATE_MOUNTED);
+        if (!ret)
+            pr_info("osfs: Created image of %llu blocks on %pg\n", block_count, sb->s_bdev);
+        return ret;
+    }
+
+    ret = osfs_image_load(sb, NULL, ds.s_state == OSFS_STATE_CLEAN);
+    if (!ret)
+        ret = osfs_image_open_root(sb);
+    if (ret)
+        return ret;
+
+    if (sb_rdonly(sb))
+        return 0;
+    // The replayed journal and the rebuilt bitmap go home before new commits
+    if (ds.s_state != OSFS_STATE_CLEAN)
+        return osfs_image_sync(sb, OSFS_STATE_MOUNTED);
+    // Until the next clean unmount the image may not match the metadata on disk
+    ret = osfs_image_write_super(sb, NULL, OSFS_STATE_MOUNTED);
+    if (!ret)
+        ret = sync_blockdev(sb->s_bdev);
+    return ret;
+}
+
+/**
+ * Function: osfs_image_write_data
+ * Description: Writes the allocated data blocks to the data area of a snapshot
+ *              file. Free ranges, and in memory mode blocks that were never
+ *              written, are skipped and stay holes of the file.
+ * Inputs:
+ *   - sb: The superblock.
+ *   - file: The snapshot file.
+ * Returns:
+ *   - 0 on success, a negative error code otherwise.
+ */
+static int osfs_image_write_data(struct super_block *sb, struct file *file)
+{
+    struct osfs_sb_info *sb_info = sb->s_fs_info;
+    uint32_t per_page = PAGE_SIZE >> sb_info->block_bits;
+    unsigned long start, end, n;
+    ssize_t written;
+    loff_t pos;
+    void *addr;
+
+    for_each_set_bitrange(start, end, sb_info->block_bitmap, sb_info->block_count) {
+        while (start < end) {
+            // Blocks are only contiguous in memory within a page of the store
+            n = min(end, round_down(start, per_page) + per_page) - start;
+            addr = osfs_block_addr(sb_info, start);
+            if (!addr && sb_info->bdev)
+                return -EIO;
+            if (addr) {
+                pos = (sb_info->layout.l_data + start) << sb_info->block_bits;
+                written = kernel_write(file, addr, n << sb_info->block_bits, &pos);
+                if (written != n << sb_info->block_bits)
+                    return written < 0 ? written : -EIO;
+            }
+            start += n;
+            cond_resched();
+        }
+    }
+    return 0;
+}
+
+/**
+ * Function: osfs_image_snapshot
+ * Description: Writes a consistent snapshot of the filesystem to a file, in
+ *              the image format with a clean state. The filesystem is frozen
+ *              meanwhile, which also flushes dirty page cache folios into the
+ *              data blocks. The file is truncated first, so the data area only
+ *              holds the allocated blocks and the rest is sparse.
+ * Inputs:
+ *   - sb: The superblock to snapshot.
+ *   - file: The destination, a regular file open for writing on another
+ *           filesystem (writes to this one would wait for the thaw).
+ * Returns:
+ *   - 0 on success.
+ *   - -EBADF if the file is not open for writing.
+ *   - -EINVAL if the file cannot hold a snapshot.
+ *   - A negative error code from the freeze or the writes otherwise.
+ */
+int osfs_image_snapshot(struct super_block *sb, struct file *file)
+{
+    struct osfs_sb_info *sb_info = sb->s_fs_info;
+    struct inode *inode = file_inode(file);
+    int ret, err;
+
+    if (!(file->f_mode & FMODE_WRITE))
+        return -EBADF;
+    if (!S_ISREG(inode->i_mode) || (file->f_flags & O_APPEND) || inode->i_sb == sb)
+        return -EINVAL;
+
+    ret = freeze_super(sb, FREEZE_HOLDER_KERNEL);
+    if (ret)
+        return ret;
+
+    // Memory mode has no layout of its own
+    osfs_image_layout(sb_info->block_size, sb_info->inode_count, sb_info->block_count,
+                      &sb_info->layout);
+    ret = vfs_truncate(&file->f_path, 0);
+    if (!ret)
+        ret = vfs_truncate(&file->f_path, sb_info->layout.l_end << sb_info->block_bits);
+    if (!ret)
+        ret = osfs_image_write_metadata(sb, file);
+    if (!ret)
+        ret = osfs_image_write_data(sb, file);
+    if (!ret)
+        ret = osfs_image_write_super(sb, file, OSFS_STATE_CLEAN);
+    if (!ret)
+        ret = vfs_fsync(file, 0);
+
+    err = thaw_super(sb, FREEZE_HOLDER_KERNEL);
+    if (ret)
+        pr_err("osfs_image_snapshot: Failed to write snapshot: %d\n", ret);
+    return ret ?: err;
+}
+
+/**
+ * Function: osfs_image_read_data
+ * Description: Reads the allocated data blocks of a snapshot into the store.
+ * Inputs:
+ *   - sb: The superblock, with the metadata loaded.
+ *   - file: The snapshot file.
+ * Returns:
+ *   - 0 on success, a negative error code otherwise.
+ */
+static int osfs_image_read_data(struct super_block *sb, struct file *file)
+{
+    struct osfs_sb_info *sb_info = sb->s_fs_info;
+    uint32_t per_page = PAGE_SIZE >> sb_info->block_bits;
+    unsigned long start, end, n;
+    ssize_t ret;
+    loff_t pos;
+    void *addr;
+
+    for_each_set_bitrange(start, end, sb_info->block_bitmap, sb_info->block_count) {
+        while (start < end) {
+            n = min(end, round_down(start, per_page) + per_page) - start;
+            addr = osfs_block_prepare(sb_info, start, GFP_KERNEL);
+            if (IS_ERR(addr))
+                return PTR_ERR(addr);
+            pos = (sb_info->layout.l_data + start) << sb_info->block_bits;
+            ret = kernel_read(file, addr, n << sb_info->block_bits, &pos);
+            if (ret < 0)
+                return ret;
+            start += n;
+            cond_resched();
+        }
+    }
+    return 0;
+}
+
+/**
+ * Function: osfs_image_restore
+ * Description: Fills a memory mode superblock from a snapshot file written by
+ *              osfs_image_snapshot. The geometry comes from the snapshot, and
+ *              the allocated blocks are read in eagerly.
+ * Inputs:
+ *   - sb: The superblock to be filled.
+ *   - fc: The filesystem context, whose restore option names the file.
+ * Returns:
+ *   - 0 on success.
+ *   - -EPERM outside the initial user namespace.
+ *   - -EINVAL if the file is not a usable snapshot.
+ *   - A negative error code on other failures.
+ */
+int osfs_image_restore(struct super_block *sb, struct fs_context *fc)
+{
+    struct osfs_fs_context *ctx = fc->fs_private;
+    struct osfs_sb_info *sb_info;
+    struct osfs_disk_super ds;
+    struct file *file;
+    loff_t pos = 0;
+    int ret;
+
+    // Snapshots are parsed as trustingly as images
+    if (fc->user_ns != &init_user_ns) {
+        errorfc(fc, "snapshots can only be restored from the initial user namespace");
+        return -EPERM;
+    }
+
+    file = filp_open(ctx->restore, O_RDONLY | O_LARGEFILE, 0);
+    if (IS_ERR(file)) {
+        errorfc(fc, "cannot open snapshot %s", ctx->restore);
+        return PTR_ERR(file);
+    }
+
+    ret = -EINVAL;
+    if (kernel_read(file, &ds, sizeof(ds), &pos) != sizeof(ds)) {
+        errorfc(fc, "snapshot is too short");
+        goto out;
+    }
+    ret = osfs_image_check_super(fc, &ds);
+    if (ret)
+        goto out;
+    ret = -EINVAL;
+    if (ds.s_state != OSFS_STATE_CLEAN ||
+        i_size_read(file_inode(file)) < ds.s_layout.l_end * ds.s_block_size) {
+        errorfc(fc, "snapshot is incomplete");
+        goto out;
+    }
+
+    ret = osfs_setup_super(sb, ds.s_block_size, ds.s_inode_count, ds.s_block_count, ctx->numa);
+    if (ret)
+        goto out;
+    sb_info = sb->s_fs_info;
+    sb_info->layout = ds.s_layout;
+
+    ret = osfs_image_load(sb, file, true);
+    if (!ret)
+        ret = osfs_image_read_data(sb, file);
+    if (!ret)
+        ret = osfs_image_open_root(sb);
+    if (!ret)
+        pr_info("osfs: Restored %u blocks from %s\n", ds.s_block_count, ctx->restore);
+out:
+    fput(file);
+    return ret;
+}
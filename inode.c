@@ -1,6 +1,8 @@
 #include <linux/fs.h>
+#include <linux/slab.h>
 #include <linux/uaccess.h>
 #include "osfs.h"
+#include "osfs_trace.h"
 
 /**
  * Function: osfs_get_osfs_inode
@@ -18,12 +20,33 @@ struct osfs_inode *osfs_get_osfs_inode(struct super_block *sb, uint32_t ino)
 
     if (ino == 0 || ino >= sb_info->inode_count) // File system inode count upper bound
         return NULL;
-    return &((struct osfs_inode *)(sb_info->inode_table))[ino];
+    return &sb_info->inode_table[ino];
+}
+
+/**
+ * Function: osfs_get_inode_meta
+ * Description: Retrieves the cold half of an inode (see struct osfs_inode_meta).
+ * Inputs:
+ *   - sb: The superblock of the filesystem.
+ *   - ino: The inode number to retrieve.
+ * Returns:
+ *   - A pointer to the osfs_inode_meta structure if successful.
+ *   - NULL if the inode number is invalid or out of bounds.
+ */
+struct osfs_inode_meta *osfs_get_inode_meta(struct super_block *sb, uint32_t ino)
+{
+    struct osfs_sb_info *sb_info = sb->s_fs_info;
+
+    if (ino == 0 || ino >= sb_info->inode_count)
+        return NULL;
+    return &sb_info->inode_meta[ino];
 }
 
 /**
  * Function: osfs_get_free_inode
- * Description: Allocates a free inode number from the inode bitmap.
+ * Description: Allocates a free inode number from the inode bitmap. Concurrent
+ *              creators race on test_and_set_bit and the loser simply retries,
+ *              so no lock is needed.
  * Inputs:
  *   - sb_info: The superblock information of the filesystem.
  * Returns:
@@ -32,22 +55,39 @@ struct osfs_inode *osfs_get_osfs_inode(struct super_block *sb, uint32_t ino)
  */
 int osfs_get_free_inode(struct osfs_sb_info *sb_info)
 {
-    uint32_t ino;
+    uint32_t ino = 1;
 
-    for (ino = 1; ino < sb_info->inode_count; ino++) {
-        if (!test_bit(ino, sb_info->inode_bitmap)) {
-            set_bit(ino, sb_info->inode_bitmap);
-            sb_info->nr_free_inodes--;
+    while ((ino = find_next_zero_bit(sb_info->inode_bitmap, sb_info->inode_count, ino)) <
+           sb_info->inode_count) {
+        if (!test_and_set_bit(ino, sb_info->inode_bitmap)) {
+            percpu_counter_dec(&sb_info->nr_free_inodes);
             return ino;
         }
     }
-    pr_err("osfs_get_free_inode: No free inode available\n");
     return -ENOSPC;
 }
 
+/**
+ * Function: osfs_put_free_inode
+ * Description: Gives back an inode number taken by osfs_get_free_inode that
+ *              never got an inode.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - ino: The inode number.
+ * Returns:
+ *   - None.
+ */
+void osfs_put_free_inode(struct osfs_sb_info *sb_info, uint32_t ino)
+{
+    clear_bit_unlock(ino, sb_info->inode_bitmap);
+    percpu_counter_inc(&sb_info->nr_free_inodes);
+}
+
 /**
  * Function: osfs_iget
- * Description: Creates or retrieves a VFS inode from a given inode number.
+ * Description: Retrieves the VFS inode of a given inode number, from the inode
+ *              cache when it is already in core and built from the osfs_inode
+ *              otherwise.
  * Inputs:
  *   - sb: The superblock of the filesystem.
  *   - ino: The inode number to load.
@@ -58,27 +98,34 @@ int osfs_get_free_inode(struct osfs_sb_info *sb_info)
  */
 struct inode *osfs_iget(struct super_block *sb, unsigned long ino)
 {
+    struct osfs_inode_meta *meta;
     struct osfs_inode *osfs_inode;
     struct inode *inode;
 
-    osfs_inode = osfs_get_osfs_inode(sb, ino);
-    if (!osfs_inode)
-        return ERR_PTR(-EFAULT);
-
-    inode = new_inode(sb);
+    inode = iget_locked(sb, ino);
     if (!inode)
         return ERR_PTR(-ENOMEM);
+    if (!(inode->i_state & I_NEW))
+        return inode;
+
+    osfs_inode = osfs_get_osfs_inode(sb, ino);
+    meta = osfs_get_inode_meta(sb, ino);
+    if (!osfs_inode || !meta) {
+        iget_failed(inode);
+        return ERR_PTR(-EFAULT);
+    }
 
-    inode->i_ino = ino;
-    inode->i_sb = sb;
     inode->i_mode = osfs_inode->i_mode;
-    i_uid_write(inode, osfs_inode->i_uid);
-    i_gid_write(inode, osfs_inode->i_gid);
-    inode->__i_atime = osfs_inode->__i_atime;
-    inode->__i_mtime = osfs_inode->__i_mtime;
-    inode->__i_ctime = osfs_inode->__i_ctime;
+    i_uid_write(inode, meta->i_uid);
+    i_gid_write(inode, meta->i_gid);
+    set_nlink(inode, osfs_inode->i_links_count);
+    inode->__i_atime = meta->__i_atime;
+    inode->__i_mtime = meta->__i_mtime;
+    inode->__i_ctime = meta->__i_ctime;
     inode->i_size = osfs_inode->i_size;
-    inode->i_blocks = osfs_inode->i_blocks;
+    OSFS_I(inode)->i_disksize = inode->i_size;
+    // Only a starting point: osfs_getattr reports the current count
+    inode->i_blocks = (blkcnt_t)osfs_inode->i_blocks << (inode->i_blkbits - 9);
     inode->i_private = osfs_inode;
 
     if (S_ISDIR(inode->i_mode)) {
@@ -87,14 +134,143 @@ struct inode *osfs_iget(struct super_block *sb, unsigned long ino)
     } else if (S_ISREG(inode->i_mode)) {
         inode->i_op = &osfs_file_inode_operations;
         inode->i_fop = &osfs_file_operations;
+        inode->i_mapping->a_ops = &osfs_aops;
     }
 
-    // Insert the inode into the inode hash
-    insert_inode_hash(inode);
-
+    unlock_new_inode(inode);
     return inode;
 }
 
+/**
+ * Function: osfs_find_free_block
+ * Description: Finds the first free data block at or after start. Words of the
+ *              block bitmap flagged as full in block_summary are skipped, so
+ *              the cost depends on the number of words with room rather than
+ *              on the number of allocated blocks.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - start: The block number to start searching at.
+ * Returns:
+ *   - The free block number, or block_count if none is left after start.
+ */
+static uint32_t osfs_find_free_block(struct osfs_sb_info *sb_info, uint32_t start)
+{
+    unsigned long nr_words = BITMAP_SIZE(sb_info->block_count);
+    unsigned long word = start / BITS_PER_LONG;
+    unsigned long bit, limit;
+
+    while ((word = find_next_zero_bit(sb_info->block_summary, nr_words, word)) < nr_words) {
+        limit = min_t(unsigned long, (word + 1) * BITS_PER_LONG, sb_info->block_count);
+        bit = find_next_zero_bit(sb_info->block_bitmap, limit,
+                                 max_t(unsigned long, word * BITS_PER_LONG, start));
+        if (bit < limit)
+            return bit;
+        word++;
+    }
+    return sb_info->block_count;
+}
+
+/**
+ * Function: osfs_update_block_summary
+ * Description: Flags the bitmap words covering [start, start + len) that became
+ *              full. A clear summary bit only means "may have room", so frees
+ *              just clear it without rescanning.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - start: The first block that was allocated.
+ *   - len: The number of blocks allocated.
+ * Returns:
+ *   - None.
+ */
+void osfs_update_block_summary(struct osfs_sb_info *sb_info, uint32_t start, uint32_t len)
+{
+    unsigned long word, first = start / BITS_PER_LONG, last = (start + len - 1) / BITS_PER_LONG;
+    unsigned long limit;
+
+    for (word = first; word <= last; word++) {
+        limit = min_t(unsigned long, (word + 1) * BITS_PER_LONG, sb_info->block_count);
+        if (find_next_zero_bit(sb_info->block_bitmap, limit, word * BITS_PER_LONG) >= limit)
+            set_bit(word, sb_info->block_summary);
+    }
+}
+
+/**
+ * Function: osfs_claim_blocks
+ * Description: Marks [start, start + len) as allocated in the block bitmap.
+ *              Called with alloc_lock held.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - start: The first block of the run.
+ *   - len: The number of blocks in the run.
+ * Returns:
+ *   - None.
+ */
+static void osfs_claim_blocks(struct osfs_sb_info *sb_info, uint32_t start, uint32_t len)
+{
+    bitmap_set(sb_info->block_bitmap, start, len);
+    osfs_update_block_summary(sb_info, start, len);
+    percpu_counter_sub(&sb_info->nr_free_blocks, len);
+    sb_info->alloc_hint = start + len < sb_info->block_count ? start + len : 0;
+    if (sb_info->numa == OSFS_NUMA_LOCAL)
+        sb_info->numa_nodes[osfs_numa_home(sb_info, start)].hint = sb_info->alloc_hint;
+}
+
+/**
+ * Function: osfs_free_run_length
+ * Description: Measures the free run starting at a free block.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - start: A free block number.
+ *   - max: The length beyond which the caller is not interested.
+ * Returns:
+ *   - The number of consecutive free blocks at start, capped at max.
+ */
+static uint32_t osfs_free_run_length(struct osfs_sb_info *sb_info, uint32_t start, uint32_t max)
+{
+    uint32_t limit = start + min(max, sb_info->block_count - start);
+
+    return find_next_bit(sb_info->block_bitmap, limit, start) - start;
+}
+
+/**
+ * Function: osfs_group_room
+ * Description: Caps the length of a run starting at a block to the end of the
+ *              block's allocation group, for allocations kept on one node.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - start: The first block of the run.
+ *   - count: The number of blocks wanted.
+ * Returns:
+ *   - The number of blocks the run may span.
+ */
+static uint32_t osfs_group_room(struct osfs_sb_info *sb_info, uint32_t start, uint32_t count)
+{
+    uint64_t end = ((uint64_t)(start >> sb_info->numa_group_bits) + 1) << sb_info->numa_group_bits;
+
+    return min_t(uint64_t, count, end - start);
+}
+
+/**
+ * Function: osfs_next_home_group
+ * Description: Finds the first block of the next allocation group after the
+ *              one of a block that is homed on a given node.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - home: The index of the node in numa_nodes.
+ *   - block_no: A block in a group of another node.
+ * Returns:
+ *   - The first block of that group, or block_count if there is none.
+ */
+static uint32_t osfs_next_home_group(struct osfs_sb_info *sb_info, unsigned int home,
+                                     uint32_t block_no)
+{
+    uint64_t group = (block_no >> sb_info->numa_group_bits) + 1;
+
+    group += (home + sb_info->numa_nr_nodes - group % sb_info->numa_nr_nodes) %
+             sb_info->numa_nr_nodes;
+    return min_t(uint64_t, group << sb_info->numa_group_bits, sb_info->block_count);
+}
+
 /**
  * Function: osfs_alloc_data_block
  * Description: Allocates a free data block from the block bitmap.
@@ -107,98 +283,229 @@ struct inode *osfs_iget(struct super_block *sb, unsigned long ino)
  */
 int osfs_alloc_data_block(struct osfs_sb_info *sb_info, uint32_t *block_no)
 {
-    uint32_t i;
+    uint32_t allocated;
+
+    return osfs_alloc_data_run(sb_info, OSFS_NO_GOAL, 1, block_no, &allocated);
+}
+
+/**
+ * Function: osfs_alloc_data_run
+ * Description: Allocates a run of contiguous free data blocks, preferring long runs:
+ *              1. If goal is free, the run starts there, so a file's last extent
+ *                 simply grows.
+ *              2. Otherwise free runs are visited from the rotating allocation
+ *                 hint; the first one holding count blocks wins. At most
+ *                 OSFS_ALLOC_SCAN_RUNS runs are examined, after which the
+ *                 longest one seen is used.
+ *              With numa=local a writer's runs come from the allocation groups
+ *              of its node, starting at the node's hint and ending with their
+ *              group, and the goal only counts in such a group; the whole
+ *              device is searched as above once those groups are full.
+ *              The bitmap, its summary and the hints are protected by alloc_lock.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - goal: The preferred first block, or OSFS_NO_GOAL.
+ *   - count: The maximum number of blocks wanted.
+ *   - block_no: Pointer to store the first allocated block number.
+ *   - allocated: Pointer to store the run length (between 1 and count).
+ * Returns:
+ *   - 0 on successful allocation.
+ *   - -ENOSPC if no free data block is available.
+ */
+int osfs_alloc_data_run(struct osfs_sb_info *sb_info, uint32_t goal, uint32_t count,
+                        uint32_t *block_no, uint32_t *allocated)
+{
+    u64 stat_start = osfs_stat_start();
+    uint32_t start, len, hint, best_start = 0, best_len = 0;
+    uint32_t pos;
+    bool wrapped;
+    unsigned int scanned = 0;
+    enum osfs_alloc_result result;
+    int home = osfs_numa_local(sb_info);
+    int runs;
+
+    spin_lock(&sb_info->alloc_lock);
+    if (goal < sb_info->block_count && !test_bit(goal, sb_info->block_bitmap) &&
+        (home < 0 || osfs_numa_home(sb_info, goal) == home)) {
+        best_start = goal;
+        best_len = osfs_free_run_length(sb_info, goal,
+                                        home < 0 ? count : osfs_group_room(sb_info, goal, count));
+        result = OSFS_ALLOC_GOAL;
+        goto claim;
+    }
+
+retry:
+    hint = home < 0 ? sb_info->alloc_hint : sb_info->numa_nodes[home].hint;
+    pos = hint;
+    wrapped = false;
+    for (runs = 0; runs < OSFS_ALLOC_SCAN_RUNS;) {
+        start = osfs_find_free_block(sb_info, pos);
+        if (start >= sb_info->block_count) {
+            if (wrapped)
+                break;
+            wrapped = true;
+            pos = 0;
+            continue;
+        }
+        // Past the hint again: every free run has been seen
+        if (wrapped && start >= hint)
+            break;
+        // Groups of other nodes wait until the writer's are full
+        if (home >= 0 && osfs_numa_home(sb_info, start) != home) {
+            pos = osfs_next_home_group(sb_info, home, start);
+            continue;
+        }
 
-    for (i = 0; i < sb_info->block_count; i++) {
-        if (!test_bit(i, sb_info->block_bitmap)) {
-            set_bit(i, sb_info->block_bitmap);
-            sb_info->nr_free_blocks--;
-            *block_no = i;
-            return 0;
+        len = osfs_free_run_length(sb_info, start,
+                                   home < 0 ? count : osfs_group_room(sb_info, start, count));
+        scanned++;
+        runs++;
+        if (len > best_len) {
+            best_start = start;
+            best_len = len;
+            if (len == count)
+                break;
         }
+        pos = start + len;
     }
-    pr_err("osfs_alloc_data_block: No free data block available\n");
-    return -ENOSPC;
+
+    if (!best_len && home >= 0) {
+        home = -1;
+        goto retry;
+    }
+    if (!best_len) {
+        spin_unlock(&sb_info->alloc_lock);
+        trace_osfs_alloc(goal, count, 0, 0);
+        osfs_stat_alloc(sb_info, OSFS_ALLOC_NOSPC, scanned, count, 0);
+        osfs_stat_end(sb_info, OSFS_STAT_ALLOC, stat_start);
+        return -ENOSPC;
+    }
+    result = best_len == count ? OSFS_ALLOC_FIT : OSFS_ALLOC_LONGEST;
+
+claim:
+    osfs_claim_blocks(sb_info, best_start, best_len);
+    spin_unlock(&sb_info->alloc_lock);
+    *block_no = best_start;
+    *allocated = best_len;
+    trace_osfs_alloc(goal, count, best_start, best_len);
+    osfs_stat_alloc(sb_info, result, scanned, count, best_len);
+    osfs_stat_end(sb_info, OSFS_STAT_ALLOC, stat_start);
+    return 0;
 }
 
-// allocate multiple data blocks
-int osfs_alloc_multiple_data_blocks(struct osfs_sb_info *sb_info, uint32_t *block_nos, int32_t *block_length, int block_needed)
+/**
+ * Function: __osfs_free_data_block
+ * Description: Drops one owner of a data block. The last owner returns it to
+ *              the block bitmap and drops its backing memory. Called with
+ *              alloc_lock held.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - block_no: The data block to free.
+ * Returns:
+ *   - true if the block was freed, false if it is still shared.
+ */
+static bool __osfs_free_data_block(struct osfs_sb_info *sb_info, uint32_t block_no)
 {
-    uint32_t i;
-    int block_count = 0, block_idx = 0;
-    for (i = 0; i < sb_info->block_count; i++) {
-        if (!test_bit(i, sb_info->block_bitmap)) {
-            set_bit(i, sb_info->block_bitmap);
-            sb_info->nr_free_blocks--;
-            block_nos[block_idx] = i;
-            block_length[block_idx] = 1;
-            block_count++;
-            i++;
-            if (block_count == block_needed) return 0;
-            while(i < sb_info->block_count && test_bit(i, sb_info->block_bitmap)) {
-                set_bit(i, sb_info->block_bitmap);
-                block_length[block_count]++;
-                sb_info->nr_free_blocks--;
-                block_count++;
-                i++;
-                if (block_count == block_needed) return 0;
-            }
-            i--;
-        }
+    if (sb_info->block_refs && sb_info->block_refs[block_no]) {
+        sb_info->block_refs[block_no]--;
+        return false;
     }
-    pr_err("osfs_alloc_data_block: No free data block available\n");
-    return -ENOSPC;
+    clear_bit(block_no, sb_info->block_bitmap);
+    clear_bit(block_no / BITS_PER_LONG, sb_info->block_summary);
+    osfs_block_release(sb_info, block_no);
+    return true;
 }
 
-int osfs_realloc_multiple_data_blocks(struct osfs_sb_info *sb_info, uint32_t *block_nos, int32_t *block_length, int block_needed)
+/**
+ * Function: osfs_free_data_run
+ * Description: Frees a run of contiguous data blocks.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - start: The first block of the run.
+ *   - len: The number of blocks in the run.
+ * Returns:
+ *   - None.
+ */
+void osfs_free_data_run(struct osfs_sb_info *sb_info, uint32_t start, uint32_t len)
 {
-    int block_count = 0, block_idx = 0;
-    for (block_idx = 0; block_idx < block_needed; block_idx++) {
-        if (block_length[block_idx] != -1) {
-            block_count += block_length[block_idx];
+    u64 stat_start = osfs_stat_start();
+    uint32_t i, freed = 0;
+
+    spin_lock(&sb_info->alloc_lock);
+    for (i = 0; i < len; i++)
+        freed += __osfs_free_data_block(sb_info, start + i);
+    spin_unlock(&sb_info->alloc_lock);
+    percpu_counter_add(&sb_info->nr_free_blocks, freed);
+    trace_osfs_free(start, len, freed);
+    osfs_stat_end(sb_info, OSFS_STAT_FREE, stat_start);
+}
+
+/**
+ * Function: osfs_share_data_run
+ * Description: Adds an owner to every block of an allocated run, for a file
+ *              cloning it. The reference counts are only allocated by the first
+ *              clone; until then every allocated block has a single owner.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - start: The first block of the run.
+ *   - len: The number of blocks in the run.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if the reference counts cannot be allocated.
+ */
+int osfs_share_data_run(struct osfs_sb_info *sb_info, uint32_t start, uint32_t len)
+{
+    uint32_t *refs = READ_ONCE(sb_info->block_refs);
+    uint32_t i;
+
+    if (!refs) {
+        refs = kvcalloc(sb_info->block_count, sizeof(*refs), GFP_KERNEL);
+        if (!refs)
+            return -ENOMEM;
+        spin_lock(&sb_info->alloc_lock);
+        if (sb_info->block_refs) {
+            spin_unlock(&sb_info->alloc_lock);
+            kvfree(refs);
         } else {
-            break;
-        }
-    }
-    // print bitmap
-    // {
-    //     pr_info("osfs_realloc_multiple_data_blocks: block_count: %d\n", block_count);
-    //     char *bitmap = (char *)kmalloc(sizeof(char) * sb_info->block_count, GFP_KERNEL);
-    //     for (i = 0; i < sb_info->block_count; i++) {
-    //         bitmap[i] = test_bit(i, sb_info->block_bitmap) ? '1' : '0';
-    //     }
-    //     pr_info("osfs_realloc_multiple_data_blocks: block bitmap: %s\n", bitmap);
-    //     kfree(bitmap);
-    // }
-
-    for (uint32_t i = 0; i < sb_info->block_count; i++) {
-        if (!test_bit(i, sb_info->block_bitmap)) {
-            set_bit(i, sb_info->block_bitmap);
-            sb_info->nr_free_blocks--;
-            block_nos[block_idx] = i;
-            block_length[block_idx] = 1;
-            block_count++;
-            i++;
-            if (block_count == block_needed) return 0;
-            while(i < sb_info->block_count && !test_bit(i, sb_info->block_bitmap)) {
-                set_bit(i, sb_info->block_bitmap);
-                block_length[block_idx]++;
-                sb_info->nr_free_blocks--;
-                block_count++;
-                i++;
-                if (block_count == block_needed) return 0;
-            }
-            i--;
-            block_idx++;
+            WRITE_ONCE(sb_info->block_refs, refs);
+            spin_unlock(&sb_info->alloc_lock);
         }
     }
 
-    pr_err("osfs_alloc_data_block: No free data block available\n");
-    return -ENOSPC;
+    spin_lock(&sb_info->alloc_lock);
+    for (i = 0; i < len; i++)
+        sb_info->block_refs[start + i]++;
+    spin_unlock(&sb_info->alloc_lock);
+    return 0;
 }
 
+/**
+ * Function: osfs_block_shared
+ * Description: Tells whether a data block has more than one owner, so its
+ *              owners must copy it before modifying it.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - block_no: The data block number.
+ * Returns:
+ *   - true if the block is shared.
+ */
+bool osfs_block_shared(struct osfs_sb_info *sb_info, uint32_t block_no)
+{
+    uint32_t *refs = READ_ONCE(sb_info->block_refs);
+
+    return refs && READ_ONCE(refs[block_no]);
+}
+
+/**
+ * Function: osfs_free_data_block
+ * Description: Returns a data block to the block bitmap and drops its backing memory.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - block_no: The data block to free.
+ * Returns:
+ *   - None.
+ */
 void osfs_free_data_block(struct osfs_sb_info *sb_info, uint32_t block_no)
 {
-    clear_bit(block_no, sb_info->block_bitmap);
-    sb_info->nr_free_blocks++;
-}
\ No newline at end of file
+    osfs_free_data_run(sb_info, block_no, 1);
+}
@@ -0,0 +1,722 @@
+#include <linux/blkdev.h>
+#include <linux/crc32.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/workqueue.h>
+#include <linux/xarray.h>
+#include "osfs.h"
+
+/*
+ * Metadata journal of image mode: a redo log of whole inodes and directory
+ * blocks in the journal area of the image.
+ *
+ * Changes are not logged as they happen; operations only record which inodes
+ * and directory blocks they touched in the running transaction, and the commit
+ * copies their current state. Operations changing several objects (creating,
+ * removing) run inside a handle, osfs_journal_start/stop, which holds j_sem
+ * shared; the commit takes it exclusive while it copies, so every transaction
+ * holds whole operations. Changes to a single inode (extending a file) need no
+ * handle, the copy is taken under the lock of the inode (osfs_image_pin_inode).
+ * Because all the state is copied at once, however many operations joined
+ * the transaction are made durable by one journal write and one cache flush:
+ * commits run every OSFS_COMMIT_INTERVAL, and fsync or sync waits for the
+ * commit of the transaction running when it was called, sharing it with
+ * everyone else waiting.
+ *
+ * Data is not journaled, but written to the data area before the transaction
+ * referencing it; the inode size in a transaction is capped to the data
+ * already in the block store (i_disksize). Block bitmaps are not journaled
+ * either: after replay they are rebuilt from the extents.
+ *
+ * A checkpoint (osfs_image_checkpoint) rewrites all metadata in place and
+ * empties the journal, when the journal is full and at unmount. On disk, a
+ * transaction is a header followed by its records, starting on a block
+ * boundary; transactions follow each other from the start of the area, with
+ * consecutive sequence numbers from s_journal_seq of the superblock. Replay
+ * stops at the first block that is not the next transaction or whose checksum
+ * does not match, which is where a crash interrupted the journal.
+ */
+
+#define OSFS_JOURNAL_MAGIC 0x4f534a4c  // "OSJL"
+#define OSFS_COMMIT_INTERVAL (5 * HZ)
+#define OSFS_JOURNAL_MIN_BLOCKS 256
+#define OSFS_JOURNAL_MAX_BLOCKS 4096
+
+/**
+ * Struct: osfs_journal_header
+ * Description: Start of a transaction in the journal area. h_crc is the
+ *              crc32 of the header, with h_crc zero, and of the records.
+ */
+struct osfs_journal_header {
+    uint32_t h_magic;                   // OSFS_JOURNAL_MAGIC
+    uint32_t h_crc;                     // Checksum of the transaction
+    uint64_t h_seq;                     // Sequence number
+    uint32_t h_len;                     // Bytes of records following the header
+    uint32_t h_nr_records;              // Number of records
+};
+
+enum osfs_journal_record_type {
+    OSFS_JREC_INODE = 1,                // struct osfs_inode, osfs_inode_meta, spilled extents
+                                        // or inline data
+    OSFS_JREC_BLOCK = 2,                // Contents of a directory block
+};
+
+/**
+ * Struct: osfs_journal_record
+ * Description: Header of a record, followed by r_len bytes of payload. Records
+ *              are packed without padding.
+ */
+struct osfs_journal_record {
+    uint16_t r_type;                    // enum osfs_journal_record_type
+    uint16_t r_reserved;
+    uint32_t r_id;                      // Inode number or data block number
+    uint32_t r_len;                     // Bytes of payload
+};
+
+/**
+ * Struct: osfs_transaction
+ * Description: The inodes and directory blocks touched since the last commit.
+ *              The xarrays only hold value entries, the index is the key.
+ */
+struct osfs_transaction {
+    uint64_t t_seq;                     // Sequence the transaction commits as
+    struct xarray t_inodes;             // Inode numbers
+    struct xarray t_blocks;             // Directory block numbers
+    bool t_overflow;                    // A touch could not be recorded: checkpoint instead
+};
+
+/**
+ * Struct: osfs_journal
+ * Description: Journal state of a mounted image.
+ */
+struct osfs_journal {
+    struct super_block *j_sb;
+    struct rw_semaphore j_sem;          // Shared by handles, exclusive while a commit copies
+    spinlock_t j_lock;                  // Protects j_running
+    struct osfs_transaction *j_running; // Transaction operations join
+    struct mutex j_commit_mutex;        // Serializes commits and checkpoints
+    uint64_t j_committed;               // Last sequence known durable
+    uint64_t j_replay_seq;              // s_journal_seq at mount
+    uint64_t j_head;                    // First free block of the journal area
+    uint64_t j_blocks;                  // Size of the journal area
+    bool j_failed;                      // A journal write failed: checkpoint next
+    void *j_buf;                        // Transaction being written or replayed, j_blocks long
+    struct delayed_work j_commit_work;  // Periodic commit
+};
+
+/**
+ * Function: osfs_journal_blocks
+ * Description: Sizes the journal area of an image: about 1/1024 of the data
+ *              area, within OSFS_JOURNAL_MIN_BLOCKS and OSFS_JOURNAL_MAX_BLOCKS.
+ * Inputs:
+ *   - block_count: The number of data blocks of the image.
+ * Returns:
+ *   - The number of blocks.
+ */
+uint64_t osfs_journal_blocks(uint32_t block_count)
+{
+    return clamp_t(uint64_t, block_count / 1024, OSFS_JOURNAL_MIN_BLOCKS, OSFS_JOURNAL_MAX_BLOCKS);
+}
+
+static struct osfs_transaction *osfs_transaction_alloc(uint64_t seq)
+{
+    struct osfs_transaction *t;
+
+    t = kzalloc(sizeof(*t), GFP_NOFS);
+    if (!t)
+        return NULL;
+    t->t_seq = seq;
+    xa_init(&t->t_inodes);
+    xa_init(&t->t_blocks);
+    return t;
+}
+
+static void osfs_transaction_free(struct osfs_transaction *t)
+{
+    xa_destroy(&t->t_inodes);
+    xa_destroy(&t->t_blocks);
+    kfree(t);
+}
+
+static bool osfs_transaction_empty(struct osfs_transaction *t)
+{
+    return xa_empty(&t->t_inodes) && xa_empty(&t->t_blocks) && !t->t_overflow;
+}
+
+static void osfs_journal_commit_work(struct work_struct *work);
+
+/**
+ * Function: osfs_journal_init
+ * Description: Sets up the journal of an image being mounted. The journal is
+ *              left as found; osfs_journal_replay reads it back.
+ * Inputs:
+ *   - sb: The superblock, set up by osfs_setup_super with its layout.
+ *   - seq: The sequence of the first transaction in the journal area.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if memory allocation fails.
+ */
+int osfs_journal_init(struct super_block *sb, uint64_t seq)
+{
+    struct osfs_sb_info *sb_info = sb->s_fs_info;
+    struct osfs_journal *j;
+
+    j = kzalloc(sizeof(*j), GFP_KERNEL);
+    if (!j)
+        return -ENOMEM;
+
+    j->j_sb = sb;
+    init_rwsem(&j->j_sem);
+    spin_lock_init(&j->j_lock);
+    mutex_init(&j->j_commit_mutex);
+    INIT_DELAYED_WORK(&j->j_commit_work, osfs_journal_commit_work);
+    j->j_blocks = sb_info->layout.l_inode_bitmap - sb_info->layout.l_journal;
+    j->j_replay_seq = seq;
+    j->j_committed = seq - 1;
+    j->j_running = osfs_transaction_alloc(seq);
+    j->j_buf = vmalloc(j->j_blocks << sb_info->block_bits);
+    if (!j->j_running || !j->j_buf) {
+        if (j->j_running)
+            osfs_transaction_free(j->j_running);
+        vfree(j->j_buf);
+        kfree(j);
+        return -ENOMEM;
+    }
+
+    sb_info->journal = j;
+    return 0;
+}
+
+/**
+ * Function: osfs_journal_cancel
+ * Description: Stops the periodic commits, before the last checkpoint.
+ * Inputs:
+ *   - sb_info: The superblock information.
+ * Returns:
+ *   - None.
+ */
+void osfs_journal_cancel(struct osfs_sb_info *sb_info)
+{
+    if (sb_info->journal)
+        cancel_delayed_work_sync(&sb_info->journal->j_commit_work);
+}
+
+/**
+ * Function: osfs_journal_destroy
+ * Description: Frees the journal of an image being unmounted.
+ * Inputs:
+ *   - sb_info: The superblock information.
+ * Returns:
+ *   - None.
+ */
+void osfs_journal_destroy(struct osfs_sb_info *sb_info)
+{
+    struct osfs_journal *j = sb_info->journal;
+
+    if (!j)
+        return;
+    cancel_delayed_work_sync(&j->j_commit_work);
+    osfs_transaction_free(j->j_running);
+    vfree(j->j_buf);
+    kfree(j);
+    sb_info->journal = NULL;
+}
+
+/**
+ * Function: osfs_journal_start
+ * Description: Starts a handle: the changes made until osfs_journal_stop all
+ *              land in the same transaction. Does nothing in memory mode.
+ * Inputs:
+ *   - sb_info: The superblock information.
+ * Returns:
+ *   - None.
+ */
+void osfs_journal_start(struct osfs_sb_info *sb_info)
+{
+    if (sb_info->journal)
+        down_read(&sb_info->journal->j_sem);
+}
+
+void osfs_journal_stop(struct osfs_sb_info *sb_info)
+{
+    if (sb_info->journal)
+        up_read(&sb_info->journal->j_sem);
+}
+
+// Records a touched object in the running transaction; may be called in any context
+static void osfs_journal_touch(struct osfs_journal *j, bool inode, unsigned long id)
+{
+    struct osfs_transaction *t;
+    bool was_empty;
+
+    spin_lock(&j->j_lock);
+    t = j->j_running;
+    was_empty = osfs_transaction_empty(t);
+    if (xa_is_err(xa_store(inode ? &t->t_inodes : &t->t_blocks, id, xa_mk_value(0),
+                           GFP_ATOMIC)))
+        t->t_overflow = true;
+    spin_unlock(&j->j_lock);
+
+    if (was_empty)
+        schedule_delayed_work(&j->j_commit_work, OSFS_COMMIT_INTERVAL);
+}
+
+/**
+ * Function: osfs_journal_inode
+ * Description: Adds an inode to the running transaction, after changing it.
+ * Inputs:
+ *   - sb_info: The superblock information.
+ *   - ino: The inode number.
+ * Returns:
+ *   - None.
+ */
+void osfs_journal_inode(struct osfs_sb_info *sb_info, uint32_t ino)
+{
+    if (sb_info->journal)
+        osfs_journal_touch(sb_info->journal, true, ino);
+}
+
+/**
+ * Function: osfs_journal_block
+ * Description: Adds a directory block to the running transaction, after
+ *              changing it.
+ * Inputs:
+ *   - sb_info: The superblock information.
+ *   - block_no: The data block number.
+ * Returns:
+ *   - None.
+ */
+void osfs_journal_block(struct osfs_sb_info *sb_info, uint32_t block_no)
+{
+    if (sb_info->journal)
+        osfs_journal_touch(sb_info->journal, false, block_no);
+}
+
+/**
+ * Function: osfs_journal_seq
+ * Description: Returns the sequence of the running transaction, which is the
+ *              first one in the journal once a checkpoint completes.
+ * Inputs:
+ *   - sb_info: The superblock information.
+ * Returns:
+ *   - The sequence, 0 without a journal.
+ */
+uint64_t osfs_journal_seq(struct osfs_sb_info *sb_info)
+{
+    uint64_t seq;
+
+    if (!sb_info->journal)
+        return 0;
+    spin_lock(&sb_info->journal->j_lock);
+    seq = sb_info->journal->j_running->t_seq;
+    spin_unlock(&sb_info->journal->j_lock);
+    return seq;
+}
+
+/**
+ * Function: osfs_journal_lock
+ * Description: Quiesces the journal for a checkpoint: no commit runs and no
+ *              handle is open until osfs_journal_unlock.
+ * Inputs:
+ *   - sb_info: The superblock information.
+ * Returns:
+ *   - None.
+ */
+void osfs_journal_lock(struct osfs_sb_info *sb_info)
+{
+    struct osfs_journal *j = sb_info->journal;
+
+    if (!j)
+        return;
+    mutex_lock(&j->j_commit_mutex);
+    down_write(&j->j_sem);
+}
+
+/**
+ * Function: osfs_journal_unlock
+ * Description: Ends a checkpoint. Once one completed, the journal restarts
+ *              empty at the sequence of the running transaction, whose
+ *              touches are kept: they may postdate what the checkpoint copied.
+ * Inputs:
+ *   - sb_info: The superblock information.
+ *   - checkpointed: Whether the checkpoint completed.
+ * Returns:
+ *   - None.
+ */
+void osfs_journal_unlock(struct osfs_sb_info *sb_info, bool checkpointed)
+{
+    struct osfs_journal *j = sb_info->journal;
+
+    if (!j)
+        return;
+    if (checkpointed) {
+        j->j_head = 0;
+        j->j_failed = false;
+        j->j_committed = osfs_journal_seq(sb_info) - 1;
+    }
+    up_write(&j->j_sem);
+    mutex_unlock(&j->j_commit_mutex);
+}
+
+/**
+ * Function: osfs_journal_capture
+ * Description: Copies the objects of a transaction into j_buf, after room for
+ *              the header. Called with j_sem held exclusive.
+ * Inputs:
+ *   - j: The journal.
+ *   - t: The transaction, no longer running.
+ *   - space: The bytes available in the journal area.
+ *   - header: Filled with the header of the transaction, except the checksum.
+ * Returns:
+ *   - The length of the transaction in bytes on success.
+ *   - -ENOSPC if it does not fit in space.
+ *   - A negative error code on other failures.
+ */
+static ssize_t osfs_journal_capture(struct osfs_journal *j, struct osfs_transaction *t,
+                                    size_t space, struct osfs_journal_header *header)
+{
+    struct super_block *sb = j->j_sb;
+    struct osfs_sb_info *sb_info = sb->s_fs_info;
+    struct osfs_journal_record rec = { 0 };
+    size_t pos = sizeof(*header), nr_ext, inline_len;
+    struct osfs_inode copy;
+    struct inode *inode;
+    unsigned long id;
+    void *entry, *addr, *data;
+    bool spilled;
+
+    memset(header, 0, sizeof(*header));
+    xa_for_each(&t->t_inodes, id, entry) {
+        inode = osfs_image_pin_inode(sb, id);
+        if (!inode)
+            return -ENOMEM;
+        spilled = osfs_image_copy_inode(&sb_info->inode_table[id], inode, &copy);
+        nr_ext = spilled ? copy.i_nr_extents : 0;
+        // An inline file has no extents, its contents take their place
+        data = osfs_inode_inline(&copy) ? osfs_inline_get(sb_info, id) : NULL;
+        inline_len = data ? copy.i_size : 0;
+
+        rec.r_type = OSFS_JREC_INODE;
+        rec.r_id = id;
+        rec.r_len = sizeof(copy) + sizeof(struct osfs_inode_meta) +
+                    nr_ext * sizeof(struct osfs_extent) + inline_len;
+        if (pos + sizeof(rec) + rec.r_len > space) {
+            osfs_image_unpin_inode(inode);
+            return -ENOSPC;
+        }
+        memcpy(j->j_buf + pos, &rec, sizeof(rec));
+        pos += sizeof(rec);
+        memcpy(j->j_buf + pos, &copy, sizeof(copy));
+        pos += sizeof(copy);
+        memcpy(j->j_buf + pos, &sb_info->inode_meta[id], sizeof(struct osfs_inode_meta));
+        pos += sizeof(struct osfs_inode_meta);
+        memcpy(j->j_buf + pos, sb_info->inode_table[id].i_extents,
+               nr_ext * sizeof(struct osfs_extent));
+        pos += nr_ext * sizeof(struct osfs_extent);
+        memcpy(j->j_buf + pos, data, inline_len);
+        pos += inline_len;
+        header->h_nr_records++;
+        osfs_image_unpin_inode(inode);
+    }
+
+    xa_for_each(&t->t_blocks, id, entry) {
+        rec.r_type = OSFS_JREC_BLOCK;
+        rec.r_id = id;
+        rec.r_len = sb_info->block_size;
+        if (pos + sizeof(rec) + rec.r_len > space)
+            return -ENOSPC;
+        // A block freed since it was touched has nothing left to log
+        addr = osfs_block_addr(sb_info, id);
+        if (!addr)
+            continue;
+        memcpy(j->j_buf + pos, &rec, sizeof(rec));
+        pos += sizeof(rec);
+        memcpy(j->j_buf + pos, addr, rec.r_len);
+        pos += rec.r_len;
+        header->h_nr_records++;
+    }
+
+    header->h_magic = OSFS_JOURNAL_MAGIC;
+    header->h_seq = t->t_seq;
+    header->h_len = pos - sizeof(*header);
+    return pos;
+}
+
+/**
+ * Function: osfs_journal_do_commit
+ * Description: Commits the running transaction. Its objects are copied and
+ *              the data pages flushed with handles excluded, then the copy is
+ *              written to the journal and the device cache flushed. When the
+ *              transaction does not fit, a checkpoint is done instead. Called
+ *              with j_commit_mutex held.
+ * Inputs:
+ *   - j: The journal.
+ * Returns:
+ *   - 0 on success, a negative error code otherwise.
+ */
+static int osfs_journal_do_commit(struct osfs_journal *j)
+{
+    struct super_block *sb = j->j_sb;
+    struct osfs_sb_info *sb_info = sb->s_fs_info;
+    struct osfs_journal_header header;
+    struct osfs_transaction *t, *next;
+    size_t space = (j->j_blocks - j->j_head) << sb_info->block_bits;
+    ssize_t len;
+    int ret;
+
+    next = osfs_transaction_alloc(0);
+    if (!next)
+        return -ENOMEM;
+
+    down_write(&j->j_sem);
+    spin_lock(&j->j_lock);
+    t = j->j_running;
+    // An empty transaction keeps running: sequences on disk must not skip
+    if (osfs_transaction_empty(t) && !j->j_failed) {
+        spin_unlock(&j->j_lock);
+        up_write(&j->j_sem);
+        osfs_transaction_free(next);
+        return 0;
+    }
+    next->t_seq = t->t_seq + 1;
+    j->j_running = next;
+    spin_unlock(&j->j_lock);
+
+    len = t->t_overflow || j->j_failed ? -ENOSPC : osfs_journal_capture(j, t, space, &header);
+    if (len == -ENOSPC) {
+        // Everything t touched is in memory and goes home with the checkpoint
+        ret = osfs_image_checkpoint(sb, OSFS_STATE_MOUNTED);
+        if (!ret) {
+            j->j_head = 0;
+            j->j_failed = false;
+            j->j_committed = t->t_seq;
+        }
+        up_write(&j->j_sem);
+        osfs_transaction_free(t);
+        return ret;
+    }
+    ret = len < 0 ? len : osfs_flush_data_pages(sb_info);
+    up_write(&j->j_sem);
+    if (ret)
+        goto fail;
+
+    memcpy(j->j_buf, &header, sizeof(header));
+    header.h_crc = crc32_le(~0, j->j_buf, len);
+    memcpy(j->j_buf, &header, sizeof(header));
+
+    ret = osfs_image_io(sb, NULL, sb_info->layout.l_journal + j->j_head, j->j_buf, len, true);
+    if (!ret)
+        ret = sync_blockdev(sb->s_bdev);
+    if (!ret)
+        ret = blkdev_issue_flush(sb->s_bdev);
+    if (ret)
+        goto fail;
+
+    j->j_head += DIV_ROUND_UP(len, sb_info->block_size);
+    j->j_committed = t->t_seq;
+    osfs_transaction_free(t);
+    return 0;
+
+fail:
+    // The touches of t are gone; only a checkpoint covers them now
+    pr_err("osfs_journal_do_commit: Failed to commit transaction %llu: %d\n", t->t_seq, ret);
+    j->j_failed = true;
+    osfs_transaction_free(t);
+    return ret;
+}
+
+/**
+ * Function: osfs_journal_commit
+ * Description: Makes every change made before the call durable, committing
+ *              the running transaction unless a commit that started later has
+ *              already covered it. Does nothing in memory mode.
+ * Inputs:
+ *   - sb_info: The superblock information.
+ * Returns:
+ *   - 0 on success, a negative error code otherwise.
+ */
+int osfs_journal_commit(struct osfs_sb_info *sb_info)
+{
+    struct osfs_journal *j = sb_info->journal;
+    uint64_t target;
+    int ret = 0;
+
+    if (!j || sb_rdonly(j->j_sb))
+        return 0;
+
+    target = osfs_journal_seq(sb_info);
+    mutex_lock(&j->j_commit_mutex);
+    // Whoever held the mutex may have committed our transaction for us; an
+    // empty one is never committed, there is nothing to wait for then
+    if (j->j_committed < target)
+        ret = osfs_journal_do_commit(j);
+    mutex_unlock(&j->j_commit_mutex);
+    return ret;
+}
+
+static void osfs_journal_commit_work(struct work_struct *work)
+{
+    struct osfs_journal *j = container_of(work, struct osfs_journal, j_commit_work.work);
+    struct super_block *sb = j->j_sb;
+
+    // Mounting and unmounting hold s_umount; come back rather than race them
+    if (!down_read_trylock(&sb->s_umount)) {
+        schedule_delayed_work(&j->j_commit_work, OSFS_COMMIT_INTERVAL);
+        return;
+    }
+    if (sb->s_flags & SB_ACTIVE)
+        osfs_journal_commit(sb->s_fs_info);
+    up_read(&sb->s_umount);
+}
+
+/**
+ * Function: osfs_journal_apply
+ * Description: Applies the records of one transaction to the loaded metadata.
+ * Inputs:
+ *   - sb: The superblock.
+ *   - data: The records.
+ *   - len: Their length in bytes.
+ *   - blocks: false to apply inode records, true to apply block records.
+ * Returns:
+ *   - 0 on success.
+ *   - -EUCLEAN if a record is malformed.
+ *   - A negative error code on other failures.
+ */
+static int osfs_journal_apply(struct super_block *sb, const void *data, size_t len, bool blocks)
+{
+    struct osfs_sb_info *sb_info = sb->s_fs_info;
+    size_t base = sizeof(struct osfs_inode) + sizeof(struct osfs_inode_meta);
+    struct osfs_journal_record rec;
+    struct osfs_inode *osfs_inode;
+    size_t pos = 0;
+    void *addr;
+    int ret;
+
+    while (pos < len) {
+        if (len - pos < sizeof(rec))
+            return -EUCLEAN;
+        memcpy(&rec, data + pos, sizeof(rec));
+        pos += sizeof(rec);
+        if (len - pos < rec.r_len)
+            return -EUCLEAN;
+
+        switch (rec.r_type) {
+        case OSFS_JREC_INODE:
+            if (rec.r_len < base || !rec.r_id || rec.r_id >= sb_info->inode_count)
+                return -EUCLEAN;
+            if (blocks)
+                break;
+            osfs_inode = &sb_info->inode_table[rec.r_id];
+            osfs_extent_release_array(osfs_inode);
+            memcpy(osfs_inode, data + pos, sizeof(*osfs_inode));
+            memcpy(&sb_info->inode_meta[rec.r_id], data + pos + sizeof(*osfs_inode),
+                   sizeof(struct osfs_inode_meta));
+            osfs_inode->i_extents = NULL;
+            osfs_inode->i_extent_cap = 0;
+            if (osfs_inode->i_nr_extents > OSFS_INLINE_EXTENTS) {
+                if (rec.r_len != base + osfs_inode->i_nr_extents * sizeof(struct osfs_extent)) {
+                    osfs_inode->i_nr_extents = 0;
+                    return -EUCLEAN;
+                }
+                ret = osfs_extent_alloc_array(osfs_inode, osfs_inode->i_nr_extents);
+                if (ret) {
+                    osfs_inode->i_nr_extents = 0;
+                    return ret;
+                }
+                memcpy(osfs_inode->i_extents, data + pos + base, rec.r_len - base);
+            } else if (rec.r_len == base) {
+                osfs_inline_release(sb_info, rec.r_id);
+            } else if (osfs_inode_inline(osfs_inode) && rec.r_len == base + osfs_inode->i_size) {
+                addr = osfs_inline_prepare(sb_info, rec.r_id, GFP_KERNEL);
+                if (IS_ERR(addr))
+                    return PTR_ERR(addr);
+                memcpy(addr, data + pos + base, rec.r_len - base);
+                memset(addr + rec.r_len - base, 0, OSFS_INLINE_DATA_MAX - (rec.r_len - base));
+            } else {
+                return -EUCLEAN;
+            }
+            if (osfs_inode->i_mode)
+                set_bit(rec.r_id, sb_info->inode_bitmap);
+            else
+                clear_bit(rec.r_id, sb_info->inode_bitmap);
+            break;
+        case OSFS_JREC_BLOCK:
+            if (rec.r_len != sb_info->block_size || rec.r_id >= sb_info->block_count)
+                return -EUCLEAN;
+            // A block freed by a later transaction keeps reading as zeros
+            if (!blocks || !test_bit(rec.r_id, sb_info->block_bitmap))
+                break;
+            addr = osfs_block_prepare(sb_info, rec.r_id, GFP_KERNEL);
+            if (IS_ERR(addr))
+                return PTR_ERR(addr);
+            memcpy(addr, data + pos, rec.r_len);
+            break;
+        default:
+            return -EUCLEAN;
+        }
+        pos += rec.r_len;
+    }
+    return 0;
+}
+
+/**
+ * Function: osfs_journal_replay
+ * Description: Replays the committed transactions of the journal onto the
+ *              metadata loaded from the image. Inode records are replayed
+ *              before the block bitmap is rebuilt, block records once the
+ *              store knows which blocks are in use, so this runs twice.
+ * Inputs:
+ *   - sb: The superblock.
+ *   - blocks: false for the inode pass, true for the block pass.
+ * Returns:
+ *   - 0 on success.
+ *   - -EUCLEAN if a committed transaction is malformed.
+ *   - A negative error code on I/O or allocation failure.
+ */
+int osfs_journal_replay(struct super_block *sb, bool blocks)
+{
+    struct osfs_sb_info *sb_info = sb->s_fs_info;
+    struct osfs_journal *j = sb_info->journal;
+    struct osfs_journal_header header;
+    uint64_t seq = j->j_replay_seq, head = 0, nr_blocks;
+    uint32_t crc;
+    int ret;
+
+    while (head < j->j_blocks) {
+        ret = osfs_image_io(sb, NULL, sb_info->layout.l_journal + head, &header,
+                            sizeof(header), false);
+        if (ret)
+            return ret;
+        nr_blocks = DIV_ROUND_UP(sizeof(header) + (uint64_t)header.h_len, sb_info->block_size);
+        if (header.h_magic != OSFS_JOURNAL_MAGIC || header.h_seq != seq ||
+            nr_blocks > j->j_blocks - head)
+            break;
+
+        ret = osfs_image_io(sb, NULL, sb_info->layout.l_journal + head, j->j_buf,
+                            sizeof(header) + header.h_len, false);
+        if (ret)
+            return ret;
+        crc = header.h_crc;
+        header.h_crc = 0;
+        memcpy(j->j_buf, &header, sizeof(header));
+        if (crc32_le(~0, j->j_buf, sizeof(header) + header.h_len) != crc)
+            break;
+
+        ret = osfs_journal_apply(sb, j->j_buf + sizeof(header), header.h_len, blocks);
+        if (ret) {
+            pr_err("osfs_journal_replay: Bad transaction %llu: %d\n", seq, ret);
+            return ret;
+        }
+        head += nr_blocks;
+        seq++;
+    }
+
+    if (!blocks) {
+        pr_info("osfs: Replayed %llu journal transactions\n", seq - j->j_replay_seq);
+        j->j_running->t_seq = seq;
+        j->j_committed = seq - 1;
+        j->j_head = head;
+    }
+    return 0;
+}
@@ -7,24 +7,71 @@
 #include <linux/time.h>
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
+#include <linux/xarray.h>
+#include <linux/ktime.h>
+#include <linux/percpu_counter.h>
+#include <linux/rwsem.h>
+#include <linux/spinlock.h>
 #include <linux/string.h>
 #include <linux/module.h>
 
 #define OSFS_MAGIC 0x051AB520
 // #define BLOCK_SIZE 4096       // Each data block size is 4KB
-#define INODE_COUNT 20         // Maximum of 20 inodes in the filesystem
-#define DATA_BLOCK_COUNT 200    // Assume there are 20 data blocks
+#define OSFS_DEFAULT_INODE_COUNT 20     // Inodes when mounted without nr_inodes=
+#define OSFS_DEFAULT_BLOCK_COUNT 200    // Data blocks when mounted without size=
+#define OSFS_MIN_BLOCK_SIZE 512         // Smallest accepted block_size=
+#define OSFS_INODE_RAM_FRACTION 4       // Largest share of RAM nr_inodes= may take, as 1/n
+#define OSFS_NO_GOAL U32_MAX           // No preferred block for an allocation
+#define OSFS_ALLOC_SCAN_RUNS 16         // Free runs examined before settling for the longest
+#define OSFS_PREALLOC_MIN 16            // Smallest preallocation window, in blocks
+#define OSFS_PREALLOC_MAX 1024          // Largest preallocation window, in blocks
+#define OSFS_INLINE_EXTENTS 2           // Extents stored inside the osfs_inode itself
+#define OSFS_EXTENT_CHUNK 32            // Extents in one osfs_extent_cache object
+#define OSFS_INLINE_DATA_MAX 128        // Regular files up to this size keep their data inline
+#define OSFS_NUMA_GROUP_SHIFT 21        // log2 bytes of data in an allocation group (numa=local)
 #define MAX_FILENAME_LEN 255
-#define MAX_DIR_ENTRIES (BLOCK_SIZE / sizeof(struct osfs_dir_entry))
 
+// Calculate the size of a bitmap (in units of unsigned long)
 #define BITMAP_SIZE(bits) (((bits) + BITS_PER_LONG - 1) / BITS_PER_LONG)
 
-// Calculate the size of the bitmap (in units of unsigned long)
-#define INODE_BITMAP_SIZE BITMAP_SIZE(INODE_COUNT)
-#define BLOCK_BITMAP_SIZE BITMAP_SIZE(DATA_BLOCK_COUNT)
-
 #define ROOT_INODE 1            // Define the root inode as 1
 
+// Placement of the data pages across NUMA nodes, the numa= mount option (data.c)
+enum osfs_numa {
+    OSFS_NUMA_OFF,                      // Wherever the writer's memory policy puts them
+    OSFS_NUMA_INTERLEAVE,               // Page by page across the nodes
+    OSFS_NUMA_LOCAL,                    // On the home node of their allocation group
+};
+
+/**
+ * Struct: osfs_numa_node
+ * Description: A node data pages are placed on. Allocation groups are homed
+ *              on the nodes in turn; hint is where allocations by writers on
+ *              the node start searching (numa=local, alloc_lock).
+ */
+struct osfs_numa_node {
+    int nid;                            // NUMA node id
+    uint32_t hint;                      // First block to look at in the node's groups
+};
+
+/**
+ * Struct: osfs_image_layout
+ * Description: Where each area of an image starts, in blocks of block_size.
+ *              Areas follow the superblock in this order and start on block
+ *              boundaries; see osfs_image_layout() in image.c.
+ */
+struct osfs_image_layout {
+    uint64_t l_journal;                 // Metadata journal (journal.c)
+    uint64_t l_inode_bitmap;            // Inode bitmap, unsigned long words
+    uint64_t l_block_bitmap;            // Block bitmap, unsigned long words
+    uint64_t l_inode_table;             // struct osfs_inode[inode_count]
+    uint64_t l_inode_meta;              // struct osfs_inode_meta[inode_count]
+    uint64_t l_inline_data;             // OSFS_INLINE_DATA_MAX bytes per inode
+    uint64_t l_extents;                 // Spilled extent arrays, in inode order
+    uint64_t l_data;                    // Data blocks
+    uint64_t l_end;                     // Blocks spanned by the image
+};
+
 /**
  * Struct: osfs_sb_info
  * Description: Superblock information for the osfs filesystem.
@@ -32,67 +79,386 @@
 struct osfs_sb_info {
     uint32_t magic;              // Magic number to identify the filesystem
     uint32_t block_size;         // Size of each data block
+    uint32_t block_bits;         // log2(block_size)
     uint32_t inode_count;        // Total number of inodes
     uint32_t block_count;        // Total number of data blocks
-    uint32_t nr_free_inodes;     // Number of free inodes
-    uint32_t nr_free_blocks;     // Number of free data blocks
+    struct percpu_counter nr_free_inodes; // Number of free inodes
+    struct percpu_counter nr_free_blocks; // Number of free data blocks
+    struct percpu_counter nr_prealloc_blocks; // Blocks held in preallocation windows
+    spinlock_t alloc_lock;       // Protects block_bitmap, block_summary and the allocation hints
     unsigned long *inode_bitmap; // Pointer to the inode bitmap
     unsigned long *block_bitmap; // Pointer to the data block bitmap
-    void *inode_table;           // Pointer to the inode table
-    void *data_blocks;           // Pointer to the data blocks area
+    unsigned long *block_summary; // One bit per block_bitmap word, set when the word is full
+    uint32_t alloc_hint;         // Block the next allocation search starts at
+    uint32_t *block_refs;        // Owners beyond the first of each block, NULL until a clone (alloc_lock)
+    struct osfs_inode *inode_table; // Hot inode fields, cache line aligned
+    struct osfs_inode_meta *inode_meta; // Cold inode fields, same indexing
+    struct xarray data_pages;    // Pages backing the data blocks, populated on first write
+    struct xarray inline_data;   // Contents of inline files by inode number (extent.c)
+    struct block_device *bdev;   // Backing device in image mode, NULL in memory mode
+    struct osfs_image_layout layout; // Areas of the image (image mode)
+    unsigned long *image_valid;  // Blocks whose device copy is current (image mode)
+    struct osfs_journal *journal; // Metadata journal (image mode)
+    struct osfs_stats __percpu *stats; // Per-operation counters and latencies (stats.c)
+    struct dentry *debugfs_dir;  // Directory of this mount under debugfs osfs/
+    enum osfs_numa numa;         // Placement of the data pages
+    uint32_t numa_group_bits;    // log2 blocks in an allocation group
+    unsigned int numa_nr_nodes;  // Entries in numa_nodes
+    struct osfs_numa_node *numa_nodes; // Nodes online at mount, NULL with numa=off
     uint32_t first_level_index_block;  // First level block
 };
 
+/**
+ * Struct: osfs_fs_context
+ * Description: Mount options collected through the fs_context API.
+ */
+struct osfs_fs_context {
+    uint64_t size;               // Capacity of the data area in bytes (0: default)
+    uint32_t nr_inodes;          // Number of inodes, including the unused inode 0
+    uint32_t block_size;         // Size of each data block
+    bool format;                 // Create a new image on the device
+    char *restore;               // Snapshot file to restore a memory mode mount from
+    enum osfs_numa numa;         // Placement of the data pages
+};
+
+// Writes a snapshot of the filesystem to the file descriptor passed as argument
+#define OSFS_IOC_SNAPSHOT _IOW(0xE5, 1, int)
+
+#define OSFS_IMAGE_VERSION 3
+#define OSFS_STATE_CLEAN 0              // Image was unmounted cleanly
+#define OSFS_STATE_MOUNTED 1            // Image is mounted or was not unmounted
+
+/**
+ * Struct: osfs_disk_super
+ * Description: Superblock stored at byte 0 of an image. The inode table and
+ *              the bitmaps are stored as their in-memory arrays, so images are
+ *              only portable between machines with the same byte order, word
+ *              size and struct layouts; s_inode_size and s_meta_size catch the
+ *              latter.
+ */
+struct osfs_disk_super {
+    uint32_t s_magic;                   // OSFS_MAGIC
+    uint32_t s_version;                 // OSFS_IMAGE_VERSION
+    uint32_t s_block_size;              // Size of each block
+    uint32_t s_inode_count;             // Total number of inodes
+    uint32_t s_block_count;             // Total number of data blocks
+    uint16_t s_inode_size;              // sizeof(struct osfs_inode)
+    uint16_t s_meta_size;               // sizeof(struct osfs_inode_meta)
+    uint32_t s_state;                   // OSFS_STATE_*
+    uint32_t s_long_size;               // sizeof(unsigned long), the bitmap word
+    struct osfs_image_layout s_layout;  // Areas of the image
+    uint64_t s_journal_seq;             // Sequence of the first transaction in the journal
+};
+
 /**
  * Struct: osfs_dir_entry
- * Description: Directory entry structure.
+ * Description: Variable-length directory entry. Entries are packed back to back
+ *              and never cross a block; rec_len of the last entry in a block
+ *              reaches the end of the block, and an entry with inode_no 0 is an
+ *              unused record.
  */
 struct osfs_dir_entry {
-    char filename[MAX_FILENAME_LEN]; // File name
-    uint32_t inode_no;               // Corresponding inode number
+    uint32_t inode_no;               // Corresponding inode number, 0 if unused
+    uint16_t rec_len;                // Bytes from this entry to the next one
+    uint8_t name_len;                // Length of the name
+    uint8_t file_type;               // FT_* type of the file, see fs_umode_to_ftype()
+    char name[];                     // File name, not NUL-terminated
+};
+
+#define OSFS_DIR_ALIGN 4                // Entries start on 4-byte boundaries
+// Smallest record holding a name of the given length
+#define OSFS_DIR_REC_LEN(name_len) \
+    ALIGN(offsetof(struct osfs_dir_entry, name) + (name_len), OSFS_DIR_ALIGN)
+
+/**
+ * Struct: osfs_extent
+ * Description: A run of contiguous data blocks backing contiguous file blocks.
+ */
+struct osfs_extent {
+    uint32_t e_lblk;                    // First file block covered
+    uint32_t e_pblk;                    // First data block of the run
+    uint32_t e_len;                     // Number of blocks in the run
+};
+
+/**
+ * Struct: osfs_extent_cursor
+ * Description: Lookup hint remembering the extent hit last, kept per open file.
+ */
+struct osfs_extent_cursor {
+    uint32_t ec_index;                  // Index into i_extents of the last hit
+};
+
+struct osfs_dir_index;
+struct osfs_journal;
+struct osfs_stats;
+
+// Operations whose calls and latencies are counted per mount (stats.c)
+enum osfs_stat_op {
+    OSFS_STAT_LOOKUP,
+    OSFS_STAT_CREATE,
+    OSFS_STAT_MKDIR,
+    OSFS_STAT_UNLINK,
+    OSFS_STAT_LINK,
+    OSFS_STAT_RENAME,
+    OSFS_STAT_READ,
+    OSFS_STAT_WRITE,
+    OSFS_STAT_FSYNC,
+    OSFS_STAT_ALLOC,
+    OSFS_STAT_FREE,
+    OSFS_NR_STAT_OPS
+};
+
+#define OSFS_STAT_BUCKETS 32            // log2 latency buckets, 1ns to 2s and above
+
+// How osfs_alloc_data_run found the run it returned (stats.c)
+enum osfs_alloc_result {
+    OSFS_ALLOC_GOAL,                    // The goal block was free, the run starts there
+    OSFS_ALLOC_FIT,                     // The search found a run of the full count
+    OSFS_ALLOC_LONGEST,                 // No run was long enough, the longest seen was used
+    OSFS_ALLOC_NOSPC,                   // No free block at all
+    OSFS_NR_ALLOC_RESULTS
 };
 
 /**
  * Struct: osfs_inode
- * Description: Filesystem-specific inode structure.
+ * Description: Hot half of an on-media inode, everything the I/O paths and
+ *              table sweeps read. The inode table is an array of these, one
+ *              cache line each; the rest lives in struct osfs_inode_meta.
+ *              Fields are ordered by decreasing size so the struct has no
+ *              holes: 40 bytes of scalars plus the inline extents fill 64
+ *              bytes on 64-bit. Keep it that way when adding fields.
  */
 struct osfs_inode {
-    uint32_t i_ino;                     // Inode number
-    uint32_t i_size;                    // File size in bytes
+    struct osfs_extent *i_extents;      // Spilled extent array, NULL while i_inline_extents suffices
+    uint64_t i_size;                    // File size in bytes
     uint32_t i_blocks;                  // Number of blocks occupied by the file
+    uint32_t i_nr_extents;              // Number of extents, sorted by e_lblk
+    uint32_t i_extent_cap;              // Capacity of i_extents once spilled
+    uint32_t i_pa_start;                // First block of the preallocation window
+    uint32_t i_pa_len;                  // Blocks reserved in the window, not yet in the file
     uint16_t i_mode;                    // File mode (permissions and type)
     uint16_t i_links_count;             // Number of hard links
-    uint32_t i_uid;                     // User ID of owner
-    uint32_t i_gid;                     // Group ID of owner
+    struct osfs_extent i_inline_extents[OSFS_INLINE_EXTENTS]; // First extents of small files
+} ____cacheline_aligned;
+
+static_assert(offsetofend(struct osfs_inode, i_inline_extents) <= 64,
+              "the hot inode fields must fit one 64-byte cache line");
+
+/**
+ * Struct: osfs_inode_meta
+ * Description: Cold half of an on-media inode, only read when an inode is
+ *              brought in core or created. Kept in the array following the
+ *              inode table, at the same index; 64 bytes, no holes.
+ */
+struct osfs_inode_meta {
     struct timespec64 __i_atime;        // Last access time
     struct timespec64 __i_mtime;        // Last modification time
     struct timespec64 __i_ctime;        // Creation time
-    // uint32_t i_block;                   // Simplified handling, single data block pointer
-    uint32_t i_block;                   // Simplified handling, single data block pointer for dir
-    uint32_t *i_blocks_ptr;             // MODED
-    int32_t *i_blocks_length;
+    uint32_t i_ino;                     // Inode number
+    uint32_t i_uid;                     // User ID of owner
+    uint32_t i_gid;                     // Group ID of owner
+    uint32_t i_reserved;                // Zero; makes the padding of the tail explicit
 };
 
+static_assert(sizeof(struct osfs_inode_meta) == 64,
+              "the cold inode fields are stored as 64-byte records");
+
+// Memory an inode takes in the tables allocated at mount
+#define OSFS_INODE_BYTES (sizeof(struct osfs_inode) + sizeof(struct osfs_inode_meta))
+
+/**
+ * Function: osfs_extent_array
+ * Description: Returns the extents of a file or directory, wherever they live.
+ */
+static inline struct osfs_extent *osfs_extent_array(struct osfs_inode *osfs_inode)
+{
+    return osfs_inode->i_extents ? osfs_inode->i_extents : osfs_inode->i_inline_extents;
+}
+
+// File block after the last one mapped; files may have holes before it
+static inline uint32_t osfs_extent_end(struct osfs_inode *osfs_inode)
+{
+    struct osfs_extent *last;
+
+    if (!osfs_inode->i_nr_extents)
+        return 0;
+    last = &osfs_extent_array(osfs_inode)[osfs_inode->i_nr_extents - 1];
+    return last->e_lblk + last->e_len;
+}
+
+/**
+ * Function: osfs_inode_inline
+ * Description: Tells whether a file keeps its data inline: a regular file
+ *              without data blocks, no larger than OSFS_INLINE_DATA_MAX. Its
+ *              contents are in sb_info->inline_data, absent while all zeros.
+ */
+static inline bool osfs_inode_inline(const struct osfs_inode *osfs_inode)
+{
+    return S_ISREG(osfs_inode->i_mode) && !osfs_inode->i_blocks &&
+           osfs_inode->i_size <= OSFS_INLINE_DATA_MAX;
+}
+
+// Inode number of an entry of the inode table
+static inline uint32_t osfs_ino(const struct osfs_sb_info *sb_info, const struct osfs_inode *osfs_inode)
+{
+    return osfs_inode - sb_info->inode_table;
+}
+
+/**
+ * Struct: osfs_inode_info
+ * Description: In-core inode, allocated from osfs_inode_cachep around the VFS
+ *              inode. i_private of the VFS inode points at its osfs_inode.
+ */
+struct osfs_inode_info {
+    struct rw_semaphore i_extent_sem;   // Protects the extents, the window and i_blocks
+    struct osfs_dir_index *i_dir_index; // In-memory name index of a directory (dir.c)
+    loff_t i_disksize;                  // File size backed by data in the block store, under i_lock
+    struct inode vfs_inode;
+};
+
+static inline struct osfs_inode_info *OSFS_I(struct inode *inode)
+{
+    return container_of(inode, struct osfs_inode_info, vfs_inode);
+}
+
 
 
 
 struct inode *osfs_iget(struct super_block *sb, unsigned long ino);
 struct osfs_inode *osfs_get_osfs_inode(struct super_block *sb, uint32_t ino);
+struct osfs_inode_meta *osfs_get_inode_meta(struct super_block *sb, uint32_t ino);
 int osfs_get_free_inode(struct osfs_sb_info *sb_info);
+void osfs_put_free_inode(struct osfs_sb_info *sb_info, uint32_t ino);
 int osfs_alloc_data_block(struct osfs_sb_info *sb_info, uint32_t *block_no);
-int osfs_fill_super(struct super_block *sb, void *data, int silent);
+int osfs_fill_super(struct super_block *sb, struct fs_context *fc);
+int osfs_setup_super(struct super_block *sb, uint32_t block_size, uint32_t inode_count,
+                     uint32_t block_count, enum osfs_numa numa);
+int osfs_make_root(struct super_block *sb);
 struct inode *osfs_new_inode(const struct inode *dir, umode_t mode);
 void osfs_free_data_block(struct osfs_sb_info *sb_info, uint32_t block_no);
-void osfs_destroy_inode(struct inode *inode);
+void osfs_evict_inode(struct inode *inode);
+int osfs_init_inodecache(void);
+void osfs_destroy_inodecache(void);
+
+int osfs_alloc_data_run(struct osfs_sb_info *sb_info, uint32_t goal, uint32_t count,
+                        uint32_t *block_no, uint32_t *allocated);
+void osfs_free_data_run(struct osfs_sb_info *sb_info, uint32_t start, uint32_t len);
+int osfs_share_data_run(struct osfs_sb_info *sb_info, uint32_t start, uint32_t len);
+bool osfs_block_shared(struct osfs_sb_info *sb_info, uint32_t block_no);
+void osfs_update_block_summary(struct osfs_sb_info *sb_info, uint32_t start, uint32_t len);
+
+// Directory index (dir.c)
+void osfs_dir_index_free(struct inode *dir);
+
+// Data block store (data.c)
+void *osfs_block_addr(struct osfs_sb_info *sb_info, uint32_t block_no);
+void *osfs_block_prepare(struct osfs_sb_info *sb_info, uint32_t block_no, gfp_t gfp);
+int osfs_read_blocks(struct osfs_sb_info *sb_info, uint32_t block_no, void *dst, size_t len);
+void osfs_block_release(struct osfs_sb_info *sb_info, uint32_t block_no);
+void osfs_block_dirty(struct osfs_sb_info *sb_info, uint32_t block_no);
+int osfs_flush_data_pages(struct osfs_sb_info *sb_info);
+void osfs_destroy_data_pages(struct osfs_sb_info *sb_info);
+int osfs_numa_init(struct osfs_sb_info *sb_info, enum osfs_numa numa);
+int osfs_numa_local(struct osfs_sb_info *sb_info);
 
-// MODED
-int osfs_alloc_multiple_data_blocks(struct osfs_sb_info *sb_info, uint32_t *block_nos, int32_t *block_length, int block_needed);
-int osfs_realloc_multiple_data_blocks(struct osfs_sb_info *sb_info, uint32_t *block_nos, int32_t *block_length, int block_needed);
+/**
+ * Function: osfs_numa_home
+ * Description: Tells which entry of numa_nodes is home to the allocation group
+ *              of a block. Groups are homed on the nodes in turn.
+ * Inputs:
+ *   - sb_info: The superblock information, with numa_nodes set up.
+ *   - block_no: The data block number.
+ * Returns:
+ *   - The index of the node in numa_nodes.
+ */
+static inline unsigned int osfs_numa_home(struct osfs_sb_info *sb_info, uint32_t block_no)
+{
+    return (block_no >> sb_info->numa_group_bits) % sb_info->numa_nr_nodes;
+}
+
+// Extent map (extent.c)
+int osfs_extent_lookup(struct osfs_inode *osfs_inode, uint32_t lblk,
+                       struct osfs_extent_cursor *cursor, uint32_t *pblk, uint32_t *count);
+int osfs_extent_append(struct osfs_inode *osfs_inode, uint32_t lblk, uint32_t pblk, uint32_t len);
+int osfs_extent_reserve(struct osfs_sb_info *sb_info, struct osfs_inode *osfs_inode,
+                        uint32_t lblk, uint32_t end);
+int osfs_extent_free_range(struct osfs_sb_info *sb_info, struct osfs_inode *osfs_inode,
+                           uint32_t start, uint32_t end);
+void osfs_extent_discard_prealloc(struct osfs_sb_info *sb_info, struct osfs_inode *osfs_inode);
+bool osfs_reclaim_prealloc(struct super_block *sb, struct inode *self);
+void osfs_extent_free_all(struct osfs_sb_info *sb_info, struct osfs_inode *osfs_inode);
+void osfs_extent_release_array(struct osfs_inode *osfs_inode);
+int osfs_extent_alloc_array(struct osfs_inode *osfs_inode, uint32_t nr);
+int osfs_extent_remap_block(struct osfs_inode *osfs_inode, uint32_t lblk, uint32_t pblk);
+int osfs_extent_unshare(struct osfs_sb_info *sb_info, struct osfs_inode *osfs_inode,
+                        uint32_t lblk);
+void *osfs_inline_get(struct osfs_sb_info *sb_info, uint32_t ino);
+void *osfs_inline_prepare(struct osfs_sb_info *sb_info, uint32_t ino, gfp_t gfp);
+void osfs_inline_release(struct osfs_sb_info *sb_info, uint32_t ino);
+int osfs_inline_spill(struct osfs_sb_info *sb_info, struct osfs_inode *osfs_inode);
+void osfs_inline_destroy(struct osfs_sb_info *sb_info);
+int osfs_init_extent_cache(void);
+void osfs_destroy_extent_cache(void);
+
+// Image mode (image.c)
+int osfs_image_fill_super(struct super_block *sb, struct fs_context *fc);
+int osfs_image_sync(struct super_block *sb, uint32_t state);
+int osfs_image_checkpoint(struct super_block *sb, uint32_t state);
+int osfs_image_io(struct super_block *sb, struct file *file, uint64_t block, void *buf,
+                  size_t len, bool write);
+struct inode *osfs_image_pin_inode(struct super_block *sb, uint32_t ino);
+void osfs_image_unpin_inode(struct inode *inode);
+bool osfs_image_copy_inode(const struct osfs_inode *osfs_inode, struct inode *inode,
+                           struct osfs_inode *copy);
+int osfs_image_snapshot(struct super_block *sb, struct file *file);
+int osfs_image_restore(struct super_block *sb, struct fs_context *fc);
+int osfs_fsync(struct file *file, loff_t start, loff_t end, int datasync);
+int osfs_getattr(struct mnt_idmap *idmap, const struct path *path, struct kstat *stat,
+                 u32 request_mask, unsigned int query_flags);
+long osfs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+
+// Metadata journal (journal.c)
+int osfs_journal_init(struct super_block *sb, uint64_t seq);
+void osfs_journal_destroy(struct osfs_sb_info *sb_info);
+void osfs_journal_cancel(struct osfs_sb_info *sb_info);
+void osfs_journal_start(struct osfs_sb_info *sb_info);
+void osfs_journal_stop(struct osfs_sb_info *sb_info);
+void osfs_journal_inode(struct osfs_sb_info *sb_info, uint32_t ino);
+void osfs_journal_block(struct osfs_sb_info *sb_info, uint32_t block_no);
+int osfs_journal_commit(struct osfs_sb_info *sb_info);
+int osfs_journal_replay(struct super_block *sb, bool blocks);
+void osfs_journal_lock(struct osfs_sb_info *sb_info);
+void osfs_journal_unlock(struct osfs_sb_info *sb_info, bool checkpointed);
+uint64_t osfs_journal_seq(struct osfs_sb_info *sb_info);
+uint64_t osfs_journal_blocks(uint32_t block_count);
+
+// Statistics and tracing (stats.c)
+int osfs_stats_init(struct super_block *sb);
+void osfs_stats_destroy(struct osfs_sb_info *sb_info);
+void osfs_stat_end(struct osfs_sb_info *sb_info, enum osfs_stat_op op, u64 start);
+void osfs_stat_alloc(struct osfs_sb_info *sb_info, enum osfs_alloc_result result,
+                     unsigned int runs, uint32_t wanted, uint32_t got);
+void osfs_init_debugfs(void);
+void osfs_exit_debugfs(void);
+
+/**
+ * Function: osfs_stat_start
+ * Description: Timestamp to pass to osfs_stat_end() when the operation is done.
+ * Inputs:
+ *   - None.
+ * Returns:
+ *   - The current monotonic time in nanoseconds.
+ */
+static inline u64 osfs_stat_start(void)
+{
+    return ktime_get_ns();
+}
 
 // External Operations Structures
 
 extern const struct inode_operations osfs_file_inode_operations;
 extern const struct file_operations osfs_file_operations;
+extern const struct address_space_operations osfs_aops;
 extern const struct inode_operations osfs_dir_inode_operations;
 extern const struct file_operations osfs_dir_operations;
 extern const struct super_operations osfs_super_ops;
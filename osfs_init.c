@@ -1,22 +1,23 @@
 #include <linux/init.h>
 #include <linux/module.h>
+#include <linux/blkdev.h>
+#include <linux/fs_context.h>
+#include <linux/fs_parser.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
 #include "osfs.h"
 
 /**
- * Function: osfs_mount
- * Description: Mounts the osfs filesystem.
+ * Function: osfs_init_fs_context
+ * Description: Sets up the filesystem context used to parse mount options.
  * Inputs:
- *   - fs_type: The file system type structure.
- *   - flags: Mount flags.
- *   - dev_name: Device name (not used in nodev filesystem).
- *   - data: Data passed during mount.
+ *   - fc: The filesystem context being created.
  * Returns:
- *   - A dentry pointer to the root of the mounted filesystem.
+ *   - 0 on success.
+ *   - -ENOMEM if the option storage cannot be allocated.
  */
-static struct dentry *osfs_mount(struct file_system_type *fs_type,
-                                 int flags,
-                                 const char *dev_name,
-                                 void *data);
+static int osfs_init_fs_context(struct fs_context *fc);
 
 /**
  * Function: osfs_kill_superblock
@@ -28,6 +29,51 @@ static struct dentry *osfs_mount(struct file_system_type *fs_type,
  */
 static void osfs_kill_superblock(struct super_block *sb);
 
+enum osfs_param {
+    Opt_size,
+    Opt_nr_inodes,
+    Opt_block_size,
+    Opt_format,
+    Opt_restore,
+    Opt_numa,
+};
+
+static const struct constant_table osfs_param_numa[] = {
+    {"off", OSFS_NUMA_OFF},
+    {"interleave", OSFS_NUMA_INTERLEAVE},
+    {"local", OSFS_NUMA_LOCAL},
+    {}
+};
+
+/**
+ * Struct: osfs_fs_parameters
+ * Description: Mount options understood by osfs.
+ *   - size=<bytes>[k|m|g]: Capacity of the data area, at most the RAM size.
+ *   - nr_inodes=<n>: Number of inodes, whose table may take at most
+ *             1/OSFS_INODE_RAM_FRACTION of RAM.
+ *   - block_size=<bytes>: Data block size, a power of two up to PAGE_SIZE.
+ *   - format: Create a new image on the block device given as the source,
+ *             taking the geometry from the options above. Without it an
+ *             existing image is mounted and the geometry options are ignored.
+ *   - restore=<path>: Fill a memory mode mount from a snapshot taken with
+ *             OSFS_IOC_SNAPSHOT; the geometry comes from the snapshot.
+ *   - numa=off|interleave|local: Where data pages go on NUMA machines: by
+ *             the writer's memory policy (default), spread across the nodes
+ *             page by page, or on the writer's node, the block allocator
+ *             giving each node its own allocation groups. Either of the last
+ *             two also keeps the inode table on the mounting task's node.
+ *             Ignored on machines with a single node.
+ */
+static const struct fs_parameter_spec osfs_fs_parameters[] = {
+    fsparam_string("size", Opt_size),
+    fsparam_u32("nr_inodes", Opt_nr_inodes),
+    fsparam_u32("block_size", Opt_block_size),
+    fsparam_flag("format", Opt_format),
+    fsparam_string("restore", Opt_restore),
+    fsparam_enum("numa", Opt_numa, osfs_param_numa),
+    {}
+};
+
 /**
  * Struct: osfs_type
  * Description: Defines the file system type for osfs.
@@ -35,14 +81,16 @@ static void osfs_kill_superblock(struct super_block *sb);
 struct file_system_type osfs_type = {
     .owner = THIS_MODULE,
     .name = "osfs",
-    .mount = osfs_mount,
+    .init_fs_context = osfs_init_fs_context,
+    .parameters = osfs_fs_parameters,
     .kill_sb = osfs_kill_superblock,
     .fs_flags = FS_USERNS_MOUNT,
 };
 
 /**
  * Function: osfs_init
- * Description: Initializes the osfs module by registering the filesystem.
+ * Description: Initializes the osfs module by creating the inode and extent
+ *              caches and the debugfs directory, and registering the filesystem.
  * Inputs:
  *   - None.
  * Returns:
@@ -53,9 +101,27 @@ static int __init osfs_init(void)
 {
     int ret;
 
+    ret = osfs_init_inodecache();
+    if (ret) {
+        pr_err("Failed to create inode cache\n");
+        return ret;
+    }
+
+    ret = osfs_init_extent_cache();
+    if (ret) {
+        pr_err("Failed to create extent cache\n");
+        osfs_destroy_inodecache();
+        return ret;
+    }
+
+    osfs_init_debugfs();
+
     ret = register_filesystem(&osfs_type);
     if (ret) {
         pr_err("Failed to register filesystem\n");
+        osfs_exit_debugfs();
+        osfs_destroy_extent_cache();
+        osfs_destroy_inodecache();
         return ret;
     }
 
@@ -65,7 +131,8 @@ static int __init osfs_init(void)
 
 /**
  * Function: osfs_exit
- * Description: Cleans up the osfs module by unregistering the filesystem.
+ * Description: Cleans up the osfs module by unregistering the filesystem and
+ *              destroying the caches.
  * Inputs:
  *   - None.
  * Returns:
@@ -80,25 +147,150 @@ static void __exit osfs_exit(void)
         pr_err("Failed to unregister filesystem\n");
     else
         pr_info("osfs: Successfully unregistered\n");
+    osfs_exit_debugfs();
+    osfs_destroy_extent_cache();
+    osfs_destroy_inodecache();
+}
+
+/**
+ * Function: osfs_parse_param
+ * Description: Parses a single mount option into the filesystem context.
+ *              Geometries the memory of the machine cannot hold are refused
+ *              here, before anything is allocated for them.
+ * Inputs:
+ *   - fc: The filesystem context.
+ *   - param: The option to parse.
+ * Returns:
+ *   - 0 on success.
+ *   - -EINVAL if the value is out of range.
+ *   - A negative error code from fs_parse on failure.
+ */
+static int osfs_parse_param(struct fs_context *fc, struct fs_parameter *param)
+{
+    struct osfs_fs_context *ctx = fc->fs_private;
+    unsigned long long ram = (unsigned long long)totalram_pages() << PAGE_SHIFT;
+    struct fs_parse_result result;
+    char *rest;
+    int opt;
+
+    opt = fs_parse(fc, osfs_fs_parameters, param, &result);
+    if (opt < 0)
+        return opt;
+
+    switch (opt) {
+    case Opt_size:
+        ctx->size = memparse(param->string, &rest);
+        if (*rest || !ctx->size)
+            return invalfc(fc, "Bad value '%s' for size", param->string);
+        // Data pages cannot be reclaimed, and the bitmaps grow with the size
+        if (ctx->size > ram)
+            return invalfc(fc, "size must not exceed the %llu bytes of RAM", ram);
+        break;
+    case Opt_nr_inodes:
+        // Inode 0 is reserved and inode 1 is the root directory
+        if (result.uint_32 < 2)
+            return invalfc(fc, "nr_inodes must be at least 2");
+        // The inode table is allocated in full at mount
+        if ((uint64_t)result.uint_32 * OSFS_INODE_BYTES > ram / OSFS_INODE_RAM_FRACTION)
+            return invalfc(fc, "nr_inodes must not take more than 1/%d of RAM",
+                           OSFS_INODE_RAM_FRACTION);
+        ctx->nr_inodes = result.uint_32;
+        break;
+    case Opt_block_size:
+        if (!is_power_of_2(result.uint_32) || result.uint_32 < OSFS_MIN_BLOCK_SIZE ||
+            result.uint_32 > PAGE_SIZE)
+            return invalfc(fc, "block_size must be a power of two between %d and %lu",
+                           OSFS_MIN_BLOCK_SIZE, PAGE_SIZE);
+        ctx->block_size = result.uint_32;
+        break;
+    case Opt_format:
+        ctx->format = true;
+        break;
+    case Opt_restore:
+        kfree(ctx->restore);
+        ctx->restore = param->string;
+        param->string = NULL;
+        break;
+    case Opt_numa:
+        ctx->numa = result.uint_32;
+        break;
+    }
+    return 0;
 }
 
 /**
- * Function: osfs_mount
- * Description: Handles the mounting of the osfs filesystem.
+ * Function: osfs_get_tree
+ * Description: Creates the superblock of a new osfs instance. A source naming
+ *              a block device mounts the image on it; any other source (the
+ *              Makefile passes "None") creates an empty memory-only instance.
  * Inputs:
- *   - fs_type: The file system type structure.
- *   - flags: Mount flags.
- *   - dev_name: Device name (not used in nodev filesystem).
- *   - data: Data passed during mount.
+ *   - fc: The filesystem context.
  * Returns:
- *   - A dentry pointer to the root of the mounted filesystem.
+ *   - 0 on success.
+ *   - -EPERM if an image is mounted outside the initial user namespace.
+ *   - A negative error code on failure.
+ */
+static int osfs_get_tree(struct fs_context *fc)
+{
+    dev_t dev;
+
+    if (fc->source && !lookup_bdev(fc->source, &dev)) {
+        // Images are parsed without any validation beyond the superblock
+        if (fc->user_ns != &init_user_ns) {
+            errorfc(fc, "images can only be mounted from the initial user namespace");
+            return -EPERM;
+        }
+        return get_tree_bdev(fc, osfs_image_fill_super);
+    }
+    return get_tree_nodev(fc, osfs_fill_super);
+}
+
+/**
+ * Function: osfs_free_fc
+ * Description: Releases the mount options stored in a filesystem context.
+ * Inputs:
+ *   - fc: The filesystem context.
+ * Returns:
+ *   - None.
+ */
+static void osfs_free_fc(struct fs_context *fc)
+{
+    struct osfs_fs_context *ctx = fc->fs_private;
+
+    if (ctx)
+        kfree(ctx->restore);
+    kfree(ctx);
+}
+
+static const struct fs_context_operations osfs_context_ops = {
+    .parse_param = osfs_parse_param,
+    .get_tree = osfs_get_tree,
+    .free = osfs_free_fc,
+};
+
+/**
+ * Function: osfs_init_fs_context
+ * Description: Sets up the filesystem context with the default geometry.
+ * Inputs:
+ *   - fc: The filesystem context being created.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if the option storage cannot be allocated.
  */
-static struct dentry *osfs_mount(struct file_system_type *fs_type,
-                                 int flags,
-                                 const char *dev_name,
-                                 void *data)
+static int osfs_init_fs_context(struct fs_context *fc)
 {
-    return mount_nodev(fs_type, flags, data, osfs_fill_super);
+    struct osfs_fs_context *ctx;
+
+    ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+    if (!ctx)
+        return -ENOMEM;
+
+    ctx->nr_inodes = OSFS_DEFAULT_INODE_COUNT;
+    ctx->block_size = BLOCK_SIZE;
+
+    fc->fs_private = ctx;
+    fc->ops = &osfs_context_ops;
+    return 0;
 }
 
 /**
@@ -112,17 +304,32 @@ static struct dentry *osfs_mount(struct file_system_type *fs_type,
 static void osfs_kill_superblock(struct super_block *sb)
 {
     struct osfs_sb_info *sb_info = sb->s_fs_info;
+    unsigned long ino;
 
-    pr_info("osfs_kill_superblock: Unmounting file system\n");
+    // Write back and evict every inode while the data area is still around;
+    // in image mode put_super writes the image back before the device goes
+    if (sb->s_bdev)
+        kill_block_super(sb);
+    else
+        kill_anon_super(sb);
 
     if (sb_info) {
-        pr_info("osfs_kill_superblock: free blcok \n");
-
-        vfree(sb_info);
+        osfs_stats_destroy(sb_info);
+        osfs_journal_destroy(sb_info);
+        // Extent arrays outlive the in-core inodes; the data blocks go with the pages
+        for_each_set_bit(ino, sb_info->inode_bitmap, sb_info->inode_count)
+            osfs_extent_release_array(osfs_get_osfs_inode(sb, ino));
+        osfs_destroy_data_pages(sb_info);
+        osfs_inline_destroy(sb_info);
+        bitmap_free(sb_info->image_valid);
+        kvfree(sb_info->block_refs);
+        kfree(sb_info->numa_nodes);
+        percpu_counter_destroy(&sb_info->nr_prealloc_blocks);
+        percpu_counter_destroy(&sb_info->nr_free_blocks);
+        percpu_counter_destroy(&sb_info->nr_free_inodes);
+        kvfree(sb_info);
         sb->s_fs_info = NULL;
     }
-
-    pr_info("osfs_kill_superblock: File system unmounted successfully\n");
 }
 
 module_init(osfs_init);
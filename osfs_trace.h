@@ -0,0 +1,129 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM osfs
+
+#if !defined(_OSFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _OSFS_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * Static tracepoints of osfs, under events/osfs/ in tracefs. They cost a
+ * patched-out branch while disabled; the instances are created in stats.c.
+ */
+
+TRACE_EVENT(osfs_lookup,
+    TP_PROTO(struct inode *dir, struct dentry *dentry, unsigned long ino),
+    TP_ARGS(dir, dentry, ino),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, dir)
+        __field(unsigned long, ino)     // 0 if the name does not exist
+        __string(name, dentry->d_name.name)
+    ),
+    TP_fast_assign(
+        __entry->dev = dir->i_sb->s_dev;
+        __entry->dir = dir->i_ino;
+        __entry->ino = ino;
+        __assign_str(name, dentry->d_name.name);
+    ),
+    TP_printk("dev %d:%d dir %lu name %s ino %lu",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir, __get_str(name),
+              __entry->ino)
+);
+
+TRACE_EVENT(osfs_create,
+    TP_PROTO(struct inode *dir, struct dentry *dentry, struct inode *inode),
+    TP_ARGS(dir, dentry, inode),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, dir)
+        __field(unsigned long, ino)
+        __field(umode_t, mode)
+        __string(name, dentry->d_name.name)
+    ),
+    TP_fast_assign(
+        __entry->dev = dir->i_sb->s_dev;
+        __entry->dir = dir->i_ino;
+        __entry->ino = inode->i_ino;
+        __entry->mode = inode->i_mode;
+        __assign_str(name, dentry->d_name.name);
+    ),
+    TP_printk("dev %d:%d dir %lu name %s ino %lu mode 0%o",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir, __get_str(name),
+              __entry->ino, __entry->mode)
+);
+
+DECLARE_EVENT_CLASS(osfs_rw_class,
+    TP_PROTO(struct inode *inode, loff_t pos, size_t count, ssize_t ret),
+    TP_ARGS(inode, pos, count, ret),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, ino)
+        __field(loff_t, pos)
+        __field(size_t, count)
+        __field(ssize_t, ret)           // Bytes transferred or negative error code
+    ),
+    TP_fast_assign(
+        __entry->dev = inode->i_sb->s_dev;
+        __entry->ino = inode->i_ino;
+        __entry->pos = pos;
+        __entry->count = count;
+        __entry->ret = ret;
+    ),
+    TP_printk("dev %d:%d ino %lu pos %lld count %zu ret %zd",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino, __entry->pos,
+              __entry->count, __entry->ret)
+);
+
+DEFINE_EVENT(osfs_rw_class, osfs_read,
+    TP_PROTO(struct inode *inode, loff_t pos, size_t count, ssize_t ret),
+    TP_ARGS(inode, pos, count, ret)
+);
+
+DEFINE_EVENT(osfs_rw_class, osfs_write,
+    TP_PROTO(struct inode *inode, loff_t pos, size_t count, ssize_t ret),
+    TP_ARGS(inode, pos, count, ret)
+);
+
+TRACE_EVENT(osfs_alloc,
+    TP_PROTO(uint32_t goal, uint32_t count, uint32_t block, uint32_t allocated),
+    TP_ARGS(goal, count, block, allocated),
+    TP_STRUCT__entry(
+        __field(uint32_t, goal)
+        __field(uint32_t, count)
+        __field(uint32_t, block)
+        __field(uint32_t, allocated)
+    ),
+    TP_fast_assign(
+        __entry->goal = goal;
+        __entry->count = count;
+        __entry->block = block;
+        __entry->allocated = allocated;
+    ),
+    TP_printk("goal %d count %u block %u allocated %u",
+              (int)__entry->goal, __entry->count, __entry->block, __entry->allocated)
+);
+
+TRACE_EVENT(osfs_free,
+    TP_PROTO(uint32_t start, uint32_t len, uint32_t freed),
+    TP_ARGS(start, len, freed),
+    TP_STRUCT__entry(
+        __field(uint32_t, start)
+        __field(uint32_t, len)
+        __field(uint32_t, freed)        // Blocks no clone still shared
+    ),
+    TP_fast_assign(
+        __entry->start = start;
+        __entry->len = len;
+        __entry->freed = freed;
+    ),
+    TP_printk("start %u len %u freed %u", __entry->start, __entry->len, __entry->freed)
+);
+
+#endif /* _OSFS_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE osfs_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,388 @@
+#include <linux/debugfs.h>
+#include <linux/fs.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+#include "osfs.h"
+
+#define CREATE_TRACE_POINTS
+#include "osfs_trace.h"
+
+/*
+ * Per-mount operation statistics, in debugfs as osfs/<major>:<minor>/stats.
+ * Each operation has a count, a total latency and a log2 histogram of its
+ * latencies: bucket b counts the calls that took [2^b, 2^(b+1)) nanoseconds,
+ * the last one everything slower. Counters are per CPU, so recording is a few
+ * local increments; reading sums them up. Writing anything to the file resets
+ * them.
+ *
+ * Next to it, frag describes the fragmentation of the mount: the free runs of
+ * the block bitmap and the extents of the files, both scanned at read time,
+ * and how the allocator found its runs, counted as it goes.
+ */
+
+static struct dentry *osfs_debugfs_root;
+
+static const char *const osfs_stat_names[OSFS_NR_STAT_OPS] = {
+    [OSFS_STAT_LOOKUP] = "lookup",
+    [OSFS_STAT_CREATE] = "create",
+    [OSFS_STAT_MKDIR] = "mkdir",
+    [OSFS_STAT_UNLINK] = "unlink",
+    [OSFS_STAT_LINK] = "link",
+    [OSFS_STAT_RENAME] = "rename",
+    [OSFS_STAT_READ] = "read",
+    [OSFS_STAT_WRITE] = "write",
+    [OSFS_STAT_FSYNC] = "fsync",
+    [OSFS_STAT_ALLOC] = "alloc",
+    [OSFS_STAT_FREE] = "free",
+};
+
+/**
+ * Struct: osfs_op_stats
+ * Description: Counters of one operation on one CPU.
+ */
+struct osfs_op_stats {
+    u64 count;                          // Calls
+    u64 total_ns;                       // Sum of their latencies
+    u64 hist[OSFS_STAT_BUCKETS];        // Calls per log2 latency bucket
+};
+
+struct osfs_stats {
+    struct osfs_op_stats ops[OSFS_NR_STAT_OPS];
+    u64 alloc[OSFS_NR_ALLOC_RESULTS];   // Allocations by how the run was found
+    u64 alloc_wanted;                   // Blocks asked for
+    u64 alloc_got;                      // Blocks handed out
+    u64 alloc_runs[OSFS_ALLOC_SCAN_RUNS + 1]; // Allocations by free runs examined
+};
+
+static const char *const osfs_alloc_names[OSFS_NR_ALLOC_RESULTS] = {
+    [OSFS_ALLOC_GOAL] = "goal",
+    [OSFS_ALLOC_FIT] = "fit",
+    [OSFS_ALLOC_LONGEST] = "longest",
+    [OSFS_ALLOC_NOSPC] = "nospc",
+};
+
+/**
+ * Function: osfs_stat_end
+ * Description: Records one call of an operation, started at start.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - op: The operation.
+ *   - start: osfs_stat_start() taken when the call began.
+ * Returns:
+ *   - None.
+ */
+void osfs_stat_end(struct osfs_sb_info *sb_info, enum osfs_stat_op op, u64 start)
+{
+    u64 ns = ktime_get_ns() - start;
+    unsigned int bucket = ns ? min_t(unsigned int, ilog2(ns), OSFS_STAT_BUCKETS - 1) : 0;
+
+    this_cpu_inc(sb_info->stats->ops[op].count);
+    this_cpu_add(sb_info->stats->ops[op].total_ns, ns);
+    this_cpu_inc(sb_info->stats->ops[op].hist[bucket]);
+}
+
+/**
+ * Function: osfs_stat_alloc
+ * Description: Records how an allocation went.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ *   - result: How the run was found.
+ *   - runs: The number of free runs the search examined, 0 for a goal hit.
+ *   - wanted: The number of blocks asked for.
+ *   - got: The number of blocks allocated.
+ * Returns:
+ *   - None.
+ */
+void osfs_stat_alloc(struct osfs_sb_info *sb_info, enum osfs_alloc_result result,
+                     unsigned int runs, uint32_t wanted, uint32_t got)
+{
+    this_cpu_inc(sb_info->stats->alloc[result]);
+    this_cpu_add(sb_info->stats->alloc_wanted, wanted);
+    this_cpu_add(sb_info->stats->alloc_got, got);
+    this_cpu_inc(sb_info->stats->alloc_runs[min_t(unsigned int, runs, OSFS_ALLOC_SCAN_RUNS)]);
+}
+
+/**
+ * Function: osfs_stats_show
+ * Description: Prints the statistics of a mount, one line per operation that
+ *              was called, then one line per non-empty histogram bucket with
+ *              the lower bound of the bucket in nanoseconds and its count.
+ * Inputs:
+ *   - m: The seq_file.
+ *   - v: Unused.
+ * Returns:
+ *   - 0.
+ */
+static int osfs_stats_show(struct seq_file *m, void *v)
+{
+    struct osfs_sb_info *sb_info = m->private;
+    struct osfs_op_stats sum, *s;
+    unsigned int op, b;
+    int cpu;
+
+    for (op = 0; op < OSFS_NR_STAT_OPS; op++) {
+        memset(&sum, 0, sizeof(sum));
+        for_each_possible_cpu(cpu) {
+            s = &per_cpu_ptr(sb_info->stats, cpu)->ops[op];
+            sum.count += READ_ONCE(s->count);
+            sum.total_ns += READ_ONCE(s->total_ns);
+            for (b = 0; b < OSFS_STAT_BUCKETS; b++)
+                sum.hist[b] += READ_ONCE(s->hist[b]);
+        }
+        if (!sum.count)
+            continue;
+
+        seq_printf(m, "%s count %llu total_ns %llu avg_ns %llu\n", osfs_stat_names[op],
+                   sum.count, sum.total_ns, div64_u64(sum.total_ns, sum.count));
+        for (b = 0; b < OSFS_STAT_BUCKETS; b++) {
+            if (sum.hist[b])
+                seq_printf(m, "  %llu %llu\n", b ? 1ULL << b : 0, sum.hist[b]);
+        }
+    }
+    return 0;
+}
+
+static int osfs_stats_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, osfs_stats_show, inode->i_private);
+}
+
+/**
+ * Function: osfs_stats_write
+ * Description: Resets the statistics of a mount, whatever is written. Calls
+ *              in flight may still be recorded in part.
+ * Inputs:
+ *   - file: The stats file.
+ *   - buf: Ignored.
+ *   - count: The number of bytes written.
+ *   - ppos: Ignored.
+ * Returns:
+ *   - count.
+ */
+static ssize_t osfs_stats_write(struct file *file, const char __user *buf, size_t count,
+                                loff_t *ppos)
+{
+    struct osfs_sb_info *sb_info = ((struct seq_file *)file->private_data)->private;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+        memset(per_cpu_ptr(sb_info->stats, cpu), 0, sizeof(struct osfs_stats));
+    return count;
+}
+
+static const struct file_operations osfs_stats_fops = {
+    .owner = THIS_MODULE,
+    .open = osfs_stats_open,
+    .read = seq_read,
+    .write = osfs_stats_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+/**
+ * Function: osfs_frag_show_free
+ * Description: Prints the free space of a mount as runs of free blocks: their
+ *              number, the longest, and a histogram by log2 of the run length
+ *              with the lower bound of each bucket, the runs in it and their
+ *              blocks. The bitmap is read without alloc_lock, so concurrent
+ *              allocations may make the picture slightly inconsistent.
+ * Inputs:
+ *   - m: The seq_file.
+ *   - sb_info: The superblock information of the filesystem.
+ * Returns:
+ *   - None.
+ */
+static void osfs_frag_show_free(struct seq_file *m, struct osfs_sb_info *sb_info)
+{
+    u64 runs[32] = {0}, blocks[32] = {0}, nr_runs = 0, nr_free = 0;
+    unsigned long start, end = 0, largest = 0;
+    unsigned int b;
+
+    while ((start = find_next_zero_bit(sb_info->block_bitmap, sb_info->block_count, end)) <
+           sb_info->block_count) {
+        end = find_next_bit(sb_info->block_bitmap, sb_info->block_count, start);
+        b = ilog2(end - start);
+        runs[b]++;
+        blocks[b] += end - start;
+        nr_runs++;
+        nr_free += end - start;
+        largest = max(largest, end - start);
+        cond_resched();
+    }
+
+    seq_printf(m, "free blocks %llu of %u runs %llu largest %lu\n", nr_free,
+               sb_info->block_count, nr_runs, largest);
+    for (b = 0; b < 32; b++) {
+        if (runs[b])
+            seq_printf(m, "  %llu %llu %llu\n", 1ULL << b, runs[b], blocks[b]);
+    }
+}
+
+/**
+ * Function: osfs_frag_show_files
+ * Description: Prints how fragmented the files of a mount are: the number of
+ *              inodes owning blocks, their extents, the average and largest
+ *              number of extents per inode, and a histogram by log2 of the
+ *              number of extents. Inodes are read without their locks.
+ * Inputs:
+ *   - m: The seq_file.
+ *   - sb_info: The superblock information of the filesystem.
+ * Returns:
+ *   - None.
+ */
+static void osfs_frag_show_files(struct seq_file *m, struct osfs_sb_info *sb_info)
+{
+    u64 files[32] = {0}, nr_files = 0, nr_extents = 0, nr_blocks = 0, avg;
+    uint32_t extents, largest = 0;
+    unsigned long ino;
+    unsigned int b;
+
+    for_each_set_bit(ino, sb_info->inode_bitmap, sb_info->inode_count) {
+        extents = READ_ONCE(sb_info->inode_table[ino].i_nr_extents);
+        if (!extents)
+            continue;
+        files[ilog2(extents)]++;
+        nr_files++;
+        nr_extents += extents;
+        nr_blocks += READ_ONCE(sb_info->inode_table[ino].i_blocks);
+        largest = max(largest, extents);
+    }
+
+    // Average in hundredths
+    avg = nr_files ? div64_u64(nr_extents * 100, nr_files) : 0;
+    seq_printf(m, "files %llu blocks %llu extents %llu avg %llu.%02llu largest %u\n",
+               nr_files, nr_blocks, nr_extents, avg / 100, avg % 100, largest);
+    for (b = 0; b < 32; b++) {
+        if (files[b])
+            seq_printf(m, "  %llu %llu\n", 1ULL << b, files[b]);
+    }
+}
+
+/**
+ * Function: osfs_frag_show
+ * Description: Prints the fragmentation of a mount: free space, files, then
+ *              the allocator counters, which are reset with the stats file.
+ *              The allocator line counts allocations by how their run was
+ *              found and the blocks wanted and obtained; it is followed by the
+ *              allocations per number of free runs their search examined.
+ * Inputs:
+ *   - m: The seq_file.
+ *   - v: Unused.
+ * Returns:
+ *   - 0.
+ */
+static int osfs_frag_show(struct seq_file *m, void *v)
+{
+    struct osfs_sb_info *sb_info = m->private;
+    u64 alloc[OSFS_NR_ALLOC_RESULTS] = {0}, runs[OSFS_ALLOC_SCAN_RUNS + 1] = {0};
+    u64 wanted = 0, got = 0;
+    struct osfs_stats *s;
+    unsigned int i;
+    int cpu;
+
+    osfs_frag_show_free(m, sb_info);
+    osfs_frag_show_files(m, sb_info);
+
+    for_each_possible_cpu(cpu) {
+        s = per_cpu_ptr(sb_info->stats, cpu);
+        for (i = 0; i < OSFS_NR_ALLOC_RESULTS; i++)
+            alloc[i] += READ_ONCE(s->alloc[i]);
+        for (i = 0; i <= OSFS_ALLOC_SCAN_RUNS; i++)
+            runs[i] += READ_ONCE(s->alloc_runs[i]);
+        wanted += READ_ONCE(s->alloc_wanted);
+        got += READ_ONCE(s->alloc_got);
+    }
+
+    seq_puts(m, "alloc");
+    for (i = 0; i < OSFS_NR_ALLOC_RESULTS; i++)
+        seq_printf(m, " %s %llu", osfs_alloc_names[i], alloc[i]);
+    seq_printf(m, " wanted %llu got %llu\n", wanted, got);
+    for (i = 0; i <= OSFS_ALLOC_SCAN_RUNS; i++) {
+        if (runs[i])
+            seq_printf(m, "  %u %llu\n", i, runs[i]);
+    }
+    return 0;
+}
+
+static int osfs_frag_open(struct inode *inode, struct file *file)
+{
+    return single_open(file, osfs_frag_show, inode->i_private);
+}
+
+static const struct file_operations osfs_frag_fops = {
+    .owner = THIS_MODULE,
+    .open = osfs_frag_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+/**
+ * Function: osfs_stats_init
+ * Description: Allocates the statistics of a new mount and publishes them in
+ *              debugfs. A missing debugfs only hides them.
+ * Inputs:
+ *   - sb: The superblock, with s_fs_info set.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if the counters cannot be allocated.
+ */
+int osfs_stats_init(struct super_block *sb)
+{
+    struct osfs_sb_info *sb_info = sb->s_fs_info;
+    char name[32];
+
+    sb_info->stats = alloc_percpu(struct osfs_stats);
+    if (!sb_info->stats)
+        return -ENOMEM;
+
+    snprintf(name, sizeof(name), "%u:%u", MAJOR(sb->s_dev), MINOR(sb->s_dev));
+    sb_info->debugfs_dir = debugfs_create_dir(name, osfs_debugfs_root);
+    debugfs_create_file("stats", 0600, sb_info->debugfs_dir, sb_info, &osfs_stats_fops);
+    debugfs_create_file("frag", 0400, sb_info->debugfs_dir, sb_info, &osfs_frag_fops);
+    return 0;
+}
+
+/**
+ * Function: osfs_stats_destroy
+ * Description: Removes the statistics of a mount going away.
+ * Inputs:
+ *   - sb_info: The superblock information of the filesystem.
+ * Returns:
+ *   - None.
+ */
+void osfs_stats_destroy(struct osfs_sb_info *sb_info)
+{
+    debugfs_remove(sb_info->debugfs_dir);
+    free_percpu(sb_info->stats);
+}
+
+/**
+ * Function: osfs_init_debugfs
+ * Description: Creates the osfs directory of debugfs, under which mounts put
+ *              their statistics.
+ * Inputs:
+ *   - None.
+ * Returns:
+ *   - None.
+ */
+void osfs_init_debugfs(void)
+{
+    osfs_debugfs_root = debugfs_create_dir("osfs", NULL);
+}
+
+/**
+ * Function: osfs_exit_debugfs
+ * Description: Removes the osfs directory of debugfs.
+ * Inputs:
+ *   - None.
+ * Returns:
+ *   - None.
+ */
+void osfs_exit_debugfs(void)
+{
+    debugfs_remove(osfs_debugfs_root);
+}
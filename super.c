@@ -1,91 +1,353 @@
 #include <linux/fs.h>
+#include <linux/fs_context.h>
+#include <linux/log2.h>
 #include <linux/pagemap.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
+#include <linux/statfs.h>
 #include "osfs.h"
 
+/**
+ * Function: osfs_show_options
+ * Description: Prints the geometry of a mounted filesystem in /proc/mounts.
+ * Inputs:
+ *   - m: The seq_file to print into.
+ *   - root: The root dentry of the mount.
+ * Returns:
+ *   - 0.
+ */
+static int osfs_show_options(struct seq_file *m, struct dentry *root)
+{
+    struct osfs_sb_info *sb_info = root->d_sb->s_fs_info;
+
+    seq_printf(m, ",size=%llu", (unsigned long long)sb_info->block_count << sb_info->block_bits);
+    seq_printf(m, ",nr_inodes=%u", sb_info->inode_count);
+    seq_printf(m, ",block_size=%u", sb_info->block_size);
+    if (sb_info->numa != OSFS_NUMA_OFF)
+        seq_printf(m, ",numa=%s", sb_info->numa == OSFS_NUMA_LOCAL ? "local" : "interleave");
+    return 0;
+}
+
+/**
+ * Function: osfs_statfs
+ * Description: Reports filesystem usage. Free blocks and inodes come from the
+ *              percpu counters the allocators keep, so no bitmap is scanned;
+ *              blocks held in preallocation windows count as free, since
+ *              allocations that run out take them back.
+ * Inputs:
+ *   - dentry: A dentry of the filesystem.
+ *   - buf: The statistics to fill in.
+ * Returns:
+ *   - 0.
+ */
+static int osfs_statfs(struct dentry *dentry, struct kstatfs *buf)
+{
+    struct super_block *sb = dentry->d_sb;
+    struct osfs_sb_info *sb_info = sb->s_fs_info;
+
+    buf->f_type = sb->s_magic;
+    buf->f_bsize = sb_info->block_size;
+    buf->f_frsize = sb_info->block_size;
+    buf->f_blocks = sb_info->block_count;
+    buf->f_bfree = percpu_counter_sum_positive(&sb_info->nr_free_blocks) +
+                   percpu_counter_sum_positive(&sb_info->nr_prealloc_blocks);
+    buf->f_bavail = buf->f_bfree;
+    buf->f_files = sb_info->inode_count - 1; // Inode 0 is never used
+    buf->f_ffree = percpu_counter_sum_positive(&sb_info->nr_free_inodes);
+    buf->f_namelen = MAX_FILENAME_LEN;
+    buf->f_fsid = u64_to_fsid(huge_encode_dev(sb->s_dev));
+    return 0;
+}
+
+static struct kmem_cache *osfs_inode_cachep;
+
+/**
+ * Function: osfs_alloc_inode
+ * Description: Allocates an in-core inode from osfs_inode_cachep.
+ * Inputs:
+ *   - sb: The superblock the inode belongs to.
+ * Returns:
+ *   - The VFS inode embedded in the new osfs_inode_info on success.
+ *   - NULL if memory allocation fails.
+ */
+static struct inode *osfs_alloc_inode(struct super_block *sb)
+{
+    struct osfs_inode_info *info;
+
+    info = alloc_inode_sb(sb, osfs_inode_cachep, GFP_KERNEL);
+    if (!info)
+        return NULL;
+    info->i_dir_index = NULL;
+    info->i_disksize = 0;
+    return &info->vfs_inode;
+}
+
+/**
+ * Function: osfs_free_inode
+ * Description: Returns an in-core inode to osfs_inode_cachep, after the RCU
+ *              grace period that follows its eviction.
+ * Inputs:
+ *   - inode: The inode to free.
+ * Returns:
+ *   - None.
+ */
+static void osfs_free_inode(struct inode *inode)
+{
+    kmem_cache_free(osfs_inode_cachep, OSFS_I(inode));
+}
+
+static void osfs_inode_init_once(void *obj)
+{
+    struct osfs_inode_info *info = obj;
+
+    init_rwsem(&info->i_extent_sem);
+    inode_init_once(&info->vfs_inode);
+}
+
+/**
+ * Function: osfs_init_inodecache
+ * Description: Creates the slab cache in-core inodes are allocated from.
+ * Inputs:
+ *   - None.
+ * Returns:
+ *   - 0 on success.
+ *   - -ENOMEM if the cache cannot be created.
+ */
+int osfs_init_inodecache(void)
+{
+    osfs_inode_cachep = kmem_cache_create("osfs_inode_cache", sizeof(struct osfs_inode_info), 0,
+                                          SLAB_RECLAIM_ACCOUNT | SLAB_ACCOUNT,
+                                          osfs_inode_init_once);
+    return osfs_inode_cachep ? 0 : -ENOMEM;
+}
+
+/**
+ * Function: osfs_destroy_inodecache
+ * Description: Destroys the in-core inode cache once every inode freed through
+ *              RCU has been returned to it.
+ * Inputs:
+ *   - None.
+ * Returns:
+ *   - None.
+ */
+void osfs_destroy_inodecache(void)
+{
+    rcu_barrier();
+    kmem_cache_destroy(osfs_inode_cachep);
+}
+
+/**
+ * Function: osfs_sync_fs
+ * Description: Makes the changes to an image durable by committing the running
+ *              journal transaction, with the dirty data blocks it references.
+ *              Memory mode has nothing to write.
+ * Inputs:
+ *   - sb: The superblock to sync.
+ *   - wait: Whether the caller waits for the data to be durable (ignored,
+ *           commits are always waited on).
+ * Returns:
+ *   - 0 on success, a negative error code on I/O failure.
+ */
+static int osfs_sync_fs(struct super_block *sb, int wait)
+{
+    return osfs_journal_commit(sb->s_fs_info);
+}
+
+/**
+ * Function: osfs_put_super
+ * Description: Checkpoints an image one last time at unmount and marks it clean.
+ * Inputs:
+ *   - sb: The superblock being torn down.
+ * Returns:
+ *   - None.
+ */
+static void osfs_put_super(struct super_block *sb)
+{
+    osfs_journal_cancel(sb->s_fs_info);
+    if (sb->s_bdev && osfs_image_sync(sb, OSFS_STATE_CLEAN))
+        pr_err("osfs_put_super: failed to write back the image\n");
+}
+
 /**
  * Struct: osfs_super_ops
  * Description: Defines the superblock operations for the osfs filesystem.
  */
 const struct super_operations osfs_super_ops = {
-    .statfs = simple_statfs,            // Provides filesystem statistics
-    .drop_inode = generic_delete_inode, // Generic inode deletion
-    .destroy_inode = osfs_destroy_inode,
-
+    .statfs = osfs_statfs,              // Provides filesystem statistics
+    .show_options = osfs_show_options,  // Reports the effective mount options
+    .alloc_inode = osfs_alloc_inode,
+    .free_inode = osfs_free_inode,
+    .drop_inode = generic_drop_inode,   // Keep unused linked inodes cached for osfs_iget
+    .evict_inode = osfs_evict_inode,
+    .sync_fs = osfs_sync_fs,            // Commits the journal of an image
+    .put_super = osfs_put_super,        // Marks an image clean at unmount
 };
 
-void osfs_destroy_inode(struct inode *inode)
+/**
+ * Function: osfs_evict_inode
+ * Description: Drops the page cache of an inode leaving memory. Dirty folios of
+ *              a live file are written back first, since the data blocks are
+ *              the only other copy of the data. Any preallocation window left
+ *              over is released, and so is the name index of a directory.
+ *              An inode whose last link is gone is freed with its blocks. No
+ *              journal handle is taken: a commit may be waiting for this
+ *              eviction to pin the inode, and the single inode record it then
+ *              copies is consistent on its own.
+ * Inputs:
+ *   - inode: The inode being evicted.
+ * Returns:
+ *   - None.
+ */
+void osfs_evict_inode(struct inode *inode)
 {
-    if (inode->i_private) {
-        inode->i_private = NULL;
+    struct osfs_sb_info *sb_info = inode->i_sb->s_fs_info;
+    struct osfs_inode *osfs_inode = inode->i_private;
+
+    if (inode->i_nlink)
+        filemap_write_and_wait(inode->i_mapping);
+    truncate_inode_pages_final(&inode->i_data);
+    if (S_ISREG(inode->i_mode) && osfs_inode) {
+        down_write(&OSFS_I(inode)->i_extent_sem);
+        osfs_extent_discard_prealloc(sb_info, osfs_inode);
+        up_write(&OSFS_I(inode)->i_extent_sem);
     }
+    if (S_ISDIR(inode->i_mode))
+        osfs_dir_index_free(inode);
+
+    // Placeholders that were never set up have no osfs inode
+    if (!inode->i_nlink && osfs_inode && !is_bad_inode(inode)) {
+        down_write(&OSFS_I(inode)->i_extent_sem);
+        osfs_extent_free_all(sb_info, osfs_inode);
+        memset(osfs_inode, 0, sizeof(*osfs_inode));
+        memset(osfs_get_inode_meta(inode->i_sb, inode->i_ino), 0,
+               sizeof(struct osfs_inode_meta));
+        up_write(&OSFS_I(inode)->i_extent_sem);
+        // The cleared entry must be visible before the number can be reused
+        osfs_put_free_inode(sb_info, inode->i_ino);
+        osfs_journal_inode(sb_info, inode->i_ino);
+    }
+    clear_inode(inode);
 }
 
 
 /**
- * Function: osfs_fill_super
- * Description: Initializes the superblock with filesystem-specific information during mount.
+ * Function: osfs_setup_super
+ * Description: Allocates the in-memory metadata of a filesystem with the given
+ *              geometry, all of it zeroed and charged to the memory cgroup of
+ *              the mounting task, and attaches it to the superblock.
+ *              Memory for data blocks is only allocated as they are used.
+ *              With a numa= placement the metadata lives on the node of the
+ *              mounting task, whatever its memory policy.
  * Inputs:
- *   - sb: The superblock to be filled.
- *   - data: Data passed during mount.
- *   - silent: If non-zero, suppress certain error messages.
+ *   - sb: The superblock being filled.
+ *   - block_size: The size of each data block.
+ *   - inode_count: The number of inodes, including the unused inode 0.
+ *   - block_count: The number of data blocks.
+ *   - numa: The placement of the data pages.
  * Returns:
- *   - 0 on successful initialization.
- *   - A negative error code on failure.
+ *   - 0 on success; from here on osfs_kill_superblock frees everything.
+ *   - -ENOMEM if memory allocation fails.
  */
-int osfs_fill_super(struct super_block *sb, void *data, int silent)
+int osfs_setup_super(struct super_block *sb, uint32_t block_size, uint32_t inode_count,
+                     uint32_t block_count, enum osfs_numa numa)
 {
-    pr_info("osfs: Filling super start\n");
-    struct inode *root_inode;
     struct osfs_sb_info *sb_info;
     void *memory_region;
     size_t total_memory_size;
+    size_t inode_bitmap_size, block_bitmap_size, block_summary_size, inode_table_offset;
+    uint32_t block_bits = ilog2(block_size);
+
+    inode_bitmap_size = BITMAP_SIZE(inode_count) * sizeof(unsigned long);
+    block_bitmap_size = BITMAP_SIZE(block_count) * sizeof(unsigned long);
+    block_summary_size = BITMAP_SIZE(BITMAP_SIZE(block_count)) * sizeof(unsigned long);
 
-    // Calculate total memory size required
-    total_memory_size = sizeof(struct osfs_sb_info) +
-                        INODE_BITMAP_SIZE * sizeof(unsigned long) +
-                        BLOCK_BITMAP_SIZE * sizeof(unsigned long) +
-                        INODE_COUNT * sizeof(struct osfs_inode) +
-                        DATA_BLOCK_COUNT * BLOCK_SIZE;
+    // Calculate total memory size required; data blocks are populated lazily.
+    // The hot inode table starts on a cache line, the cold half follows it.
+    inode_table_offset = ALIGN(sizeof(struct osfs_sb_info) +
+                               inode_bitmap_size +
+                               block_bitmap_size +
+                               block_summary_size, SMP_CACHE_BYTES);
+    total_memory_size = inode_table_offset +
+                        (size_t)inode_count * sizeof(struct osfs_inode) +
+                        (size_t)inode_count * sizeof(struct osfs_inode_meta);
 
-    // Allocate memory for superblock information and related structures
-    memory_region = vmalloc(total_memory_size);
+    // Allocate memory for superblock information and related structures,
+    // charged to the mounting task as mounts need no privilege
+    memory_region = kvzalloc_node(total_memory_size, GFP_KERNEL_ACCOUNT,
+                                  numa != OSFS_NUMA_OFF ? numa_node_id() : NUMA_NO_NODE);
     if (!memory_region)
         return -ENOMEM;
 
-    memset(memory_region, 0, total_memory_size);
-
     // Initialize superblock information
     sb_info = (struct osfs_sb_info *)memory_region;
     sb_info->magic = OSFS_MAGIC;
-    sb_info->block_size = BLOCK_SIZE;
-    sb_info->inode_count = INODE_COUNT;
-    sb_info->block_count = DATA_BLOCK_COUNT;
-    sb_info->nr_free_inodes = INODE_COUNT - 1;
-    sb_info->nr_free_blocks = DATA_BLOCK_COUNT;
+    sb_info->block_size = block_size;
+    sb_info->block_bits = block_bits;
+    sb_info->inode_count = inode_count;
+    sb_info->block_count = block_count;
+    spin_lock_init(&sb_info->alloc_lock);
 
     // Partition the memory region into respective components
     sb_info->inode_bitmap = (unsigned long *)(sb_info + 1);
-    sb_info->block_bitmap = sb_info->inode_bitmap + INODE_BITMAP_SIZE;
-    sb_info->inode_table = (void *)(sb_info->block_bitmap + BLOCK_BITMAP_SIZE);
-    sb_info->data_blocks = (void *)((char *)sb_info->inode_table +
-                                    INODE_COUNT * sizeof(struct osfs_inode));
+    sb_info->block_bitmap = (unsigned long *)((char *)sb_info->inode_bitmap + inode_bitmap_size);
+    sb_info->block_summary = (unsigned long *)((char *)sb_info->block_bitmap + block_bitmap_size);
+    sb_info->inode_table = (struct osfs_inode *)((char *)memory_region + inode_table_offset);
+    sb_info->inode_meta = (struct osfs_inode_meta *)(sb_info->inode_table + sb_info->inode_count);
+    xa_init(&sb_info->data_pages);
+    xa_init(&sb_info->inline_data);
 
-    // Initialize bitmaps
-    memset(sb_info->inode_bitmap, 0, INODE_BITMAP_SIZE * sizeof(unsigned long));
-    memset(sb_info->block_bitmap, 0, BLOCK_BITMAP_SIZE * sizeof(unsigned long));
+    // Inode 0 is never used, 1 is the root
+    if (percpu_counter_init(&sb_info->nr_free_inodes, sb_info->inode_count - 2, GFP_KERNEL)) {
+        kvfree(memory_region);
+        return -ENOMEM;
+    }
+    if (percpu_counter_init(&sb_info->nr_free_blocks, sb_info->block_count, GFP_KERNEL)) {
+        percpu_counter_destroy(&sb_info->nr_free_inodes);
+        kvfree(memory_region);
+        return -ENOMEM;
+    }
+    if (percpu_counter_init(&sb_info->nr_prealloc_blocks, 0, GFP_KERNEL)) {
+        percpu_counter_destroy(&sb_info->nr_free_blocks);
+        percpu_counter_destroy(&sb_info->nr_free_inodes);
+        kvfree(memory_region);
+        return -ENOMEM;
+    }
 
-    // Set superblock fields
+    // Set superblock fields; from here on osfs_kill_superblock frees the region
     sb->s_magic = sb_info->magic;
     sb->s_fs_info = sb_info;
     sb->s_op = &osfs_super_ops;
+    sb->s_max_links = U16_MAX;           // i_links_count is 16 bits wide
+    sb->s_blocksize = sb_info->block_size;
+    sb->s_blocksize_bits = sb_info->block_bits;
+    sb->s_maxbytes = min_t(loff_t, MAX_LFS_FILESIZE, (loff_t)U32_MAX << block_bits);
+
+    // Writeback of dirty page cache folios needs a real bdi; a device brings its own
+    if (!sb->s_bdev && super_setup_bdi(sb))
+        return -ENOMEM;
+    if (osfs_numa_init(sb_info, numa))
+        return -ENOMEM;
+    return osfs_stats_init(sb);
+}
+
+/**
+ * Function: osfs_make_root
+ * Description: Creates the root directory of a new filesystem.
+ * Inputs:
+ *   - sb: The superblock, set up by osfs_setup_super.
+ * Returns:
+ *   - 0 on success.
+ *   - A negative error code on failure.
+ */
+int osfs_make_root(struct super_block *sb)
+{
+    struct osfs_sb_info *sb_info = sb->s_fs_info;
+    struct inode *root_inode;
 
     // Create root directory inode
     root_inode = new_inode(sb);
-    if (!root_inode) {
-        vfree(memory_region);
+    if (!root_inode)
         return -ENOMEM;
-    }
 
     root_inode->i_ino = ROOT_INODE;
     root_inode->i_sb = sb;
@@ -95,36 +357,69 @@ int osfs_fill_super(struct super_block *sb, void *data, int silent)
     set_nlink(root_inode, 2);
     simple_inode_init_ts(root_inode);
     
-    // Initialize root directory's osfs_inode
+    // Initialize root directory's osfs_inode; the table is still zeroed
     struct osfs_inode *root_osfs_inode = osfs_get_osfs_inode(sb, ROOT_INODE);
-    if (!root_osfs_inode) {
+    struct osfs_inode_meta *root_meta = osfs_get_inode_meta(sb, ROOT_INODE);
+    if (!root_osfs_inode || !root_meta) {
         iput(root_inode);
-        vfree(memory_region);
         return -EIO;
     }
-    memset(root_osfs_inode, 0, sizeof(*root_osfs_inode));
 
-    root_osfs_inode->i_ino = ROOT_INODE;
     root_osfs_inode->i_mode = root_inode->i_mode;
     root_osfs_inode->i_links_count = 2;
-    root_osfs_inode->__i_atime = root_osfs_inode->__i_mtime = root_osfs_inode->__i_ctime = current_time(root_inode);
+    root_meta->i_ino = ROOT_INODE;
+    root_meta->__i_atime = root_meta->__i_mtime = root_meta->__i_ctime = current_time(root_inode);
     root_inode->i_private = root_osfs_inode;
+    insert_inode_hash(root_inode);
 
     // Mark root directory inode as used
     set_bit(ROOT_INODE, sb_info->inode_bitmap);
-    // Mark the first data block as used
-    set_bit(0, sb_info->block_bitmap);
 
     // Update root directory size
     root_inode->i_size = 0;
     inode_init_owner(&nop_mnt_idmap, root_inode, NULL, root_inode->i_mode);
-    // Set the root directory
+    root_meta->i_uid = i_uid_read(root_inode);
+    root_meta->i_gid = i_gid_read(root_inode);
+    // Set the root directory (d_make_root drops the inode on failure)
     sb->s_root = d_make_root(root_inode);
-    if (!sb->s_root) {
-        iput(root_inode);
-        vfree(memory_region);
+    if (!sb->s_root)
         return -ENOMEM;
-    }
-    pr_info("osfs: Superblock filled successfully \n");
+    return 0;
+}
+
+/**
+ * Function: osfs_fill_super
+ * Description: Initializes the superblock with filesystem-specific information during mount.
+ *              The bitmaps and inode table are sized from the mount options; memory
+ *              for data blocks is only allocated as they are written. With the
+ *              restore option everything comes from a snapshot instead.
+ * Inputs:
+ *   - sb: The superblock to be filled.
+ *   - fc: The filesystem context carrying the parsed mount options.
+ * Returns:
+ *   - 0 on successful initialization.
+ *   - A negative error code on failure.
+ */
+int osfs_fill_super(struct super_block *sb, struct fs_context *fc)
+{
+    struct osfs_fs_context *ctx = fc->fs_private;
+    uint32_t block_bits = ilog2(ctx->block_size);
+    uint64_t block_count;
+    int ret;
+
+    if (ctx->restore)
+        return osfs_image_restore(sb, fc);
+
+    block_count = ctx->size ? ctx->size >> block_bits : OSFS_DEFAULT_BLOCK_COUNT;
+    if (block_count == 0 || block_count > U32_MAX)
+        return invalfc(fc, "size must hold between 1 and %u blocks", U32_MAX);
+
+    ret = osfs_setup_super(sb, ctx->block_size, ctx->nr_inodes, block_count, ctx->numa);
+    if (ret)
+        return ret;
+
+    ret = osfs_make_root(sb);
+    if (ret)
+        return ret;
     return 0;
 }